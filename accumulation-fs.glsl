@@ -0,0 +1,48 @@
+#version 330
+
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Temporal accumulation of jittered samples; see Renderer::accumulate().
+ * The colors of all samples so far are summed up in the texture 'sums', and
+ * the colors of the new sample are in the texture 'colors'. */
+
+uniform sampler2D sums;
+uniform sampler2D colors;
+uniform int samples;    // the number of samples in 'sums'
+// 0: output the new colors, to be added to the sums by blending
+// 1: keep only pixels whose average changes visibly with the new colors
+// 2: output the average of the sums
+uniform int mode;
+
+layout(location = 0) out vec4 fcolor;
+
+void main(void)
+{
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    if (mode == 2) {
+        fcolor = texelFetch(sums, p, 0) / float(samples);
+    } else {
+        vec4 c = texelFetch(colors, p, 0);
+        if (mode == 1) {
+            vec3 change = abs(c.rgb - texelFetch(sums, p, 0).rgb / float(samples)) / float(samples + 1);
+            if (all(lessThan(change, vec3(0.5 / 255.0))))
+                discard;
+        }
+        fcolor = c;
+    }
+}
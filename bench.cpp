@@ -0,0 +1,621 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* glfract-bench: measure rendering performance.
+ *
+ * A fixed set of scenes is rendered with every backend (cpu, cpu-generic, and
+ * gl and gl-fragment if an OpenGL 3.3 core context can be created) and every
+ * precision type. The cpu-generic backend uses the generic CPU kernel for all
+ * powers instead of the specialized kernels, and the gl-fragment backend uses
+ * the fragment shader even if the compute shader is available, to show the
+ * gain of the specialized kernels and of the compute shader. Additional scenes
+ * can be given as .fract files. For each combination, the frame times of
+ * several frames are measured after one warm-up frame, and the results are
+ * written as JSON:
+ *   { "width": ..., "height": ..., "frames": ..., "threads": ...,
+ *     "gl_renderer": ..., "gl_compute_shader": ...,
+ *     "results": [ { "scene": ..., "backend": ..., "precision": ..., "max_iter": ...,
+ *                    "mpixels_per_second": ..., "giterations_per_second": ...,
+ *                    "iterations_per_pixel": ...,
+ *                    "frame_time_ms": { "min", "p50", "p90", "p99", "max" } }, ... ] }
+ * Rates are based on the median frame time. Iterations are counted from the
+ * rendered values, so they are exact for non-smooth and very close for smooth
+ * coloring.
+ *
+ * With --accuracy, the precision types are compared against a fixed-point
+ * CPU reference (see Engine::render_fixed()) instead. One scene (the center
+ * of the deep scenes, or the first .fract file) is rendered at increasing
+ * zoom depths without smooth coloring, with the maximum number of iterations
+ * growing with the zoom depth. The error is the fraction of pixels whose
+ * iteration count differs from the reference counts of the pixel and all its
+ * neighbors; this ignores sub-pixel offsets of sample positions but catches
+ * diverging orbits and blocky images. For each backend and precision, the
+ * first zoom at which the error exceeds the threshold is reported together
+ * with the cost:
+ *   { ..., "results": [ { "backend": ..., "precision": ..., "breakdown_zoom": ...,
+ *                         "mpixels_per_second": ...,
+ *                         "depths": [ { "zoom": ..., "max_iter": ..., "error": ...,
+ *                                       "frame_time_ms": ... }, ... ] }, ... ] }
+ *
+ * With --load=N, the time to load N scenes (the selected scenes repeated) is
+ * measured instead, once from N .fract files and once from one binary scene
+ * file (see SceneFile):
+ *   { "frames": ..., "results": [ { "format": ..., "scenes": ..., "bytes": ...,
+ *                                   "scenes_per_second": ...,
+ *                                   "load_time_ms": { "min", "p50", "max" } }, ... ] } */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include <getopt.h>
+
+#include <QString>
+#include <QStringList>
+#include <QFileInfo>
+#include <QElapsedTimer>
+#include <QTemporaryDir>
+#include <QGuiApplication>
+
+#include <quadmath.h>
+
+#include "state.hpp"
+#include "scenefile.hpp"
+#include "engine.hpp"
+#include "renderer.hpp"
+
+
+class Scene
+{
+public:
+    QString name;
+    State state;
+};
+
+static Scene make_scene(const char* name, const char* x, const char* y, const char* zoom, int max_iter)
+{
+    Scene scene;
+    scene.name = name;
+    scene.state.navigation.x = strtoflt128(x, 0);
+    scene.state.navigation.y = strtoflt128(y, 0);
+    scene.state.navigation.zoom = strtoflt128(zoom, 0);
+    scene.state.fractal.mandelbrot.max_iter = max_iter;
+    return scene;
+}
+
+// The center of the deep zoom scenes
+static const char* deep_x = "-0.743643887037158704752191506114774";
+static const char* deep_y = "0.131825904205311970493132056385139";
+
+// The canonical scenes. The deep zooms target the limits of the precision
+// tiers: float, double and emulated double-float, and emulated double-double.
+static std::vector<Scene> canonical_scenes()
+{
+    std::vector<Scene> scenes;
+    Scene def;
+    def.name = "default";
+    scenes.push_back(def);
+    scenes.push_back(make_scene("seahorse", "-0.7453", "0.1127", "300", 1000));
+    scenes.push_back(make_scene("interior", "-0.25", "0.0", "2.5", 1000));
+    scenes.push_back(make_scene("deep-float", deep_x, deep_y, "1e4", 2000));
+    scenes.push_back(make_scene("deep-double", deep_x, deep_y, "1e12", 5000));
+    scenes.push_back(make_scene("deep-doubledouble", deep_x, deep_y, "1e26", 10000));
+    return scenes;
+}
+
+static const char* precision_name(precision_type_t p)
+{
+    switch (p) {
+    case precision_native_float:
+        return "native_float";
+    case precision_native_double:
+        return "native_double";
+    case precision_emu_doublefloat:
+        return "emu_doublefloat";
+    case precision_emu_doubledouble:
+        return "emu_doubledouble";
+    }
+    return "";
+}
+
+// The number of iterations that produced a normalized value; see fractal.glsl
+static double iterations(const std::vector<float>& values, int max_iter)
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < values.size(); i++) {
+        if (values[i] > 0.0f)
+            sum += std::ceil(values[i] * (max_iter - 1) - 1e-3f);
+        else
+            sum += max_iter;
+    }
+    return sum;
+}
+
+static QString json_string(QString s)
+{
+    s.replace("\\", "\\\\");
+    s.replace("\"", "\\\"");
+    return "\"" + s + "\"";
+}
+
+// Iteration counts from normalized values
+static std::vector<int> iteration_counts(const std::vector<float>& values, int max_iter)
+{
+    std::vector<int> counts(values.size());
+    for (size_t i = 0; i < values.size(); i++)
+        counts[i] = (values[i] > 0.0f ? std::lround(values[i] * (max_iter - 1)) : max_iter);
+    return counts;
+}
+
+// The fraction of pixels whose count matches none of the reference counts in
+// their 3x3 neighborhood
+static double count_error(const std::vector<int>& counts, const std::vector<int>& reference, int w, int h)
+{
+    size_t wrong = 0;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            int c = counts[static_cast<size_t>(y) * w + x];
+            bool match = false;
+            for (int ry = std::max(y - 1, 0); !match && ry <= std::min(y + 1, h - 1); ry++)
+                for (int rx = std::max(x - 1, 0); !match && rx <= std::min(x + 1, w - 1); rx++)
+                    match = (c == reference[static_cast<size_t>(ry) * w + rx]);
+            if (!match)
+                wrong++;
+        }
+    }
+    return static_cast<double>(wrong) / counts.size();
+}
+
+static double percentile(const std::vector<double>& sorted, double q)
+{
+    int i = std::ceil(q * sorted.size()) - 1;
+    return sorted[std::min(std::max(i, 0), static_cast<int>(sorted.size()) - 1)];
+}
+
+// Render with the gl backend if the renderer is not NULL, otherwise with the cpu backend
+static void render(const State& state, int w, int h, const Engine& engine, Renderer* renderer, float* values)
+{
+    if (renderer)
+        renderer->render_iterations(state, w, h, 0, 0, w, h, values);
+    else
+        engine.render(state, w, h, values);
+}
+
+// Whether a precision is not available with a backend
+static bool unavailable(Renderer* renderer, precision_type_t precision)
+{
+    return (renderer && !renderer->have_arb_gpu_shader_fp64
+            && (precision == precision_native_double || precision == precision_emu_doubledouble));
+}
+
+static void benchmark(FILE* f, const std::vector<Scene>& scenes, const QStringList& backends,
+        const QStringList& precisions, int width, int height, int frames,
+        const Engine& engine, const Engine& generic_engine, Renderer* renderer)
+{
+    std::vector<float> values(static_cast<size_t>(width) * height);
+    bool first_result = true;
+    for (size_t s = 0; s < scenes.size(); s++) {
+        for (int b = 0; b < backends.size(); b++) {
+            Renderer* backend_renderer = (backends[b].startsWith("gl") ? renderer : NULL);
+            if (backend_renderer)
+                backend_renderer->set_compute_shader(backends[b] == "gl");
+            const Engine& backend_engine = (backends[b] == "cpu-generic" ? generic_engine : engine);
+            for (int p = precision_native_float; p <= precision_emu_doubledouble; p++) {
+                precision_type_t precision = static_cast<precision_type_t>(p);
+                if ((!precisions.isEmpty() && !precisions.contains(precision_name(precision)))
+                        || unavailable(backend_renderer, precision))
+                    continue;
+                State state = scenes[s].state;
+                state.precision.type = precision;
+                fprintf(stderr, "%s %s %s ...", qPrintable(scenes[s].name), qPrintable(backends[b]),
+                        precision_name(precision));
+                std::vector<double> frame_times;
+                for (int i = -1; i < frames; i++) { // frame -1 is for warm-up
+                    QElapsedTimer timer;
+                    timer.start();
+                    render(state, width, height, backend_engine, backend_renderer, values.data());
+                    if (i >= 0)
+                        frame_times.push_back(timer.nsecsElapsed() / 1e6);
+                }
+                std::sort(frame_times.begin(), frame_times.end());
+                double p50 = percentile(frame_times, 0.5);
+                double iter = iterations(values, state.fractal.mandelbrot.max_iter);
+                fprintf(stderr, " %.2f ms\n", p50);
+                fprintf(f, "%s\n    {\n", first_result ? "" : ",");
+                first_result = false;
+                fprintf(f, "      \"scene\": %s,\n", qPrintable(json_string(scenes[s].name)));
+                fprintf(f, "      \"backend\": \"%s\",\n", qPrintable(backends[b]));
+                fprintf(f, "      \"precision\": \"%s\",\n", precision_name(precision));
+                fprintf(f, "      \"max_iter\": %d,\n", state.fractal.mandelbrot.max_iter);
+                fprintf(f, "      \"mpixels_per_second\": %.6g,\n", values.size() / (p50 * 1e3));
+                fprintf(f, "      \"giterations_per_second\": %.6g,\n", iter / (p50 * 1e6));
+                fprintf(f, "      \"iterations_per_pixel\": %.6g,\n", iter / values.size());
+                fprintf(f, "      \"frame_time_ms\": { \"min\": %.6g, \"p50\": %.6g, \"p90\": %.6g, \"p99\": %.6g, \"max\": %.6g }\n",
+                        frame_times.front(), p50, percentile(frame_times, 0.9), percentile(frame_times, 0.99),
+                        frame_times.back());
+                fprintf(f, "    }");
+            }
+        }
+    }
+}
+
+static void accuracy(FILE* f, const State& scene, const QStringList& backends,
+        const QStringList& precisions, int width, int height, double max_zoom, double zoom_step,
+        float threshold, const Engine& engine, const Engine& generic_engine, Renderer* renderer)
+{
+    State base = scene;
+    base.fractal.mandelbrot.smooth = false;
+    size_t n = static_cast<size_t>(width) * height;
+
+    // Compute the reference first; it is by far the most expensive part.
+    // Deeper zooms need more iterations to show any structure.
+    std::vector<State> states;
+    std::vector<std::vector<int>> references;
+    std::vector<float> values(n);
+    for (double zoom = 1.0; zoom <= max_zoom * 1.000001; zoom *= zoom_step) {
+        State state = base;
+        state.navigation.zoom = zoom;
+        state.fractal.mandelbrot.max_iter = std::lround(base.fractal.mandelbrot.max_iter * (1.0 + std::log10(zoom)));
+        fprintf(stderr, "reference zoom %g ...", zoom);
+        QElapsedTimer timer;
+        timer.start();
+        engine.render_fixed(state, width, height, values.data());
+        states.push_back(state);
+        references.push_back(iteration_counts(values, state.fractal.mandelbrot.max_iter));
+        fprintf(stderr, " %.2f s\n", timer.elapsed() / 1000.0);
+    }
+
+    bool first_result = true;
+    for (int b = 0; b < backends.size(); b++) {
+        Renderer* backend_renderer = (backends[b].startsWith("gl") ? renderer : NULL);
+        if (backend_renderer)
+            backend_renderer->set_compute_shader(backends[b] == "gl");
+        const Engine& backend_engine = (backends[b] == "cpu-generic" ? generic_engine : engine);
+        for (int p = precision_native_float; p <= precision_emu_doubledouble; p++) {
+            precision_type_t precision = static_cast<precision_type_t>(p);
+            if ((!precisions.isEmpty() && !precisions.contains(precision_name(precision)))
+                    || unavailable(backend_renderer, precision))
+                continue;
+            fprintf(f, "%s\n    {\n", first_result ? "" : ",");
+            first_result = false;
+            fprintf(f, "      \"backend\": \"%s\",\n", qPrintable(backends[b]));
+            fprintf(f, "      \"precision\": \"%s\",\n", precision_name(precision));
+            fprintf(f, "      \"depths\": [\n");
+            double breakdown_zoom = -1.0;
+            double total_ms = 0.0;
+            for (size_t z = 0; z < states.size(); z++) {
+                State state = states[z];
+                state.precision.type = precision;
+                render(state, width, height, backend_engine, backend_renderer, values.data()); // warm-up
+                QElapsedTimer timer;
+                timer.start();
+                render(state, width, height, backend_engine, backend_renderer, values.data());
+                double ms = timer.nsecsElapsed() / 1e6;
+                total_ms += ms;
+                double error = count_error(iteration_counts(values, state.fractal.mandelbrot.max_iter),
+                        references[z], width, height);
+                double zoom = state.navigation.zoom;
+                if (breakdown_zoom < 0.0 && error > threshold)
+                    breakdown_zoom = zoom;
+                fprintf(f, "        { \"zoom\": %g, \"max_iter\": %d, \"error\": %.6g, \"frame_time_ms\": %.6g }%s\n",
+                        zoom, state.fractal.mandelbrot.max_iter, error, ms, z + 1 < states.size() ? "," : "");
+            }
+            fprintf(f, "      ],\n");
+            if (breakdown_zoom < 0.0)
+                fprintf(f, "      \"breakdown_zoom\": null,\n");
+            else
+                fprintf(f, "      \"breakdown_zoom\": %g,\n", breakdown_zoom);
+            fprintf(f, "      \"mpixels_per_second\": %.6g\n", n * states.size() / (total_ms * 1e3));
+            fprintf(f, "    }");
+            if (breakdown_zoom < 0.0)
+                fprintf(stderr, "%s %s: error stays below %g up to zoom %g\n", qPrintable(backends[b]),
+                        precision_name(precision), threshold, static_cast<double>(states.back().navigation.zoom));
+            else
+                fprintf(stderr, "%s %s: error exceeds %g at zoom %g\n", qPrintable(backends[b]),
+                        precision_name(precision), threshold, breakdown_zoom);
+        }
+    }
+}
+
+// Load n scenes from .fract files and from a binary scene file
+static bool load(FILE* f, const std::vector<Scene>& scenes, int n, int frames)
+{
+    QTemporaryDir dir;
+    if (!dir.isValid() || scenes.empty()) {
+        fprintf(stderr, "Cannot create the scene files\n");
+        return false;
+    }
+    QStringList fract_names;
+    qint64 fract_bytes = 0;
+    QString scene_file_name = dir.filePath("scenes.fracts");
+    SceneFile scene_file;
+    bool ok = scene_file.create(scene_file_name);
+    for (int i = 0; ok && i < n; i++) {
+        const State& state = scenes[i % scenes.size()].state;
+        QString name = dir.filePath(QString("scene-%1.fract").arg(i));
+        state.save(name);
+        fract_bytes += QFileInfo(name).size();
+        fract_names << name;
+        ok = scene_file.write_scene(state);
+    }
+    if (!scene_file.close() || !ok) {
+        fprintf(stderr, "Cannot create the scene files\n");
+        return false;
+    }
+
+    const char* formats[] = { "fract", "fracts" };
+    for (int format = 0; format < 2; format++) {
+        fprintf(stderr, "%d scenes from %s ...", n, format == 0 ? ".fract files" : "a scene file");
+        std::vector<double> load_times;
+        for (int i = -1; i < frames; i++) { // run -1 is for warm-up
+            std::vector<State> states;
+            QElapsedTimer timer;
+            timer.start();
+            if (format == 0) {
+                states.resize(n);
+                for (int j = 0; j < n; j++)
+                    states[j].load(fract_names[j], true);
+            } else {
+                SceneFile::load_all(scene_file_name, states);
+            }
+            if (i >= 0)
+                load_times.push_back(timer.nsecsElapsed() / 1e6);
+        }
+        std::sort(load_times.begin(), load_times.end());
+        double p50 = percentile(load_times, 0.5);
+        fprintf(stderr, " %.2f ms\n", p50);
+        fprintf(f, "%s\n    {\n", format == 0 ? "" : ",");
+        fprintf(f, "      \"format\": \"%s\",\n", formats[format]);
+        fprintf(f, "      \"scenes\": %d,\n", n);
+        fprintf(f, "      \"bytes\": %lld,\n",
+                static_cast<long long>(format == 0 ? fract_bytes : QFileInfo(scene_file_name).size()));
+        fprintf(f, "      \"scenes_per_second\": %.6g,\n", n / (p50 / 1e3));
+        fprintf(f, "      \"load_time_ms\": { \"min\": %.6g, \"p50\": %.6g, \"max\": %.6g }\n",
+                load_times.front(), p50, load_times.back());
+        fprintf(f, "    }");
+    }
+    return true;
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [options] [scene.fract ...]\n"
+            "Options:\n"
+            "  -w, --width=W          Image width (default 640, or 128 with --accuracy)\n"
+            "  -h, --height=H         Image height (default 360, or 72 with --accuracy)\n"
+            "  -n, --frames=N         Number of measured frames (default 5)\n"
+            "  -t, --threads=T        Number of threads for the cpu backend\n"
+            "                         (default: one per core)\n"
+            "  -s, --scenes=S,...     Only the given canonical scenes (default, seahorse,\n"
+            "                         interior, deep-float, deep-double,\n"
+            "                         deep-doubledouble), or none\n"
+            "  -b, --backends=B,...   Only the given backends (cpu, cpu-generic, gl,\n"
+            "                         gl-fragment; default all but cpu-generic with\n"
+            "                         --accuracy)\n"
+            "  -p, --precisions=P,... Only the given precisions (native_float,\n"
+            "                         native_double, emu_doublefloat, emu_doubledouble)\n"
+            "  -o, --output=FILE      Write JSON to FILE instead of standard output\n"
+            "  -a, --accuracy         Measure accuracy against a fixed-point reference\n"
+            "                         instead of performance\n"
+            "  -z, --max-zoom=Z       Maximum zoom for --accuracy (default 1e30)\n"
+            "  -Z, --zoom-step=F      Zoom factor between depths for --accuracy\n"
+            "                         (default 100)\n"
+            "  -e, --threshold=E      Maximum fraction of pixels with wrong iteration\n"
+            "                         counts for --accuracy (default 0.01)\n"
+            "  -l, --load=N           Measure the time to load N scenes from .fract\n"
+            "                         files and from a binary scene file instead of\n"
+            "                         performance\n",
+            argv0);
+}
+
+int main(int argc, char* argv[])
+{
+    int width = 0;
+    int height = 0;
+    int frames = 5;
+    int threads = 0;
+    QStringList scene_names;
+    QStringList backends;
+    QStringList precisions;
+    QString output;
+    bool filter_scenes = false;
+    bool accuracy_mode = false;
+    double max_zoom = 1e30;
+    double zoom_step = 100.0;
+    float threshold = 0.01f;
+    int load_scenes = 0;
+
+    const struct option options[] = {
+        { "width",      required_argument, NULL, 'w' },
+        { "height",     required_argument, NULL, 'h' },
+        { "frames",     required_argument, NULL, 'n' },
+        { "threads",    required_argument, NULL, 't' },
+        { "scenes",     required_argument, NULL, 's' },
+        { "backends",   required_argument, NULL, 'b' },
+        { "precisions", required_argument, NULL, 'p' },
+        { "output",     required_argument, NULL, 'o' },
+        { "accuracy",   no_argument,       NULL, 'a' },
+        { "max-zoom",   required_argument, NULL, 'z' },
+        { "zoom-step",  required_argument, NULL, 'Z' },
+        { "threshold",  required_argument, NULL, 'e' },
+        { "load",       required_argument, NULL, 'l' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "w:h:n:t:s:b:p:o:az:Z:e:l:", options, NULL)) != -1) {
+        switch (c) {
+        case 'w':
+            width = atoi(optarg);
+            break;
+        case 'h':
+            height = atoi(optarg);
+            break;
+        case 'n':
+            frames = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 's':
+            scene_names = QString(optarg).split(',', Qt::SkipEmptyParts);
+            filter_scenes = true;
+            break;
+        case 'b':
+            backends = QString(optarg).split(',', Qt::SkipEmptyParts);
+            break;
+        case 'p':
+            precisions = QString(optarg).split(',', Qt::SkipEmptyParts);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'a':
+            accuracy_mode = true;
+            break;
+        case 'z':
+            max_zoom = atof(optarg);
+            break;
+        case 'Z':
+            zoom_step = atof(optarg);
+            break;
+        case 'e':
+            threshold = atof(optarg);
+            break;
+        case 'l':
+            load_scenes = atoi(optarg);
+            if (load_scenes < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (width == 0)
+        width = (accuracy_mode ? 128 : 640);
+    if (height == 0)
+        height = (accuracy_mode ? 72 : 360);
+    if (width < 1 || height < 1 || frames < 1 || threads < 0
+            || max_zoom < 1.0 || zoom_step <= 1.0 || threshold < 0.0f) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (backends.isEmpty()) {
+        backends << "cpu";
+        if (!accuracy_mode)
+            backends << "cpu-generic";
+        backends << "gl" << "gl-fragment";
+    }
+    for (int i = 0; i < backends.size(); i++) {
+        if (backends[i] != "cpu" && backends[i] != "cpu-generic"
+                && backends[i] != "gl" && backends[i] != "gl-fragment") {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Collect the scenes
+    std::vector<Scene> scenes;
+    std::vector<Scene> canonical = canonical_scenes();
+    for (size_t i = 0; i < canonical.size(); i++) {
+        if (!filter_scenes || scene_names.contains(canonical[i].name))
+            scenes.push_back(canonical[i]);
+    }
+    for (int i = optind; i < argc; i++) {
+        Scene scene;
+        scene.name = argv[i];
+        if (!QFileInfo(scene.name).isReadable()) {
+            fprintf(stderr, "%s is not readable\n", argv[i]);
+            return 1;
+        }
+        scene.state.load(scene.name, true);
+        scenes.push_back(scene);
+    }
+
+    FILE* f = stdout;
+    if (!output.isEmpty()) {
+        f = fopen(qPrintable(output), "w");
+        if (!f) {
+            fprintf(stderr, "Cannot open %s\n", qPrintable(output));
+            return 1;
+        }
+    }
+
+    if (load_scenes > 0) {
+        fprintf(f, "{\n  \"frames\": %d,\n  \"results\": [", frames);
+        bool ok = load(f, scenes, load_scenes, frames);
+        fprintf(f, "\n  ]\n}\n");
+        if (f != stdout)
+            fclose(f);
+        return ok ? 0 : 1;
+    }
+
+    // Set up the backends
+    Engine engine(threads);
+    Engine generic_engine(threads, false);
+    QGuiApplication* app = NULL;
+    OffscreenRenderer* renderer = NULL;
+    QString gl_renderer;
+    if (backends.contains("gl") || backends.contains("gl-fragment")) {
+        if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+            qputenv("QT_QPA_PLATFORM", "offscreen");
+        app = new QGuiApplication(argc, argv);
+        renderer = new OffscreenRenderer;
+        if (renderer->initialize()) {
+            gl_renderer = renderer->gl_renderer();
+        } else {
+            fprintf(stderr, "Cannot create an OpenGL 3.3 core context; skipping the gl backend\n");
+            delete renderer;
+            renderer = NULL;
+            backends.removeAll("gl");
+            backends.removeAll("gl-fragment");
+        }
+    }
+
+    fprintf(f, "{\n  \"width\": %d,\n  \"height\": %d,\n", width, height);
+    if (accuracy_mode)
+        fprintf(f, "  \"threshold\": %g,\n", threshold);
+    else
+        fprintf(f, "  \"frames\": %d,\n", frames);
+    fprintf(f, "  \"threads\": %d,\n", engine.threads());
+    if (renderer)
+        fprintf(f, "  \"gl_renderer\": %s,\n  \"gl_compute_shader\": %s,\n",
+                qPrintable(json_string(gl_renderer)), renderer->have_compute_shader ? "true" : "false");
+    else
+        fprintf(f, "  \"gl_renderer\": null,\n  \"gl_compute_shader\": false,\n");
+    fprintf(f, "  \"results\": [");
+    if (accuracy_mode) {
+        // The center of the deep scenes, or the first given scene
+        State scene = make_scene("deep", deep_x, deep_y, "1", 1000).state;
+        if (optind < argc)
+            scene = scenes[scenes.size() - (argc - optind)].state;
+        accuracy(f, scene, backends, precisions, width, height, max_zoom, zoom_step, threshold, engine, generic_engine, renderer);
+    } else {
+        benchmark(f, scenes, backends, precisions, width, height, frames, engine, generic_engine, renderer);
+    }
+    fprintf(f, "\n  ]\n}\n");
+    if (f != stdout)
+        fclose(f);
+
+    delete renderer;
+    delete app;
+    return 0;
+}
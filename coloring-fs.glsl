@@ -22,14 +22,37 @@ uniform sampler2D colormap;
 
 uniform bool reverse;
 uniform float offset;
+// Histogram equalization: the prefix sums of the histogram with the given
+// number of bins; see Equalization in coloring.hpp
+uniform bool equalize;
+uniform usampler2D histogram_sums;
+uniform int bins;
+// Whether the fractal texture has distance estimates in its second channel;
+// see fractal.glsl. Pixels closer than one pixel to the set are darkened.
+uniform bool distance_estimation;
 
 smooth in vec2 vxy;
 
 layout(location = 0) out vec4 fcolor;
 
+float equalized(float f)
+{
+    float total = float(texelFetch(histogram_sums, ivec2(bins - 1, 0), 0).r);
+    if (!(f > 0.0) || total <= 0.0)
+        return f;
+    float x = min(f, 1.0) * float(bins);
+    int b = min(int(x), bins - 1);
+    float lo = (b > 0 ? float(texelFetch(histogram_sums, ivec2(b - 1, 0), 0).r) : 0.0);
+    float hi = float(texelFetch(histogram_sums, ivec2(b, 0), 0).r);
+    return (lo + (x - float(b)) * (hi - lo)) / total;
+}
+
 void main(void)
 {
-    float f = texture2D(fractal, vxy).r;
+    vec2 fd = texture2D(fractal, vxy).rg;
+    float f = fd.r;
+    if (equalize)
+        f = equalized(f);
     if (reverse)
         f = 1.0 - f;
     float c = offset + f;
@@ -38,4 +61,6 @@ void main(void)
     else if (c < 0.0)
         c += 1.0;
     fcolor = texture2D(colormap, vec2(c, 0.5));
+    if (distance_estimation && fd.g > 0.0)
+        fcolor.rgb *= min(fd.g, 1.0);
 }
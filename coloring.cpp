@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HAVE_AVX2_GATHER 1
+# include <immintrin.h>
+#endif
+
+#include "coloring.hpp"
+
+
+double colormap_offset(const State& state, double animation_seconds)
+{
+    double offset = state.colormap.start;
+    if (state.colormap.animation) {
+        double animation_offset = (state.colormap.animation_speed / 60.0) * animation_seconds;
+        animation_offset -= std::floor(animation_offset);
+        if (state.colormap.animation_reverse)
+            offset += animation_offset;
+        else
+            offset -= animation_offset;
+    }
+    if (offset > 1.0)
+        offset -= 1.0;
+    else if (offset < 0.0)
+        offset += 1.0;
+    return offset;
+}
+
+static float srgb_to_linear(unsigned char x)
+{
+    float c = x / 255.0f;
+    return (c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f));
+}
+
+Coloring::Coloring(const State& state) :
+    _reverse(state.colormap.reverse),
+    _colormap(state.colormap.colors.size())
+{
+    for (size_t i = 0; i < _colormap.size(); i++)
+        _colormap[i] = srgb_to_linear(state.colormap.colors[i]);
+}
+
+void Coloring::color(float c, unsigned char* rgbx) const
+{
+    int colormap_size = _colormap.size() / 3;
+    // GL_LINEAR texture lookup with GL_CLAMP_TO_EDGE
+    float u = c * colormap_size - 0.5f;
+    float u0 = std::floor(u);
+    float a = u - u0;
+    int i0 = u0;
+    int i1 = i0 + 1;
+    i0 = (i0 < 0 ? 0 : i0 >= colormap_size ? colormap_size - 1 : i0);
+    i1 = (i1 < 0 ? 0 : i1 >= colormap_size ? colormap_size - 1 : i1);
+    for (int j = 0; j < 3; j++) {
+        float v = (1.0f - a) * _colormap[3 * i0 + j] + a * _colormap[3 * i1 + j];
+        rgbx[j] = v * 255.0f + 0.5f;
+    }
+    rgbx[3] = 255;
+}
+
+void Coloring::apply(float offset, const float* values, size_t n, unsigned char* rgbx,
+        const Equalization* equalization) const
+{
+    for (size_t i = 0; i < n; i++) {
+        float f = values[i];
+        if (equalization)
+            f = equalization->apply(f);
+        if (_reverse)
+            f = 1.0f - f;
+        float c = offset + f;
+        if (c > 1.0f)
+            c -= 1.0f;
+        else if (c < 0.0f)
+            c += 1.0f;
+        color(c, rgbx + 4 * i);
+    }
+}
+
+int equalization_bins(int max_iter)
+{
+    return std::max(1, std::min(max_iter - 1, equalization_max_bins));
+}
+
+Equalization::Equalization(const State& state) :
+    _histogram(equalization_bins(state.fractal.mandelbrot.max_iter), 0),
+    _cdf(_histogram.size() + 1, 0.0f)
+{
+}
+
+static void histogram_range(const float* values, size_t n, uint64_t* histogram, int bins)
+{
+    for (size_t i = 0; i < n; i++) {
+        float f = values[i];
+        if (f > 0.0f)
+            histogram[std::min(static_cast<int>(std::min(f, 1.0f) * bins), bins - 1)]++;
+    }
+}
+
+void Equalization::add(const float* values, size_t n, int threads)
+{
+    int bins = _histogram.size();
+    size_t chunk = (n + threads - 1) / threads;
+    std::vector<std::vector<uint64_t>> histograms;
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads && t * chunk < n; t++)
+        histograms.push_back(std::vector<uint64_t>(bins, 0));
+    for (size_t t = 0; t < histograms.size(); t++)
+        workers.push_back(std::thread(histogram_range, values + (t + 1) * chunk,
+                    std::min(chunk, n - (t + 1) * chunk), histograms[t].data(), bins));
+    histogram_range(values, std::min(chunk, n), _histogram.data(), bins);
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+        for (int b = 0; b < bins; b++)
+            _histogram[b] += histograms[t][b];
+    }
+}
+
+void Equalization::update()
+{
+    uint64_t sum = 0;
+    for (size_t b = 0; b < _histogram.size(); b++)
+        sum += _histogram[b];
+    uint64_t partial_sum = 0;
+    for (size_t b = 0; b < _histogram.size(); b++) {
+        _cdf[b] = (sum > 0 ? static_cast<double>(partial_sum) / sum : static_cast<double>(b) / _histogram.size());
+        partial_sum += _histogram[b];
+    }
+    _cdf[_histogram.size()] = 1.0f;
+}
+
+ColorCycle::ColorCycle(const Coloring& coloring, const float* values, size_t n,
+        const Equalization* equalization) :
+    _table(65536 + 1), _positions(n)
+{
+    for (size_t i = 0; i < _table.size(); i++) {
+        unsigned char rgbx[4];
+        coloring.color(i / 65536.0f, rgbx);
+        std::memcpy(&(_table[i]), rgbx, 4);
+    }
+    for (size_t i = 0; i < n; i++) {
+        float f = values[i];
+        if (equalization)
+            f = equalization->apply(f);
+        if (coloring.reverse())
+            f = 1.0f - f;
+        _positions[i] = std::lround(f * 65536.0f);
+    }
+}
+
+static void color_cycle_range(const uint32_t* table, const int32_t* positions, size_t n,
+        int32_t offset, unsigned char* rgbx)
+{
+    for (size_t i = 0; i < n; i++) {
+        int32_t c = positions[i] + offset;
+        c = (c > 65536 ? c - 65536 : c < 0 ? c + 65536 : c);
+        c = (c < 0 ? 0 : c > 65536 ? 65536 : c);
+        std::memcpy(rgbx + 4 * i, table + c, 4);
+    }
+}
+
+#if HAVE_AVX2_GATHER
+// The same for 8 values at a time, with the table lookups done by one gather
+// instruction; compilers do not vectorize the loop above by themselves. This
+// is compiled for AVX2 regardless of the compiler flags and only called if
+// the CPU supports it.
+__attribute__((target("avx2")))
+static void color_cycle_range_avx2(const uint32_t* table, const int32_t* positions, size_t n,
+        int32_t offset, unsigned char* rgbx)
+{
+    const __m256i o = _mm256_set1_epi32(offset);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(65536);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i c = _mm256_add_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(positions + i)), o);
+        c = _mm256_sub_epi32(c, _mm256_and_si256(_mm256_cmpgt_epi32(c, one), one));
+        c = _mm256_add_epi32(c, _mm256_and_si256(_mm256_cmpgt_epi32(zero, c), one));
+        c = _mm256_min_epi32(_mm256_max_epi32(c, zero), one);
+        __m256i colors = _mm256_i32gather_epi32(reinterpret_cast<const int*>(table), c, 4);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(rgbx + 4 * i), colors);
+    }
+    color_cycle_range(table, positions + i, n - i, offset, rgbx + 4 * i);
+}
+#endif
+
+void ColorCycle::apply(float offset, unsigned char* rgbx, int threads) const
+{
+    void (*range)(const uint32_t*, const int32_t*, size_t, int32_t, unsigned char*) = color_cycle_range;
+#if HAVE_AVX2_GATHER
+    if (__builtin_cpu_supports("avx2"))
+        range = color_cycle_range_avx2;
+#endif
+    int32_t o = std::lround(offset * 65536.0f);
+    size_t n = _positions.size();
+    size_t chunk = (n + threads - 1) / threads;
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads && t * chunk < n; t++)
+        workers.push_back(std::thread(range, _table.data(), _positions.data() + t * chunk,
+                    std::min(chunk, n - t * chunk), o, rgbx + 4 * t * chunk));
+    range(_table.data(), _positions.data(), std::min(chunk, n), o, rgbx);
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COLORING_HPP
+#define COLORING_HPP
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "state.hpp"
+
+// Compute the color map offset for the given colormap animation time
+double colormap_offset(const State& state, double animation_seconds);
+
+/* Histogram equalization of normalized iteration values, so that the colors
+ * are spread evenly over the pixels instead of the iteration range. This
+ * gives contrast at deep zooms, where most pixels fall into a narrow band of
+ * iterations, without raising max_iter.
+ * The histogram has one bin per iteration, up to equalization_max_bins bins;
+ * interior pixels (value 0) are not counted. A value is mapped to the
+ * fraction of counted pixels with lower values, interpolated linearly within
+ * its bin. The GPU does the same with the histogram and prefix sums built by
+ * the Renderer; see coloring-fs.glsl. */
+static const int equalization_max_bins = 16384;
+
+// The number of histogram bins for the given max_iter
+int equalization_bins(int max_iter);
+
+class Equalization
+{
+private:
+    std::vector<uint64_t> _histogram;
+    std::vector<float> _cdf; // _cdf[i]: fraction of values in bins < i
+
+public:
+    // Create an empty histogram for values of the given state
+    Equalization(const State& state);
+
+    // Count values, with the given number of threads. Each thread fills its
+    // own histogram, and these are merged at the end.
+    void add(const float* values, size_t n, int threads = 1);
+
+    // Compute the mapping from the values counted so far
+    void update();
+
+    // Map a value; requires update()
+    float apply(float f) const
+    {
+        if (!(f > 0.0f))
+            return f;
+        int bins = _histogram.size();
+        float x = std::min(f, 1.0f) * bins;
+        int b = std::min(static_cast<int>(x), bins - 1);
+        return _cdf[b] + (x - b) * (_cdf[b + 1] - _cdf[b]);
+    }
+};
+
+/* CPU implementation of coloring-fs.glsl. It maps normalized iteration values
+ * to colors in the same way as the GPU: the color map is linearized from sRGB,
+ * sampled with linear interpolation, and the result is stored without
+ * conversion back to sRGB. */
+class Coloring
+{
+private:
+    bool _reverse;
+    std::vector<float> _colormap; // linear RGB
+
+public:
+    Coloring(const State& state);
+
+    bool reverse() const { return _reverse; }
+
+    // Store the color at the color map position c in [0,1] as RGBX quadruplet.
+    void color(float c, unsigned char* rgbx) const;
+
+    // Color n values and store them as RGBX quadruplets. If equalization is
+    // not NULL, the values are mapped through it first.
+    void apply(float offset, const float* values, size_t n, unsigned char* rgbx,
+            const Equalization* equalization = NULL) const;
+};
+
+/* Repeated coloring of the same values with different offsets, as needed for
+ * color map animations. The values are converted once to fixed point color
+ * map positions with 16 fractional bits, and the colors of all positions are
+ * precomputed. Applying an offset is then an integer addition with the same
+ * wrap-around as in Coloring::apply(), and coloring is a single table lookup
+ * per value, done for 8 values at a time with AVX2 gathers where the CPU
+ * supports them. */
+class ColorCycle
+{
+private:
+    std::vector<uint32_t> _table;       // RGBX quadruplets
+    std::vector<int32_t> _positions;
+
+public:
+    ColorCycle(const Coloring& coloring, const float* values, size_t n,
+            const Equalization* equalization = NULL);
+
+    size_t size() const { return _positions.size(); }
+
+    // Color all values with the given offset in [0,1], using the given
+    // number of threads, and store them as RGBX quadruplets.
+    void apply(float offset, unsigned char* rgbx, int threads = 1) const;
+};
+
+#endif
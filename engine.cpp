@@ -0,0 +1,1101 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "engine.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <quadmath.h>
+
+
+/*
+ * Emulated precision based on pairs of floats or doubles. This follows the
+ * emu_* functions in fractal.glsl; see the references there.
+ */
+
+template<typename B> struct Emu
+{
+    B hi, lo;
+    Emu() {}
+    Emu(B h, B l) : hi(h), lo(l) {}
+    explicit Emu(double x) : hi(x), lo(x - static_cast<double>(static_cast<B>(x))) {}
+};
+
+template<typename B> static inline B split_factor();
+template<> inline float split_factor<float>() { return 4097.0f; } // (1 << 12) + 1
+template<> inline double split_factor<double>() { return 134217729.0; } // (1 << 27) + 1
+
+template<typename B>
+static inline Emu<B> two_add(B a, B b)
+{
+    B s = a + b;
+    B v = s - a;
+    B e = (a - (s - v)) + (b - v);
+    return Emu<B>(s, e);
+}
+
+template<typename B>
+static inline Emu<B> two_sub(B a, B b)
+{
+    B s = a - b;
+    B v = s - a;
+    B e = (a - (s - v)) - (b + v);
+    return Emu<B>(s, e);
+}
+
+template<typename B>
+static inline Emu<B> quick_two_add(B a, B b) // requires abs(a) >= abs(b)
+{
+    B s = a + b;
+    B e = b - (s - a);
+    return Emu<B>(s, e);
+}
+
+template<typename B>
+static inline Emu<B> split(B a)
+{
+    B t = split_factor<B>() * a;
+    B hi = t - (t - a);
+    B lo = a - hi;
+    return Emu<B>(hi, lo);
+}
+
+template<typename B>
+static inline Emu<B> two_mul(B a, B b)
+{
+    B p = a * b;
+    Emu<B> sa = split(a);
+    Emu<B> sb = split(b);
+    B e = ((sa.hi * sb.hi - p) + sa.hi * sb.lo + sa.lo * sb.hi) + sa.lo * sb.lo;
+    return Emu<B>(p, e);
+}
+
+template<typename B>
+static inline Emu<B> operator+(const Emu<B>& a, const Emu<B>& b)
+{
+    Emu<B> s = two_add(a.hi, b.hi);
+    Emu<B> t = two_add(a.lo, b.lo);
+    s.lo += t.hi;
+    s = quick_two_add(s.hi, s.lo);
+    s.lo += t.lo;
+    return quick_two_add(s.hi, s.lo);
+}
+
+template<typename B>
+static inline Emu<B> operator-(const Emu<B>& a, const Emu<B>& b)
+{
+    Emu<B> s = two_sub(a.hi, b.hi);
+    Emu<B> t = two_sub(a.lo, b.lo);
+    s.lo += t.hi;
+    s = quick_two_add(s.hi, s.lo);
+    s.lo += t.lo;
+    return quick_two_add(s.hi, s.lo);
+}
+
+template<typename B>
+static inline Emu<B> operator*(const Emu<B>& a, const Emu<B>& b)
+{
+    Emu<B> p = two_mul(a.hi, b.hi);
+    p.lo += a.hi * b.lo + a.lo * b.hi;
+    return quick_two_add(p.hi, p.lo);
+}
+
+template<typename B>
+static inline bool operator<(const Emu<B>& a, float b)
+{
+    return (a.hi < b || (a.hi == b && a.lo < B(0)));
+}
+
+/*
+ * Conversions for all number types
+ */
+
+template<typename T> static inline T from_float128(__float128 x)
+{
+    return x;
+}
+
+template<> inline Emu<float> from_float128<Emu<float>>(__float128 x)
+{
+    float hi = x;
+    float lo = x - hi;
+    return Emu<float>(hi, lo);
+}
+
+template<> inline Emu<double> from_float128<Emu<double>>(__float128 x)
+{
+    double hi = x;
+    double lo = x - hi;
+    return Emu<double>(hi, lo);
+}
+
+template<typename T> static inline float to_float(const T& x)
+{
+    return x;
+}
+
+template<typename B> static inline float to_float(const Emu<B>& x)
+{
+    return x.hi;
+}
+
+/*
+ * The fractal computation; see fractal.glsl
+ */
+
+class Params
+{
+public:
+    int power;
+    float ln_power;
+    int max_iter;
+    float bailout;
+    bool smooth;
+    // Whether escape checks may be batched; see fractal()
+    bool batch_escape_checks;
+
+    Params(const State& state) :
+        power(state.fractal.mandelbrot.power),
+        ln_power(std::log(static_cast<float>(state.fractal.mandelbrot.power))),
+        max_iter(state.fractal.mandelbrot.max_iter),
+        bailout(state.fractal.mandelbrot.bailout),
+        smooth(state.fractal.mandelbrot.smooth),
+        batch_escape_checks(state.fractal.mandelbrot.bailout >= 4.0f)
+    {
+    }
+};
+
+template<typename T>
+static inline void powui(T& re, T& im, int n) // n >= 1
+{
+    T a_re = re;
+    T a_im = im;
+    int j = 1;
+    while (n >= 2 * j) {
+        T tmp = re * im;
+        re = re * re - im * im;
+        im = tmp + tmp;
+        j *= 2;
+    }
+    for (int k = j; k < n; k++) {
+        T tmp = re * a_re - im * a_im;
+        im = im * a_re + re * a_im;
+        re = tmp;
+    }
+}
+
+// z^POWER with a fixed multiply chain: square for even powers, multiply by
+// the base for odd powers. This is used for the instantiated powers 2 to 8.
+template<typename T, int POWER>
+struct PowChain
+{
+    static inline void apply(T& re, T& im, const T& a_re, const T& a_im)
+    {
+        if (POWER % 2 == 0) {
+            PowChain<T, POWER / 2>::apply(re, im, a_re, a_im);
+            T tmp = re * im;
+            re = re * re - im * im;
+            im = tmp + tmp;
+        } else {
+            PowChain<T, POWER - 1>::apply(re, im, a_re, a_im);
+            T tmp = re * a_re - im * a_im;
+            im = im * a_re + re * a_im;
+            re = tmp;
+        }
+    }
+};
+
+template<typename T>
+struct PowChain<T, 1>
+{
+    static inline void apply(T&, T&, const T&, const T&)
+    {
+    }
+};
+
+// The number of iterations between escape checks in the specialized kernels,
+// per number type; see iterate() in fractal.glsl
+template<typename T> struct EscapeCheckInterval { static const int value = 4; };
+template<> struct EscapeCheckInterval<Emu<float>> { static const int value = 8; };
+template<> struct EscapeCheckInterval<Emu<double>> { static const int value = 8; };
+
+template<typename T, int POWER>
+static inline void iteration(T& z_re, T& z_im, const T& c_re, const T& c_im, const Params& p)
+{
+    if (POWER == 0) {
+        powui(z_re, z_im, p.power);
+    } else {
+        T a_re = z_re;
+        T a_im = z_im;
+        PowChain<T, (POWER > 0 ? POWER : 1)>::apply(z_re, z_im, a_re, a_im);
+    }
+    z_re = z_re + c_re;
+    z_im = z_im + c_im;
+}
+
+// The state of the iteration for one pixel, so that it can be continued
+// with a larger bailout; see Engine::render_sweep()
+template<typename T>
+class Orbit
+{
+public:
+    int i;
+    T z_re, z_im;
+    T abssqrz; // |z|^2 after the last iteration
+
+    Orbit() : i(0), z_re(from_float128<T>(0)), z_im(from_float128<T>(0)), abssqrz(from_float128<T>(0))
+    {
+    }
+};
+
+// The fractal kernel for one pixel. POWER is either one of the instantiated
+// powers, so that the multiply chain is fixed at compile time, or 0 for the
+// generic kernel that uses powui() with the power from the parameters.
+// The specialized kernels check for escape only every few iterations, and
+// repeat the iterations since the last check one by one after an escape, so
+// that the result is the same as with a check after every iteration. Once
+// |z|^2 exceeds a bailout of at least 4, the orbit diverges, so the escape is
+// still detected at the next check, even if z has overflowed to inf or NaN.
+// The orbit of c is continued until |z|^2 reaches the bailout or max_iter
+// iterations are done.
+template<typename T, int POWER>
+static inline void iterate(const T& c_re, const T& c_im, const Params& p,
+        float bailout, bool batch_escape_checks, Orbit<T>& orbit)
+{
+    // Work on local copies, which the compiler can keep in registers
+    int i = orbit.i;
+    T z_re = orbit.z_re;
+    T z_im = orbit.z_im;
+    T abssqrz = orbit.abssqrz;
+    if (POWER != 0 && batch_escape_checks) {
+        const int k = EscapeCheckInterval<T>::value;
+        while (i + k <= p.max_iter) {
+            T checkpoint_re = z_re;
+            T checkpoint_im = z_im;
+            for (int j = 0; j < k; j++)
+                iteration<T, POWER>(z_re, z_im, c_re, c_im, p);
+            if (!(z_re * z_re + z_im * z_im < bailout)) {
+                z_re = checkpoint_re;
+                z_im = checkpoint_im;
+                break;
+            }
+            i += k;
+        }
+    }
+    while (i < p.max_iter) {
+        iteration<T, POWER>(z_re, z_im, c_re, c_im, p);
+        i++;
+        abssqrz = z_re * z_re + z_im * z_im;
+        if (!(abssqrz < bailout))
+            break;
+    }
+    orbit.i = i;
+    orbit.z_re = z_re;
+    orbit.z_im = z_im;
+    orbit.abssqrz = abssqrz;
+}
+
+// The iteration count of an orbit that escaped after i iterations; it is
+// continuous in smooth mode
+template<typename T, bool SMOOTH>
+static inline float iteration_count(int i, const T& abssqrz, const Params& p)
+{
+    if (SMOOTH)
+        return i - std::log(std::log(std::sqrt(to_float(abssqrz))) / static_cast<float>(M_LN2)) / p.ln_power;
+    else
+        return i;
+}
+
+// The normalized iteration value of a pixel for the given max_iter. The
+// orbit does not depend on max_iter, so an orbit that was iterated with a
+// larger max_iter gives the value for any smaller one.
+static inline float normalize(int i, float count, int max_iter)
+{
+    return (i < max_iter ? count / (max_iter - 1) : 0.0f);
+}
+
+template<typename T, int POWER, bool SMOOTH>
+static float fractal(const T& c_re, const T& c_im, const Params& p)
+{
+    Orbit<T> orbit;
+    iterate<T, POWER>(c_re, c_im, p, p.bailout, p.batch_escape_checks, orbit);
+    float count = (orbit.i < p.max_iter ? iteration_count<T, SMOOTH>(orbit.i, orbit.abssqrz, p) : 0.0f);
+    return normalize(orbit.i, count, p.max_iter);
+}
+
+/*
+ * Mappings from sample indices to points in the complex plane
+ */
+
+// The pixel centers of a tile of an image that shows the region of a state.
+// As in texture coordinates, y points upwards.
+template<typename T>
+class RegionMapping
+{
+private:
+    T _x0, _xw, _y0, _yw;
+    int _w, _h, _tx, _ty;
+
+public:
+    RegionMapping(const State& state, int w, int h, int tx, int ty) :
+        _w(w), _h(h), _tx(tx), _ty(ty)
+    {
+        __float128 x0, xw, y0, yw;
+        state.region(w, h, &x0, &xw, &y0, &yw);
+        _x0 = from_float128<T>(x0);
+        _xw = from_float128<T>(xw);
+        _y0 = from_float128<T>(y0);
+        _yw = from_float128<T>(yw);
+    }
+
+    void coord(int c, int r, T& re, T& im) const
+    {
+        re = _x0 + T((_tx + c + 0.5) / _w) * _xw;
+        im = _y0 + T((_h - (_ty + r) - 0.5) / _h) * _yw;
+    }
+};
+
+// Log-polar samples around the navigation center of a state; see
+// Engine::render_expmap(). Only the offsets from the center are computed
+// in double precision.
+template<typename T>
+class ExpMapping
+{
+private:
+    T _cx, _cy;
+    double _r0, _step;
+    int _row0;
+
+public:
+    ExpMapping(const State& state, int w, double r0, int row0) :
+        _cx(from_float128<T>(state.navigation.x)),
+        _cy(from_float128<T>(state.navigation.y)),
+        _r0(r0), _step(2.0 * M_PI / w), _row0(row0)
+    {
+    }
+
+    void coord(int c, int r, T& re, T& im) const
+    {
+        double radius = _r0 * std::exp(-(_row0 + r) * _step);
+        double angle = (c + 0.5) * _step;
+        re = _cx + T(radius * std::cos(angle));
+        im = _cy + T(radius * std::sin(angle));
+    }
+};
+
+/*
+ * Parallel computation of all samples of a mapping
+ */
+
+template<typename T, typename M, int POWER, bool SMOOTH>
+static void render_rows(const Params* p, const M* mapping, int tw, int th, float* values,
+        std::atomic<int>* next_row)
+{
+    int r;
+    while ((r = (*next_row)++) < th) {
+        float* row = values + static_cast<size_t>(r) * tw;
+        for (int c = 0; c < tw; c++) {
+            T c_re, c_im;
+            mapping->coord(c, r, c_re, c_im);
+            row[c] = fractal<T, POWER, SMOOTH>(c_re, c_im, *p);
+        }
+    }
+}
+
+template<typename T, typename M>
+static void render_parallel(const State& state, const M& mapping, int tw, int th, float* values,
+        int threads, bool specialized)
+{
+    // Dispatch table of the kernels, indexed by power and smooth mode. Rows
+    // 0 and 1 hold the generic kernel that is used for all other powers.
+    typedef void (*rows_t)(const Params*, const M*, int, int, float*, std::atomic<int>*);
+    static const rows_t kernels[9][2] = {
+        { render_rows<T, M, 0, false>, render_rows<T, M, 0, true> },
+        { render_rows<T, M, 0, false>, render_rows<T, M, 0, true> },
+        { render_rows<T, M, 2, false>, render_rows<T, M, 2, true> },
+        { render_rows<T, M, 3, false>, render_rows<T, M, 3, true> },
+        { render_rows<T, M, 4, false>, render_rows<T, M, 4, true> },
+        { render_rows<T, M, 5, false>, render_rows<T, M, 5, true> },
+        { render_rows<T, M, 6, false>, render_rows<T, M, 6, true> },
+        { render_rows<T, M, 7, false>, render_rows<T, M, 7, true> },
+        { render_rows<T, M, 8, false>, render_rows<T, M, 8, true> }
+    };
+    Params p(state);
+    int power = ((specialized && p.power >= 2 && p.power <= 8) ? p.power : 0);
+    rows_t kernel = kernels[power][p.smooth ? 1 : 0];
+    std::atomic<int> next_row(0);
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads && i < th; i++)
+        workers.push_back(std::thread(kernel, &p, &mapping, tw, th, values, &next_row));
+    kernel(&p, &mapping, tw, th, values, &next_row);
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+template<typename T>
+static void render_region(const State& state, int w, int h,
+        int tx, int ty, int tw, int th, float* values, int threads, bool specialized)
+{
+    RegionMapping<T> mapping(state, w, h, tx, ty);
+    render_parallel<T>(state, mapping, tw, th, values, threads, specialized);
+}
+
+template<typename T>
+static void render_expmap(const State& state, int w, double r0, int row0, int rows, float* values,
+        int threads, bool specialized)
+{
+    ExpMapping<T> mapping(state, w, r0, row0);
+    render_parallel<T>(state, mapping, w, rows, values, threads, specialized);
+}
+
+/*
+ * Batched computation of the variants of a view; see Engine::render_sweep()
+ */
+
+// Variants that differ only in bailout and max_iter. The orbit of a pixel
+// is the same for all of them, so it is computed only once, with the largest
+// max_iter: it is iterated until it escapes the smallest bailout, then
+// continued until it escapes the next one, and so on. Its iteration count
+// for a bailout is then normalized for each max_iter used with that bailout.
+class SweepGroup
+{
+public:
+    // The bailouts in ascending order, and for each of them the max_iter
+    // values of its variants and the arrays that receive their values
+    std::vector<float> bailouts;
+    std::vector<std::vector<int>> max_iters;
+    std::vector<std::vector<float*>> values;
+
+    virtual ~SweepGroup() {}
+    virtual void render_row(int r) const = 0;
+
+    void add(float bailout, int max_iter, float* v)
+    {
+        size_t b = std::lower_bound(bailouts.begin(), bailouts.end(), bailout) - bailouts.begin();
+        if (b == bailouts.size() || bailouts[b] != bailout) {
+            bailouts.insert(bailouts.begin() + b, bailout);
+            max_iters.insert(max_iters.begin() + b, std::vector<int>());
+            values.insert(values.begin() + b, std::vector<float*>());
+        }
+        max_iters[b].push_back(max_iter);
+        values[b].push_back(v);
+    }
+};
+
+template<typename T, int POWER, bool SMOOTH>
+class SweepGroupImpl : public SweepGroup
+{
+private:
+    Params _p;
+    RegionMapping<T> _mapping;
+    int _w;
+
+public:
+    SweepGroupImpl(const State& state, int w, int h) :
+        _p(state), _mapping(state, w, h, 0, 0), _w(w)
+    {
+    }
+
+    void render_row(int r) const override
+    {
+        size_t row = static_cast<size_t>(r) * _w;
+        for (int c = 0; c < _w; c++) {
+            T c_re, c_im;
+            _mapping.coord(c, r, c_re, c_im);
+            Orbit<T> orbit;
+            for (size_t b = 0; b < bailouts.size(); b++) {
+                // The last iteration might have escaped this bailout, too
+                if (b == 0 || orbit.abssqrz < bailouts[b]) {
+                    // Escape checks may be batched as in Params
+                    iterate<T, POWER>(c_re, c_im, _p, bailouts[b], bailouts[b] >= 4.0f, orbit);
+                }
+                float count = (orbit.i < _p.max_iter
+                        ? iteration_count<T, SMOOTH>(orbit.i, orbit.abssqrz, _p) : 0.0f);
+                for (size_t j = 0; j < max_iters[b].size(); j++)
+                    values[b][j][row + c] = normalize(orbit.i, count, max_iters[b][j]);
+            }
+        }
+    }
+};
+
+template<typename T, int POWER, bool SMOOTH>
+static SweepGroup* new_sweep_group(const State& state, int w, int h)
+{
+    return new SweepGroupImpl<T, POWER, SMOOTH>(state, w, h);
+}
+
+template<typename T>
+static SweepGroup* create_sweep_group(const State& state, int w, int h, bool specialized)
+{
+    // Same dispatch as in render_parallel()
+    typedef SweepGroup* (*new_t)(const State&, int, int);
+    static const new_t constructors[9][2] = {
+        { new_sweep_group<T, 0, false>, new_sweep_group<T, 0, true> },
+        { new_sweep_group<T, 0, false>, new_sweep_group<T, 0, true> },
+        { new_sweep_group<T, 2, false>, new_sweep_group<T, 2, true> },
+        { new_sweep_group<T, 3, false>, new_sweep_group<T, 3, true> },
+        { new_sweep_group<T, 4, false>, new_sweep_group<T, 4, true> },
+        { new_sweep_group<T, 5, false>, new_sweep_group<T, 5, true> },
+        { new_sweep_group<T, 6, false>, new_sweep_group<T, 6, true> },
+        { new_sweep_group<T, 7, false>, new_sweep_group<T, 7, true> },
+        { new_sweep_group<T, 8, false>, new_sweep_group<T, 8, true> }
+    };
+    int power = state.fractal.mandelbrot.power;
+    if (!specialized || power < 2 || power > 8)
+        power = 0;
+    return constructors[power][state.fractal.mandelbrot.smooth ? 1 : 0](state, w, h);
+}
+
+// Whether two states give the same orbits, apart from bailout and max_iter
+static bool same_orbits(const State& a, const State& b)
+{
+    return a.precision.type == b.precision.type
+        && a.fractal.mandelbrot.power == b.fractal.mandelbrot.power
+        && a.fractal.mandelbrot.smooth == b.fractal.mandelbrot.smooth
+        && a.navigation.x == b.navigation.x
+        && a.navigation.y == b.navigation.y
+        && a.navigation.zoom == b.navigation.zoom;
+}
+
+// Variants that use the same kernel come one after the other, and the most
+// expensive ones first, so that the cheap rows at the end balance the load
+static bool sweep_order(const State& a, const State& b)
+{
+    if (a.precision.type != b.precision.type)
+        return a.precision.type < b.precision.type;
+    if (a.fractal.mandelbrot.power != b.fractal.mandelbrot.power)
+        return a.fractal.mandelbrot.power < b.fractal.mandelbrot.power;
+    if (a.fractal.mandelbrot.smooth != b.fractal.mandelbrot.smooth)
+        return a.fractal.mandelbrot.smooth < b.fractal.mandelbrot.smooth;
+    return a.fractal.mandelbrot.max_iter > b.fractal.mandelbrot.max_iter;
+}
+
+static void render_sweep_rows(const std::vector<SweepGroup*>* groups, int h, std::atomic<int>* next_row)
+{
+    int rows = groups->size() * h;
+    int r;
+    while ((r = (*next_row)++) < rows)
+        (*groups)[r / h]->render_row(r % h);
+}
+
+/*
+ * Fixed-point numbers with N 32 bit limbs in two's complement. Limb 0 is the
+ * signed integer part, limbs 1 to N-1 are the fraction. Numbers are processed
+ * in batches of fixed_lanes pixels, with the same limb of all pixels stored
+ * next to each other, so that the loops over the lanes can use vector
+ * integer instructions. The integer part limits the magnitudes that can occur
+ * during the iteration to 2^31; see Engine::fixed_in_range().
+ */
+
+static const int fixed_lanes = 8;
+
+template<int N> struct Fixed
+{
+    uint32_t l[N][fixed_lanes];
+};
+
+template<int N>
+static inline void fixed_add(const Fixed<N>& a, const Fixed<N>& b, Fixed<N>& r)
+{
+    uint64_t carry[fixed_lanes] = { 0 };
+    for (int i = N - 1; i >= 0; i--) {
+        for (int k = 0; k < fixed_lanes; k++) {
+            uint64_t s = static_cast<uint64_t>(a.l[i][k]) + b.l[i][k] + carry[k];
+            r.l[i][k] = s;
+            carry[k] = s >> 32;
+        }
+    }
+}
+
+template<int N>
+static inline void fixed_sub(const Fixed<N>& a, const Fixed<N>& b, Fixed<N>& r)
+{
+    uint64_t carry[fixed_lanes];
+    for (int k = 0; k < fixed_lanes; k++)
+        carry[k] = 1;
+    for (int i = N - 1; i >= 0; i--) {
+        for (int k = 0; k < fixed_lanes; k++) {
+            uint64_t s = static_cast<uint64_t>(a.l[i][k]) + static_cast<uint32_t>(~b.l[i][k]) + carry[k];
+            r.l[i][k] = s;
+            carry[k] = s >> 32;
+        }
+    }
+}
+
+// Negate the lanes whose mask is all ones; the mask of the other lanes is zero
+template<int N>
+static inline void fixed_negate(Fixed<N>& a, const uint32_t* mask)
+{
+    uint64_t carry[fixed_lanes];
+    for (int k = 0; k < fixed_lanes; k++)
+        carry[k] = mask[k] & 1;
+    for (int i = N - 1; i >= 0; i--) {
+        for (int k = 0; k < fixed_lanes; k++) {
+            uint64_t s = static_cast<uint64_t>(a.l[i][k] ^ mask[k]) + carry[k];
+            a.l[i][k] = s;
+            carry[k] = s >> 32;
+        }
+    }
+}
+
+// Multiply the magnitudes and fix the sign afterwards. Partial products
+// below the last limb are dropped, except for their carries into it.
+// acc[i] collects the parts with weight 2^(-32 i); the low and high halves of
+// the 64 bit products are collected separately to avoid overflows.
+template<int N>
+static inline void fixed_accumulate(uint64_t acc[N + 1][fixed_lanes], int i, int j, int factor,
+        const Fixed<N>& ua, const Fixed<N>& ub)
+{
+    for (int k = 0; k < fixed_lanes; k++) {
+        uint64_t p = static_cast<uint64_t>(ua.l[i][k]) * ub.l[j][k];
+        acc[i + j][k] += factor * (p & 0xffffffffu);
+        if (i + j > 0)
+            acc[i + j - 1][k] += factor * (p >> 32);
+    }
+}
+
+template<int N>
+static inline void fixed_normalize(uint64_t acc[N + 1][fixed_lanes], const uint32_t* sign, Fixed<N>& r)
+{
+    uint64_t carry[fixed_lanes];
+    for (int k = 0; k < fixed_lanes; k++)
+        carry[k] = acc[N][k] >> 32;
+    for (int i = N - 1; i >= 0; i--) {
+        for (int k = 0; k < fixed_lanes; k++) {
+            uint64_t s = acc[i][k] + carry[k];
+            r.l[i][k] = s;
+            carry[k] = s >> 32;
+        }
+    }
+    fixed_negate(r, sign);
+}
+
+template<int N>
+static inline void fixed_mul(const Fixed<N>& a, const Fixed<N>& b, Fixed<N>& r)
+{
+    uint32_t sa[fixed_lanes], sb[fixed_lanes], sr[fixed_lanes];
+    for (int k = 0; k < fixed_lanes; k++) {
+        sa[k] = -(a.l[0][k] >> 31);
+        sb[k] = -(b.l[0][k] >> 31);
+        sr[k] = sa[k] ^ sb[k];
+    }
+    Fixed<N> ua = a;
+    Fixed<N> ub = b;
+    fixed_negate(ua, sa);
+    fixed_negate(ub, sb);
+    uint64_t acc[N + 1][fixed_lanes] = { { 0 } };
+    for (int i = 0; i < N; i++)
+        for (int j = 0; j < N && i + j <= N; j++)
+            fixed_accumulate<N>(acc, i, j, 1, ua, ub);
+    fixed_normalize<N>(acc, sr, r);
+}
+
+// Like fixed_mul(a, a, r), but with each mixed product computed only once
+template<int N>
+static inline void fixed_sqr(const Fixed<N>& a, Fixed<N>& r)
+{
+    uint32_t sa[fixed_lanes], sr[fixed_lanes] = { 0 };
+    for (int k = 0; k < fixed_lanes; k++)
+        sa[k] = -(a.l[0][k] >> 31);
+    Fixed<N> ua = a;
+    fixed_negate(ua, sa);
+    uint64_t acc[N + 1][fixed_lanes] = { { 0 } };
+    for (int i = 0; i < N; i++) {
+        if (2 * i <= N)
+            fixed_accumulate<N>(acc, i, i, 1, ua, ua);
+        for (int j = i + 1; j < N && i + j <= N; j++)
+            fixed_accumulate<N>(acc, i, j, 2, ua, ua);
+    }
+    fixed_normalize<N>(acc, sr, r);
+}
+
+template<int N>
+static inline double fixed_to_double(const Fixed<N>& a, int k)
+{
+    double d = static_cast<int32_t>(a.l[0][k]);
+    double f = 1.0;
+    for (int i = 1; i < N && i < 3; i++) {
+        f *= 1.0 / 4294967296.0;
+        d += a.l[i][k] * f;
+    }
+    return d;
+}
+
+// Convert to n limbs; |x| must be smaller than 2^31
+static void float128_to_limbs(__float128 x, uint32_t* limbs, int n)
+{
+    __float128 i = floorq(x);
+    limbs[0] = static_cast<uint32_t>(static_cast<int32_t>(i));
+    __float128 f = x - i;
+    for (int j = 1; j < n; j++) {
+        f *= 4294967296.0Q;
+        __float128 l = floorq(f);
+        limbs[j] = static_cast<uint32_t>(l);
+        f -= l;
+    }
+}
+
+// Set one lane of a to the sum of two limb arrays
+template<int N>
+static inline void fixed_set(Fixed<N>& a, int k, const uint32_t* x, const uint32_t* y)
+{
+    uint64_t carry = 0;
+    for (int i = N - 1; i >= 0; i--) {
+        uint64_t s = static_cast<uint64_t>(x[i]) + y[i] + carry;
+        a.l[i][k] = s;
+        carry = s >> 32;
+    }
+}
+
+template<int N>
+static inline void fixed_powui(Fixed<N>& re, Fixed<N>& im, int n) // n >= 1; see powui()
+{
+    Fixed<N> a_re = re;
+    Fixed<N> a_im = im;
+    Fixed<N> t0, t1;
+    int j = 1;
+    while (n >= 2 * j) {
+        fixed_mul(re, im, t0);
+        fixed_sqr(re, t1);
+        fixed_sqr(im, re);
+        fixed_sub(t1, re, re);
+        fixed_add(t0, t0, im);
+        j *= 2;
+    }
+    for (int k = j; k < n; k++) {
+        fixed_mul(re, a_re, t0);
+        fixed_mul(im, a_im, t1);
+        fixed_sub(t0, t1, t0);
+        fixed_mul(im, a_re, t1);
+        fixed_mul(re, a_im, im);
+        fixed_add(t1, im, im);
+        re = t0;
+    }
+}
+
+// The pixels of a tile, handed out row by row to the threads
+class FixedPixels
+{
+private:
+    std::atomic<int>* _next_row;
+    int _tw, _th;
+    int _row, _col;
+
+public:
+    FixedPixels(std::atomic<int>* next_row, int tw, int th) :
+        _next_row(next_row), _tw(tw), _th(th), _row(-1), _col(tw)
+    {
+    }
+
+    bool next(int* col, int* row)
+    {
+        if (_col == _tw) {
+            _row = (*_next_row)++;
+            _col = 0;
+        }
+        if (_row >= _th)
+            return false;
+        *col = _col++;
+        *row = _row;
+        return true;
+    }
+};
+
+// Iterate batches of pixels. When the iteration of a pixel ends, its lane is
+// refilled with the next pixel, so that lanes are not wasted when the
+// iteration counts of neighboring pixels differ. Finished lanes without new
+// pixels keep computing on garbage until the whole batch is done.
+template<int N>
+static void render_fixed_rows(const Params* p, const State* state, int w, int h, int tx, int ty,
+        int tw, int th, float* values, std::atomic<int>* next_row)
+{
+    __float128 x0, xw, y0, yw;
+    state->region(w, h, &x0, &xw, &y0, &yw);
+    uint32_t x0_limbs[N], y0_limbs[N], offset_limbs[N];
+    float128_to_limbs(x0, x0_limbs, N);
+    float128_to_limbs(y0, y0_limbs, N);
+
+    FixedPixels pixels(next_row, tw, th);
+    Fixed<N> c_re, c_im, z_re, z_im, sqr_re, sqr_im, t;
+    int lane_iter[fixed_lanes];
+    float* lane_value[fixed_lanes];
+    int active = 0;
+    for (int k = 0; k < fixed_lanes; k++) {
+        int col, row;
+        lane_value[k] = NULL;
+        for (int i = 0; i < N; i++)
+            c_re.l[i][k] = c_im.l[i][k] = 0;
+        if (pixels.next(&col, &row)) {
+            float128_to_limbs((tx + col + 0.5Q) / w * xw, offset_limbs, N);
+            fixed_set(c_re, k, x0_limbs, offset_limbs);
+            float128_to_limbs((h - (ty + row) - 0.5Q) / h * yw, offset_limbs, N);
+            fixed_set(c_im, k, y0_limbs, offset_limbs);
+            lane_value[k] = values + static_cast<size_t>(row) * tw + col;
+            active++;
+        }
+        lane_iter[k] = 0;
+        for (int i = 0; i < N; i++)
+            z_re.l[i][k] = z_im.l[i][k] = sqr_re.l[i][k] = sqr_im.l[i][k] = 0;
+    }
+    while (active > 0) {
+        // One iteration for all lanes
+        if (p->power == 2) {
+            // reuse the squares from the bailout test
+            fixed_mul(z_re, z_im, t);
+            fixed_add(t, t, z_im);
+            fixed_add(z_im, c_im, z_im);
+            fixed_sub(sqr_re, sqr_im, z_re);
+            fixed_add(z_re, c_re, z_re);
+        } else {
+            fixed_powui(z_re, z_im, p->power);
+            fixed_add(z_re, c_re, z_re);
+            fixed_add(z_im, c_im, z_im);
+        }
+        fixed_sqr(z_re, sqr_re);
+        fixed_sqr(z_im, sqr_im);
+        fixed_add(sqr_re, sqr_im, t);
+        // Finish and refill lanes
+        for (int k = 0; k < fixed_lanes; k++) {
+            if (!lane_value[k])
+                continue;
+            lane_iter[k]++;
+            float abssqrz = fixed_to_double(t, k);
+            if (abssqrz < p->bailout && lane_iter[k] < p->max_iter)
+                continue;
+            int i = lane_iter[k];
+            float ret = 0.0f;
+            if (i < p->max_iter) {
+                if (p->smooth) {
+                    ret = i - std::log(std::log(std::sqrt(abssqrz)) / static_cast<float>(M_LN2)) / p->ln_power;
+                    ret /= p->max_iter - 1;
+                } else {
+                    ret = static_cast<float>(i) / (p->max_iter - 1);
+                }
+            }
+            *(lane_value[k]) = ret;
+            lane_value[k] = NULL;
+            active--;
+            int col, row;
+            if (pixels.next(&col, &row)) {
+                float128_to_limbs((tx + col + 0.5Q) / w * xw, offset_limbs, N);
+                fixed_set(c_re, k, x0_limbs, offset_limbs);
+                float128_to_limbs((h - (ty + row) - 0.5Q) / h * yw, offset_limbs, N);
+                fixed_set(c_im, k, y0_limbs, offset_limbs);
+                for (int i = 0; i < N; i++)
+                    z_re.l[i][k] = z_im.l[i][k] = sqr_re.l[i][k] = sqr_im.l[i][k] = 0;
+                lane_iter[k] = 0;
+                lane_value[k] = values + static_cast<size_t>(row) * tw + col;
+                active++;
+            }
+        }
+    }
+}
+
+template<int N>
+static void render_fixed(const State& state, int w, int h,
+        int tx, int ty, int tw, int th, float* values, int threads)
+{
+    Params p(state);
+    std::atomic<int> next_row(0);
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads && i < th; i++)
+        workers.push_back(std::thread(render_fixed_rows<N>, &p, &state, w, h, tx, ty, tw, th, values, &next_row));
+    render_fixed_rows<N>(&p, &state, w, h, tx, ty, tw, th, values, &next_row);
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+Engine::Engine(int threads, bool specialized) : _threads(threads), _specialized(specialized)
+{
+    if (_threads < 1)
+        _threads = std::thread::hardware_concurrency();
+    if (_threads < 1)
+        _threads = 1;
+}
+
+void Engine::render(const State& state, int w, int h,
+        int tx, int ty, int tw, int th, float* values) const
+{
+    switch (state.precision.type) {
+    case precision_native_float:
+        render_region<float>(state, w, h, tx, ty, tw, th, values, _threads, _specialized);
+        break;
+    case precision_native_double:
+        render_region<double>(state, w, h, tx, ty, tw, th, values, _threads, _specialized);
+        break;
+    case precision_emu_doublefloat:
+        render_region<Emu<float>>(state, w, h, tx, ty, tw, th, values, _threads, _specialized);
+        break;
+    case precision_emu_doubledouble:
+        render_region<Emu<double>>(state, w, h, tx, ty, tw, th, values, _threads, _specialized);
+        break;
+    }
+}
+
+int Engine::fixed_limbs(const State& state, int w, int h)
+{
+    // Resolve the pixel size with 32 guard bits for the error growth during
+    // the iteration, and use one of the instantiated limb counts
+    __float128 x0, xw, y0, yw;
+    state.region(w, h, &x0, &xw, &y0, &yw);
+    double bits = std::log2(std::max(static_cast<double>(w / xw), static_cast<double>(h / yw))) + 32.0;
+    int limbs = 1 + std::max(1, static_cast<int>(std::ceil(bits / 32.0)));
+    const int instantiated[] = { 2, 3, 4, 5, 6, 8, 10, 12, 16 };
+    for (size_t i = 0; i < sizeof(instantiated) / sizeof(instantiated[0]); i++)
+        if (limbs <= instantiated[i])
+            return instantiated[i];
+    return 16;
+}
+
+bool Engine::fixed_in_range(const State& state, int w, int h)
+{
+    // An orbit that passed the bailout test has |z|^2 < bailout, so the next
+    // iteration gives |z| < bailout^(power/2) + |c|, and its |z|^2 for the
+    // next bailout test must fit into the integer part. The intermediate
+    // values of the iteration are smaller.
+    __float128 x0, xw, y0, yw;
+    state.region(w, h, &x0, &xw, &y0, &yw);
+    double c_re = std::max(std::abs(static_cast<double>(x0)), std::abs(static_cast<double>(x0 + xw)));
+    double c_im = std::max(std::abs(static_cast<double>(y0)), std::abs(static_cast<double>(y0 + yw)));
+    double z = std::pow(static_cast<double>(state.fractal.mandelbrot.bailout), state.fractal.mandelbrot.power / 2.0)
+        + std::sqrt(c_re * c_re + c_im * c_im);
+    return z * z < 2147483648.0;
+}
+
+void Engine::render_fixed(const State& state, int w, int h,
+        int tx, int ty, int tw, int th, float* values) const
+{
+    if (!fixed_in_range(state, w, h)) {
+        render_region<__float128>(state, w, h, tx, ty, tw, th, values, _threads, _specialized);
+        return;
+    }
+    switch (fixed_limbs(state, w, h)) {
+    case 2:
+        ::render_fixed<2>(state, w, h, tx, ty, tw, th, values, _threads);
+        break;
+    case 3:
+        ::render_fixed<3>(state, w, h, tx, ty, tw, th, values, _threads);
+        break;
+    case 4:
+        ::render_fixed<4>(state, w, h, tx, ty, tw, th, values, _threads);
+        break;
+    case 5:
+        ::render_fixed<5>(state, w, h, tx, ty, tw, th, values, _threads);
+        break;
+    case 6:
+        ::render_fixed<6>(state, w, h, tx, ty, tw, th, values, _threads);
+        break;
+    case 8:
+        ::render_fixed<8>(state, w, h, tx, ty, tw, th, values, _threads);
+        break;
+    case 10:
+        ::render_fixed<10>(state, w, h, tx, ty, tw, th, values, _threads);
+        break;
+    case 12:
+        ::render_fixed<12>(state, w, h, tx, ty, tw, th, values, _threads);
+        break;
+    default:
+        ::render_fixed<16>(state, w, h, tx, ty, tw, th, values, _threads);
+        break;
+    }
+}
+
+void Engine::render_expmap(const State& state, int w, double r0,
+        int row0, int rows, float* values) const
+{
+    switch (state.precision.type) {
+    case precision_native_float:
+        ::render_expmap<float>(state, w, r0, row0, rows, values, _threads, _specialized);
+        break;
+    case precision_native_double:
+        ::render_expmap<double>(state, w, r0, row0, rows, values, _threads, _specialized);
+        break;
+    case precision_emu_doublefloat:
+        ::render_expmap<Emu<float>>(state, w, r0, row0, rows, values, _threads, _specialized);
+        break;
+    case precision_emu_doubledouble:
+        ::render_expmap<Emu<double>>(state, w, r0, row0, rows, values, _threads, _specialized);
+        break;
+    }
+}
+
+void Engine::render_sweep(const std::vector<State>& states, int w, int h,
+        const std::vector<float*>& values) const
+{
+    // Find the groups of variants with the same orbits
+    std::vector<State> group_states;
+    std::vector<std::vector<size_t>> group_members;
+    for (size_t i = 0; i < states.size(); i++) {
+        size_t g = 0;
+        while (g < group_states.size() && !same_orbits(group_states[g], states[i]))
+            g++;
+        if (g == group_states.size()) {
+            group_states.push_back(states[i]);
+            group_members.push_back(std::vector<size_t>());
+        }
+        group_states[g].fractal.mandelbrot.max_iter = std::max(
+                group_states[g].fractal.mandelbrot.max_iter, states[i].fractal.mandelbrot.max_iter);
+        group_members[g].push_back(i);
+    }
+    std::vector<SweepGroup*> groups(group_states.size());
+    for (size_t g = 0; g < groups.size(); g++) {
+        const State& state = group_states[g];
+        switch (state.precision.type) {
+        case precision_native_float:
+            groups[g] = create_sweep_group<float>(state, w, h, _specialized);
+            break;
+        case precision_native_double:
+            groups[g] = create_sweep_group<double>(state, w, h, _specialized);
+            break;
+        case precision_emu_doublefloat:
+            groups[g] = create_sweep_group<Emu<float>>(state, w, h, _specialized);
+            break;
+        case precision_emu_doubledouble:
+            groups[g] = create_sweep_group<Emu<double>>(state, w, h, _specialized);
+            break;
+        }
+        for (size_t j = 0; j < group_members[g].size(); j++) {
+            size_t i = group_members[g][j];
+            groups[g]->add(states[i].fractal.mandelbrot.bailout, states[i].fractal.mandelbrot.max_iter, values[i]);
+        }
+    }
+    std::vector<size_t> order(groups.size());
+    for (size_t g = 0; g < order.size(); g++)
+        order[g] = g;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return sweep_order(group_states[a], group_states[b]); });
+    std::vector<SweepGroup*> sorted_groups(groups.size());
+    for (size_t g = 0; g < order.size(); g++)
+        sorted_groups[g] = groups[order[g]];
+
+    // All threads take rows from all groups
+    std::atomic<int> next_row(0);
+    int rows = sorted_groups.size() * h;
+    std::vector<std::thread> workers;
+    for (int i = 1; i < _threads && i < rows; i++)
+        workers.push_back(std::thread(render_sweep_rows, &sorted_groups, h, &next_row));
+    render_sweep_rows(&sorted_groups, h, &next_row);
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    for (size_t g = 0; g < groups.size(); g++)
+        delete groups[g];
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENGINE_HPP
+#define ENGINE_HPP
+
+#include <vector>
+
+#include "state.hpp"
+
+/* CPU implementation of fractal.glsl. It computes normalized iteration
+ * values in the same way as the GPU, with the same number types for each
+ * precision, including the emulated double-float and double-double types.
+ * The work is distributed over multiple threads. An Engine can be reused for
+ * any number of renderings.
+ * Like the shader, which gets the power, smooth mode and number type as
+ * compile-time constants, the kernels are instantiated for each number type,
+ * smooth mode and the powers 2 to 8, with a generic kernel for other powers. */
+class Engine
+{
+private:
+    int _threads;
+    bool _specialized;
+
+public:
+    // Use the given number of threads, or one per core if threads is 0.
+    // If specialized is false, the generic kernel is used for all powers;
+    // this is only useful for measuring the gain of the specialized kernels.
+    Engine(int threads = 0, bool specialized = true);
+
+    int threads() const { return _threads; }
+
+    // Compute the normalized iteration values for the tile (tx, ty, tw, th)
+    // of an image of size w x h that shows the given state. Values are stored
+    // row by row, from top to bottom.
+    void render(const State& state, int w, int h,
+            int tx, int ty, int tw, int th, float* values) const;
+
+    void render(const State& state, int w, int h, float* values) const
+    {
+        render(state, w, h, 0, 0, w, h, values);
+    }
+
+    // Compute the normalized iteration values of several variants of a view
+    // of size w x h, e.g. with different powers, bailouts and iteration
+    // limits, in one batch; values[i] receives the image of states[i].
+    // Variants that differ only in bailout and max_iter share the orbit
+    // computation, variants that use the same kernel are computed one after
+    // the other, and the threads take rows from all variants, so that they
+    // are busy until the whole batch is done. The results are the same as
+    // with render().
+    void render_sweep(const std::vector<State>& states, int w, int h,
+            const std::vector<float*>& values) const;
+
+    // Like render(), but compute with fixed-point numbers regardless of the
+    // precision type of the state. The number of 32 bit limbs is chosen from
+    // the zoom depth (see fixed_limbs()), so the accuracy is not limited by a
+    // number type; only the state coordinates themselves are __float128.
+    // This is the reference for measuring the accuracy of the other number
+    // types, and a renderer for depths where those break down. If the
+    // bailout and power give magnitudes that the fixed-point numbers cannot
+    // represent (see fixed_in_range()), __float128 is used instead.
+    void render_fixed(const State& state, int w, int h,
+            int tx, int ty, int tw, int th, float* values) const;
+
+    void render_fixed(const State& state, int w, int h, float* values) const
+    {
+        render_fixed(state, w, h, 0, 0, w, h, values);
+    }
+
+    // The number of limbs that render_fixed() uses for an image of size w x h
+    static int fixed_limbs(const State& state, int w, int h);
+    // Whether the magnitudes that occur in the iteration fit into the 32 bit
+    // integer part of the fixed-point numbers of render_fixed()
+    static bool fixed_in_range(const State& state, int w, int h);
+
+    // Compute rows [row0, row0 + rows) of an exponential map, i.e. a
+    // log-polar strip around the navigation center of the given state, with
+    // w angular samples per row. Sample (c, r) lies at angle 2pi (c + 0.5) / w
+    // and radius r0 exp(-2pi r / w), so that the samples are approximately
+    // square. A zoom video around the center can be resampled from this
+    // strip instead of computing each frame.
+    void render_expmap(const State& state, int w, double r0,
+            int row0, int rows, float* values) const;
+};
+
+#endif
@@ -0,0 +1,596 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* glfract-farm: render one fractal with several worker processes.
+ *
+ * The coordinator splits the image into tiles and hands them out to workers
+ * that connect to it over a Unix domain socket:
+ *   glfract-farm [options] fractal.fract output.png
+ * It starts --workers local workers itself. More workers can join at any
+ * time, e.g. with other backends:
+ *   glfract-farm --worker [--backend=gl] [--threads=T] SOCKET
+ * A worker renders one tile at a time and sends back its normalized
+ * iteration values. If a worker dies, its tile is handed out again; a tile
+ * that fails max_attempts times fails the job. The output format is
+ * determined by the file name extension: any image format, or .iterbuf for
+ * an iteration buffer file. The tiles are those of the iteration buffer
+ * file, which is written in tile order, so that the output is the same as
+ * that of glfract-render with the same backend.
+ *
+ * Protocol: each message is a header of two 32 bit integers in host byte
+ * order, the message type and the payload size in bytes, followed by the
+ * payload.
+ *   worker -> coordinator: HELLO, no payload
+ *   coordinator -> worker: JOB, int32 width and height and the serialized
+ *                          State
+ *   coordinator -> worker: TILE, int32 tile rectangle x, y, w, h in pixels
+ *   worker -> coordinator: RESULT, the int32 tile rectangle and w * h float
+ *                          values, row by row from top to bottom
+ *   coordinator -> worker: QUIT, no payload */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <QString>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QImage>
+#include <QElapsedTimer>
+#include <QGuiApplication>
+
+#include "state.hpp"
+#include "engine.hpp"
+#include "renderer.hpp"
+#include "coloring.hpp"
+#include "iterbuf.hpp"
+
+
+typedef enum {
+    msg_hello = 1,
+    msg_job = 2,
+    msg_tile = 3,
+    msg_result = 4,
+    msg_quit = 5
+} msg_type_t;
+
+// Payloads larger than this are considered broken
+static const uint32_t max_payload_size = 1U << 30;
+// The number of times a tile is handed out before the job fails
+static const int max_attempts = 3;
+
+static bool write_all(int fd, const void* data, size_t size)
+{
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t r = send(fd, p, size, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        size -= r;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* data, size_t size)
+{
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t r = recv(fd, p, size, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        p += r;
+        size -= r;
+    }
+    return true;
+}
+
+static bool send_message(int fd, msg_type_t type, const void* payload = NULL, uint32_t size = 0)
+{
+    uint32_t header[2] = { static_cast<uint32_t>(type), size };
+    return write_all(fd, header, sizeof(header)) && write_all(fd, payload, size);
+}
+
+static bool receive_message(int fd, msg_type_t* type, std::vector<unsigned char>& payload)
+{
+    uint32_t header[2];
+    if (!read_all(fd, header, sizeof(header)) || header[1] > max_payload_size)
+        return false;
+    *type = static_cast<msg_type_t>(header[0]);
+    payload.resize(header[1]);
+    return read_all(fd, payload.data(), payload.size());
+}
+
+static bool socket_address(const QString& path, struct sockaddr_un* addr)
+{
+    QByteArray p = QFile::encodeName(path);
+    std::memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (static_cast<size_t>(p.size()) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", qPrintable(path));
+        return false;
+    }
+    std::memcpy(addr->sun_path, p.constData(), p.size());
+    return true;
+}
+
+/* Worker */
+
+static int worker(const QString& socket_path, const QString& backend, int threads, int argc, char* argv[])
+{
+    struct sockaddr_un addr;
+    if (!socket_address(socket_path, &addr))
+        return 1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    // The coordinator might not listen yet
+    int r;
+    for (int i = 0; (r = connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr))) != 0 && i < 50; i++)
+        usleep(100000);
+    if (r != 0) {
+        fprintf(stderr, "Cannot connect to %s: %s\n", qPrintable(socket_path), std::strerror(errno));
+        return 1;
+    }
+    msg_type_t type;
+    std::vector<unsigned char> payload;
+    if (!send_message(fd, msg_hello) || !receive_message(fd, &type, payload)
+            || type != msg_job || payload.size() < 2 * sizeof(int32_t)) {
+        fprintf(stderr, "Coordinator did not send a job\n");
+        return 1;
+    }
+    int32_t size[2];
+    std::memcpy(size, payload.data(), sizeof(size));
+    State state;
+    if (!state.deserialize(payload.data() + sizeof(size), payload.size() - sizeof(size))) {
+        fprintf(stderr, "Coordinator sent an invalid job\n");
+        return 1;
+    }
+
+    QGuiApplication* app = NULL;
+    OffscreenRenderer* renderer = NULL;
+    if (backend == "gl") {
+        if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+            qputenv("QT_QPA_PLATFORM", "offscreen");
+        app = new QGuiApplication(argc, argv);
+        renderer = new OffscreenRenderer;
+        if (!renderer->initialize()) {
+            fprintf(stderr, "Cannot create an OpenGL 3.3 core context\n");
+            return 1;
+        }
+    }
+    Engine engine(threads);
+
+    int ret = 0;
+    std::vector<unsigned char> result;
+    while (receive_message(fd, &type, payload) && type == msg_tile && payload.size() == 4 * sizeof(int32_t)) {
+        int32_t rect[4];
+        std::memcpy(rect, payload.data(), sizeof(rect));
+        result.resize(sizeof(rect) + static_cast<size_t>(rect[2]) * rect[3] * sizeof(float));
+        std::memcpy(result.data(), rect, sizeof(rect));
+        float* values = reinterpret_cast<float*>(result.data() + sizeof(rect));
+        if (renderer) {
+            if (!renderer->render_iterations(state, size[0], size[1], rect[0], rect[1], rect[2], rect[3], values)) {
+                fprintf(stderr, "Cannot render tile of size %dx%d\n", rect[2], rect[3]);
+                ret = 1;
+                break;
+            }
+        } else if (backend == "fixed") {
+            engine.render_fixed(state, size[0], size[1], rect[0], rect[1], rect[2], rect[3], values);
+        } else {
+            engine.render(state, size[0], size[1], rect[0], rect[1], rect[2], rect[3], values);
+        }
+        if (!send_message(fd, msg_result, result.data(), result.size()))
+            break;
+    }
+    close(fd);
+    delete renderer;
+    delete app;
+    return ret;
+}
+
+/* Coordinator */
+
+class Farm
+{
+public:
+    // The job
+    State state;
+    int width, height;
+    QString output;
+    std::vector<unsigned char> job;
+
+    // The tiles, and the state of the work
+    std::mutex mutex;
+    std::condition_variable cond;
+    IterBuf buf; // also defines the tiles for image output
+    std::deque<int> pending;
+    std::vector<int> attempts;
+    int finished;
+    bool failed;
+    int workers;
+
+    // The output: an image colored as tiles arrive, or an iteration buffer
+    // file whose tiles are written in order. With histogram equalization,
+    // the values are kept and colored when all tiles are done.
+    bool to_iterbuf;
+    QImage image;
+    Coloring coloring;
+    float offset;
+    Equalization equalization;
+    std::vector<float> image_values;
+    std::map<int, std::vector<float> > early_tiles;
+    int next_tile_to_write;
+
+    Farm(const State& s) : state(s), coloring(s), equalization(s) {}
+
+    int tiles() const { return buf.tiles_x() * buf.tiles_y(); }
+
+    bool done() const { return failed || finished == tiles(); }
+
+    // Store a finished tile; requires the mutex
+    bool store(int t, const float* values)
+    {
+        int tx = t % buf.tiles_x();
+        int ty = t / buf.tiles_x();
+        int tw = buf.tile_width(tx);
+        int th = buf.tile_height(ty);
+        if (!to_iterbuf && state.colormap.equalize) {
+            equalization.add(values, static_cast<size_t>(tw) * th);
+            for (int y = 0; y < th; y++)
+                std::memcpy(image_values.data() + static_cast<size_t>(ty * buf.tile_size + y) * width
+                        + static_cast<size_t>(tx) * buf.tile_size,
+                        values + static_cast<size_t>(y) * tw, tw * sizeof(float));
+            return true;
+        }
+        if (!to_iterbuf) {
+            for (int y = 0; y < th; y++)
+                coloring.apply(offset, values + static_cast<size_t>(y) * tw, tw,
+                        image.scanLine(ty * buf.tile_size + y) + static_cast<size_t>(tx) * buf.tile_size * 4);
+            return true;
+        }
+        early_tiles[t] = std::vector<float>(values, values + static_cast<size_t>(tw) * th);
+        std::map<int, std::vector<float> >::iterator it;
+        while ((it = early_tiles.find(next_tile_to_write)) != early_tiles.end()) {
+            if (!buf.write_tile(next_tile_to_write % buf.tiles_x(), next_tile_to_write / buf.tiles_x(), it->second.data()))
+                return false;
+            early_tiles.erase(it);
+            next_tile_to_write++;
+        }
+        return true;
+    }
+};
+
+// Serve one worker connection until the job is done or the worker is lost
+static void serve(Farm* farm, int fd, int worker_id)
+{
+    msg_type_t type;
+    std::vector<unsigned char> payload;
+    if (!receive_message(fd, &type, payload) || type != msg_hello
+            || !send_message(fd, msg_job, farm->job.data(), farm->job.size())) {
+        close(fd);
+        return;
+    }
+    std::unique_lock<std::mutex> lock(farm->mutex);
+    farm->workers++;
+    fprintf(stderr, "worker %d connected\n", worker_id);
+    for (;;) {
+        while (farm->pending.empty() && !farm->done())
+            farm->cond.wait(lock);
+        if (farm->done()) {
+            send_message(fd, msg_quit);
+            break;
+        }
+        int t = farm->pending.front();
+        farm->pending.pop_front();
+        int tx = t % farm->buf.tiles_x();
+        int ty = t / farm->buf.tiles_x();
+        int32_t rect[4] = { tx * farm->buf.tile_size, ty * farm->buf.tile_size,
+            farm->buf.tile_width(tx), farm->buf.tile_height(ty) };
+        lock.unlock();
+        bool sent = send_message(fd, msg_tile, rect, sizeof(rect));
+        bool ok = sent
+            && receive_message(fd, &type, payload)
+            && type == msg_result
+            && payload.size() == sizeof(rect) + static_cast<size_t>(rect[2]) * rect[3] * sizeof(float)
+            && std::memcmp(payload.data(), rect, sizeof(rect)) == 0;
+        lock.lock();
+        if (!ok) {
+            // Only count attempts for tiles that reached the worker
+            if (sent)
+                farm->attempts[t]++;
+            fprintf(stderr, "worker %d lost", worker_id);
+            if (farm->attempts[t] < max_attempts) {
+                fprintf(stderr, ", handing out tile %d again\n", t);
+                farm->pending.push_front(t);
+            } else {
+                fprintf(stderr, "; tile %d failed %d times\n", t, max_attempts);
+                farm->failed = true;
+            }
+            farm->cond.notify_all();
+            break;
+        }
+        if (!farm->store(t, reinterpret_cast<const float*>(payload.data() + sizeof(rect)))) {
+            fprintf(stderr, "Cannot write %s\n", qPrintable(farm->output));
+            farm->failed = true;
+        }
+        farm->finished++;
+        farm->cond.notify_all();
+    }
+    farm->workers--;
+    lock.unlock();
+    close(fd);
+}
+
+// Start a local worker process
+static pid_t spawn_worker(const char* argv0, const QString& socket_path, const QString& backend, int threads)
+{
+    QByteArray backend_arg = QByteArray("--backend=") + backend.toLocal8Bit();
+    QByteArray threads_arg = QByteArray("--threads=") + QByteArray::number(threads);
+    QByteArray socket_arg = QFile::encodeName(socket_path);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("/proc/self/exe", argv0, "--worker", backend_arg.constData(), threads_arg.constData(),
+                socket_arg.constData(), static_cast<char*>(NULL));
+        execlp(argv0, argv0, "--worker", backend_arg.constData(), threads_arg.constData(),
+                socket_arg.constData(), static_cast<char*>(NULL));
+        _exit(127);
+    }
+    return pid;
+}
+
+// Do not leave an incomplete buffer behind when the job fails
+static void remove_output(Farm* farm)
+{
+    if (farm->to_iterbuf) {
+        farm->buf.close();
+        QFile::remove(farm->output);
+    }
+}
+
+static int coordinator(const QString& input, const QString& output, int width, int height,
+        const QString& socket_path, int local_workers, const QString& backend, int threads, const char* argv0)
+{
+    State state;
+    state.load(input, true);
+    Farm farm(state);
+    farm.offset = colormap_offset(farm.state, 0.0);
+    farm.width = width;
+    farm.height = height;
+    farm.output = output;
+    farm.to_iterbuf = output.endsWith(".iterbuf", Qt::CaseInsensitive);
+    if (!farm.to_iterbuf && farm.state.fractal.mandelbrot.distance_estimation) {
+        fprintf(stderr, "%s: distance estimation is not supported\n", qPrintable(input));
+        return 1;
+    }
+    farm.buf.state = farm.state;
+    farm.buf.width = width;
+    farm.buf.height = height;
+    farm.buf.format = iterbuf_choose_format(farm.state.fractal.mandelbrot.max_iter, farm.state.fractal.mandelbrot.smooth);
+    farm.buf.compressed = true;
+    if (farm.to_iterbuf) {
+        if (!farm.buf.create(output)) {
+            fprintf(stderr, "Cannot create %s\n", qPrintable(output));
+            return 1;
+        }
+    } else {
+        farm.image = QImage(width, height, QImage::Format_RGBX8888);
+        if (farm.image.isNull()) {
+            fprintf(stderr, "Image is too large; use an .iterbuf output\n");
+            return 1;
+        }
+        if (farm.state.colormap.equalize)
+            farm.image_values.resize(static_cast<size_t>(width) * height);
+    }
+    int32_t size[2] = { width, height };
+    farm.job.resize(sizeof(size));
+    std::memcpy(farm.job.data(), size, sizeof(size));
+    std::vector<unsigned char> state_data = farm.state.serialize();
+    farm.job.insert(farm.job.end(), state_data.begin(), state_data.end());
+    for (int t = 0; t < farm.tiles(); t++)
+        farm.pending.push_back(t);
+    farm.attempts.resize(farm.tiles(), 0);
+    farm.finished = 0;
+    farm.failed = false;
+    farm.workers = 0;
+    farm.next_tile_to_write = 0;
+
+    struct sockaddr_un addr;
+    if (!socket_address(socket_path, &addr)) {
+        remove_output(&farm);
+        return 1;
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(addr.sun_path);
+    if (bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listen_fd, 16) != 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", qPrintable(socket_path), std::strerror(errno));
+        remove_output(&farm);
+        return 1;
+    }
+    fprintf(stderr, "%d tiles, listening on %s\n", farm.tiles(), qPrintable(socket_path));
+    // Split the cores among the local workers by default
+    if (threads == 0 && local_workers > 0)
+        threads = std::max(1, Engine().threads() / local_workers);
+    std::vector<pid_t> children;
+    for (int i = 0; i < local_workers; i++)
+        children.push_back(spawn_worker(argv0, socket_path, backend, threads));
+
+    // Accept workers until the job is done. Without local workers, wait for
+    // external ones indefinitely; otherwise, give up when all local workers
+    // are gone and no other worker is connected.
+    QElapsedTimer timer;
+    timer.start();
+    std::vector<std::thread> servers;
+    int worker_id = 0;
+    int live_children = children.size();
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(farm.mutex);
+            if (farm.done())
+                break;
+            if (local_workers > 0 && live_children == 0 && farm.workers == 0) {
+                fprintf(stderr, "All workers are gone\n");
+                farm.failed = true;
+                farm.cond.notify_all();
+                break;
+            }
+        }
+        struct pollfd pfd = { listen_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) > 0) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0)
+                servers.push_back(std::thread(serve, &farm, fd, worker_id++));
+        }
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            live_children--;
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                fprintf(stderr, "local worker process %d died\n", static_cast<int>(pid));
+        }
+    }
+    close(listen_fd);
+    unlink(addr.sun_path);
+    for (size_t i = 0; i < servers.size(); i++)
+        servers[i].join();
+    for (int i = 0; i < live_children; i++)
+        wait(NULL);
+
+    bool ok = !farm.failed;
+    if (ok && !farm.to_iterbuf && farm.state.colormap.equalize) {
+        farm.equalization.update();
+        for (int y = 0; y < height; y++)
+            farm.coloring.apply(farm.offset, farm.image_values.data() + static_cast<size_t>(y) * width, width,
+                    farm.image.scanLine(y), &farm.equalization);
+    }
+    if (ok)
+        ok = (farm.to_iterbuf ? farm.buf.close() : farm.image.save(output));
+    if (!ok) {
+        remove_output(&farm);
+        fprintf(stderr, "%s FAILED\n", qPrintable(output));
+        return 1;
+    }
+    fprintf(stderr, "%s done (%d tiles, %d workers, %.2f s)\n", qPrintable(output),
+            farm.tiles(), worker_id, timer.elapsed() / 1000.0);
+    return 0;
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [options] fractal.fract output.png|output.iterbuf\n"
+            "       %s --worker [options] SOCKET\n"
+            "Options:\n"
+            "  -w, --width=W        Image width (default 1920)\n"
+            "  -h, --height=H       Image height (default 1080)\n"
+            "  -S, --socket=PATH    Socket of the coordinator (default: in the\n"
+            "                       temporary directory)\n"
+            "  -n, --workers=N      Number of local workers to start (default 1)\n"
+            "Worker options, also passed to local workers:\n"
+            "  -b, --backend=B      Render with cpu, fixed, or gl (default cpu)\n"
+            "  -t, --threads=T      Number of threads per worker (default: the cores\n"
+            "                       divided among the local workers, or one per\n"
+            "                       core for a single worker)\n",
+            argv0, argv0);
+}
+
+int main(int argc, char* argv[])
+{
+    int width = 1920;
+    int height = 1080;
+    QString socket_path;
+    int local_workers = 1;
+    QString backend = "cpu";
+    int threads = 0;
+    bool is_worker = false;
+
+    const struct option options[] = {
+        { "width",   required_argument, NULL, 'w' },
+        { "height",  required_argument, NULL, 'h' },
+        { "socket",  required_argument, NULL, 'S' },
+        { "workers", required_argument, NULL, 'n' },
+        { "backend", required_argument, NULL, 'b' },
+        { "threads", required_argument, NULL, 't' },
+        { "worker",  no_argument,       NULL, 'W' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "w:h:S:n:b:t:", options, NULL)) != -1) {
+        switch (c) {
+        case 'w':
+            width = atoi(optarg);
+            break;
+        case 'h':
+            height = atoi(optarg);
+            break;
+        case 'S':
+            socket_path = optarg;
+            break;
+        case 'n':
+            local_workers = atoi(optarg);
+            break;
+        case 'b':
+            backend = optarg;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'W':
+            is_worker = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if ((is_worker && optind != argc - 1) || (!is_worker && optind != argc - 2)
+            || (backend != "cpu" && backend != "fixed" && backend != "gl")
+            || width < 1 || height < 1 || local_workers < 0 || threads < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (is_worker)
+        return worker(argv[optind], backend, threads, argc, argv);
+
+    QString input = argv[optind];
+    if (!QFileInfo(input).isReadable()) {
+        fprintf(stderr, "%s is not readable\n", qPrintable(input));
+        return 1;
+    }
+    if (socket_path.isEmpty())
+        socket_path = QDir(QDir::tempPath()).filePath(QString("glfract-farm-%1.sock").arg(getpid()));
+    return coordinator(input, argv[optind + 1], width, height, socket_path, local_workers, backend, threads, argv[0]);
+}
@@ -0,0 +1,178 @@
+#version 430
+
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fractal.glsl"
+
+
+/*
+ *
+ * PART 4: persistent workgroups with a tile queue
+ *
+ */
+
+/* The fragment shader gives every pixel the same scheduling weight, so a warp
+ * that contains a single interior pixel runs to the maximum number of
+ * iterations while its other threads idle. Here, a fixed number of
+ * workgroups stays resident and pulls tiles of TILE_SIZE x TILE_SIZE pixels
+ * from a global atomic counter. Each workgroup holds one pixel per invocation
+ * in shared memory and iterates all of them for at most ITERATION_BATCH
+ * iterations. Finished pixels are written to the result image, the remaining
+ * ones are compacted to the start of the shared arrays, and the free slots are
+ * refilled with pixels from the current tile.
+ * Some implementations, e.g. llvmpipe, limit the number of loop iterations
+ * per invocation. Therefore, each workgroup takes at most tiles_per_group
+ * tiles from the queue in one dispatch, and the queue is drained by several
+ * dispatches; see Renderer::render_fractal(). */
+
+// SLOTS is the workgroup size and must be TILE_SIZE * TILE_SIZE
+#define TILE_SIZE 8
+#define SLOTS 64
+#define ITERATION_BATCH 64
+
+layout(local_size_x = SLOTS) in;
+
+layout(std430, binding = 0) buffer queue_buffer {
+    uint next_tile;
+};
+
+#if MANDELBROT_DISTANCE
+layout(rg32f, binding = 0) uniform writeonly image2D result;
+#else
+layout(r32f, binding = 0) uniform writeonly image2D result;
+#endif
+
+uniform FLOAT x0;
+uniform FLOAT xw;
+uniform FLOAT y0;
+uniform FLOAT yw;
+uniform ivec2 size;
+uniform int tiles_per_group;
+
+shared FLOAT slot_z_re[SLOTS];
+shared FLOAT slot_z_im[SLOTS];
+#if MANDELBROT_DISTANCE
+shared FLOAT slot_dz_re[SLOTS];
+shared FLOAT slot_dz_im[SLOTS];
+#endif
+shared int slot_i[SLOTS];
+shared int slot_pixel[SLOTS];
+shared uint active_slots;
+shared uint new_slots;
+shared uint tile;
+shared uint tile_pixel;
+shared uint tiles_taken;
+
+// The pixel center, computed from the pixel size so that no float texture
+// coordinates limit the precision
+complex_t coord(ivec2 p)
+{
+    FLOAT re = xadd(x0, xmul(to_FLOAT(float(p.x) + 0.5), xdiv(xw, to_FLOAT(float(size.x)))));
+    FLOAT im = xadd(y0, xmul(to_FLOAT(float(p.y) + 0.5), xdiv(yw, to_FLOAT(float(size.y)))));
+    return complex_t(re, im);
+}
+
+void main(void)
+{
+    uint slot = gl_LocalInvocationID.x;
+    int tiles_x = (size.x + TILE_SIZE - 1) / TILE_SIZE;
+    uint tiles = uint(tiles_x * ((size.y + TILE_SIZE - 1) / TILE_SIZE));
+    if (slot == 0u) {
+        active_slots = 0u;
+        tile_pixel = uint(SLOTS);
+        tiles_taken = 0u;
+    }
+    barrier();
+
+    for (;;) {
+        // Get a new tile when the current one is exhausted, and hand out as
+        // many of its pixels as there are free slots
+        if (slot == 0u) {
+            if (tile_pixel == uint(SLOTS)) {
+                if (tiles_taken < uint(tiles_per_group)) {
+                    tile = atomicAdd(next_tile, 1u);
+                    tiles_taken++;
+                } else {
+                    tile = tiles;
+                }
+                tile_pixel = 0u;
+            }
+            new_slots = (tile < tiles ? min(uint(SLOTS) - active_slots, uint(SLOTS) - tile_pixel) : 0u);
+        }
+        barrier();
+        uint kept = active_slots;
+        uint added = new_slots;
+        if (kept + added == 0u)
+            break;
+
+        // Load the state of this slot, or start a new pixel in it
+        int pixel = -1;
+        complex_t z;
+        complex_t dz = complex_t(to_FLOAT(0), to_FLOAT(0));
+        int i = 0;
+        if (slot < kept) {
+            pixel = slot_pixel[slot];
+            z = complex_t(slot_z_re[slot], slot_z_im[slot]);
+#if MANDELBROT_DISTANCE
+            dz = complex_t(slot_dz_re[slot], slot_dz_im[slot]);
+#endif
+            i = slot_i[slot];
+        } else if (slot < kept + added) {
+            uint t = tile_pixel + (slot - kept);
+            ivec2 p = ivec2(int(tile) % tiles_x, int(tile) / tiles_x) * TILE_SIZE
+                + ivec2(int(t) % TILE_SIZE, int(t) / TILE_SIZE);
+            if (p.x < size.x && p.y < size.y)
+                pixel = p.y * size.x + p.x;
+            z = complex_t(to_FLOAT(0), to_FLOAT(0));
+        }
+        barrier();
+        if (slot == 0u) {
+            tile_pixel += added;
+            active_slots = 0u;
+        }
+        barrier();
+
+        // Iterate, and write the result or keep the pixel for the next batch
+        if (pixel >= 0) {
+            ivec2 p = ivec2(pixel % size.x, pixel / size.x);
+            complex_t c = coord(p);
+            FLOAT abssqrz = to_FLOAT(0);
+            int batch_end = min(i + ITERATION_BATCH, MANDELBROT_MAX_ITERATIONS);
+            bool escaped = iterate(c, z, dz, i, batch_end, abssqrz);
+            if (escaped || i == MANDELBROT_MAX_ITERATIONS) {
+#if MANDELBROT_DISTANCE
+                imageStore(result, p, vec4(normalized_iterations(i, abssqrz),
+                            distance_estimate(i, dz, abssqrz, xdiv(xw, to_FLOAT(float(size.x)))), 0.0, 0.0));
+#else
+                imageStore(result, p, vec4(normalized_iterations(i, abssqrz)));
+#endif
+            } else {
+                uint s = atomicAdd(active_slots, 1u);
+                slot_pixel[s] = pixel;
+                slot_z_re[s] = z.re;
+                slot_z_im[s] = z.im;
+#if MANDELBROT_DISTANCE
+                slot_dz_re[s] = dz.re;
+                slot_dz_im[s] = dz.im;
+#endif
+                slot_i[s] = i;
+            }
+        }
+        barrier();
+    }
+}
@@ -17,410 +17,179 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#if HAVE_ARB_GPU_SHADER5
-# extension GL_ARB_gpu_shader5 : require
-# define PRECISE precise
-#else
-# define PRECISE
-#endif
+#include "fractal.glsl"
+
 
 /*
  *
- * PART 1: floating point type with basic operations
+ * PART 4: the main function
  *
  */
 
-/* This implements basic arithmetic operations for a FLOAT type, which can be
- * one of the following:
- * - float: single precision floating point, natively supported
- * - double: double precision floating point, natively supported
- * - doublefloat: emulated extended precision based on a pair of floats
- * - doubledouble: emulated extended precision based on a pair of doubles
- * The emulated types are implemented using algorithms from the following papers:
- * - "A Floating-Point Technique for Extending the Available Precision" by T. J.
- *   Dekker
- * - "Library for Double-Double and Quad-Double Arithmetic" by Yozo Hida, Xiaoye
- *   S. Li, David H. Bailey
- * - "Extended-Precision Floating-Point Numbers for GPU Computation" by Andrew
- *   Thall
- */
-
-// FLOAT_TYPE uses the same values as float_type in the C++ source
-#if (FLOAT_TYPE == 0)
-# define FLOAT float
-# define FLOAT_EMU 0
-#elif (FLOAT_TYPE == 1)
-# extension GL_ARB_gpu_shader_fp64 : require
-# define FLOAT double
-# define FLOAT_EMU 0
-#elif (FLOAT_TYPE == 2)
-# define FLOAT vec2
-# define FLOAT_EMU 1
-# define BASEFLOAT float
-# define BASEVEC2 vec2
-# define BASEVEC4 vec4
-const float SPLIT = 4097.0; // (1 << 12) + 1;
-#elif (FLOAT_TYPE == 3)
-# extension GL_ARB_gpu_shader_fp64 : require
-# define FLOAT dvec2
-# define FLOAT_EMU 1 
-# define BASEFLOAT double
-# define BASEVEC2 dvec2
-# define BASEVEC4 dvec4
-const double SPLIT = 134217729.0LF; // (1 << 27) + 1;
-#endif
-
-
-/* Building blocks for emulation based on pairs */
-
-#if FLOAT_EMU
-
-BASEVEC2 two_add(BASEFLOAT a, BASEFLOAT b)
-{
-    PRECISE BASEFLOAT s = a + b;
-    PRECISE BASEFLOAT v = s - a;
-    PRECISE BASEFLOAT e = (a - (s - v)) + (b - v);
-    return BASEVEC2(s, e);
-}
-BASEVEC2 quick_two_add(BASEFLOAT a, BASEFLOAT b) // requires abs(a) >= abs(b)
-{
-    PRECISE BASEFLOAT s = a + b;
-    PRECISE BASEFLOAT e = b - (s - a);
-    return BASEVEC2(s, e);
-}
-BASEVEC4 two_add_comp(BASEVEC2 a, BASEVEC2 b)
-{
-    PRECISE BASEVEC2 s = a + b;
-    PRECISE BASEVEC2 v = s - a;
-    PRECISE BASEVEC2 e = (a - (s - v)) + (b - v);
-    return BASEVEC4(s.x, e.x, s.y, e.y);
-}
-BASEVEC4 two_sub_comp(BASEVEC2 a, BASEVEC2 b)
-{
-    PRECISE BASEVEC2 s = a - b;
-    PRECISE BASEVEC2 v = s - a;
-    PRECISE BASEVEC2 e = (a - (s - v)) - (b + v);
-    return BASEVEC4(s.x, e.x, s.y, e.y);
-}
-BASEVEC2 split(BASEFLOAT a)
-{
-    PRECISE BASEFLOAT t = SPLIT * a;
-    PRECISE BASEFLOAT b_hi = t - (t - a);
-    PRECISE BASEFLOAT b_lo = a - b_hi;
-    return BASEVEC2(b_hi, b_lo);
-}
-BASEVEC4 split_comp(BASEVEC2 a)
-{
-    PRECISE BASEVEC2 t = SPLIT * a;
-    PRECISE BASEVEC2 b_hi = t - (t - a);
-    PRECISE BASEVEC2 b_lo = a - b_hi;
-    return BASEVEC4(b_hi.x, b_lo.x, b_hi.y, b_lo.y);
-}
-BASEVEC2 two_mul(BASEVEC2 ab)
-{
-    PRECISE BASEFLOAT p = ab.x * ab.y;
-    PRECISE BASEVEC4 s = split_comp(ab);
-    PRECISE BASEFLOAT e = ((s.x * s.z - p) + s.x * s.w + s.y * s.z) + s.y * s.w;
-    return BASEVEC2(p, e);
-}
-BASEVEC2 two_sqr(BASEFLOAT a)
-{
-    PRECISE BASEFLOAT p = a * a;
-    PRECISE BASEVEC2 s = split(a);
-    PRECISE BASEFLOAT e = ((s.x * s.x - p) + BASEFLOAT(2) * s.x * s.y) + s.y * s.y;
-    return BASEVEC2(p, e);
-}
-
-BASEVEC2 emu_add(BASEVEC2 a, BASEFLOAT b)
-{
-    PRECISE BASEVEC2 s = two_add(a.x, b);
-    s.y += a.y;
-    PRECISE BASEVEC2 r = quick_two_add(s.x, s.y);
-    return r;
-}
-BASEVEC2 emu_add(BASEVEC2 a, BASEVEC2 b)
-{
-    PRECISE BASEVEC4 st = two_add_comp(a, b);
-    st.y += st.z;
-    st.xy = quick_two_add(st.x, st.y);
-    st.y += st.w;
-    st.xy = quick_two_add(st.x, st.y);
-    return st.xy;
-}
-BASEVEC2 emu_sub(BASEVEC2 a, BASEVEC2 b)
-{
-    PRECISE BASEVEC4 st = two_sub_comp(a, b);
-    st.y += st.z;
-    st.xy = quick_two_add(st.x, st.y);
-    st.y += st.w;
-    st.xy = quick_two_add(st.x, st.y);
-    return st.xy;
-}
-BASEVEC2 emu_mul(BASEVEC2 a, BASEFLOAT b)
-{
-    PRECISE BASEVEC2 p = two_mul(BASEVEC2(a.x, b));
-    p.y += a.y * b;
-    PRECISE BASEVEC2 r = quick_two_add(p.x, p.y);
-    return r;
-}
-BASEVEC2 emu_mul(BASEVEC2 a, BASEVEC2 b)
-{
-    PRECISE BASEVEC2 p = two_mul(BASEVEC2(a.x, b.x));
-    p.y += dot(a, b.yx);
-    PRECISE BASEVEC2 r = quick_two_add(p.x, p.y);
-    return r;
-}
-BASEVEC2 emu_div(BASEVEC2 a, BASEVEC2 b)
-{
-    PRECISE BASEFLOAT q0 = a.x / b.x;
-    PRECISE BASEVEC2 r = emu_sub(a, emu_mul(b, q0));
-    PRECISE BASEFLOAT q1 = r.x / b.x;
-    r = emu_sub(r, emu_mul(b, q1));
-    PRECISE BASEFLOAT q2 = r.x / b.x;
-    r = emu_add(quick_two_add(q0, q1), q2);
-    return r;
-}
-BASEVEC2 emu_sqr(BASEFLOAT a)
-{
-    PRECISE BASEVEC2 p = two_sqr(a);
-    PRECISE BASEVEC2 r = quick_two_add(p.x, p.y);
-    return r;
-}
-BASEVEC2 emu_sqr(BASEVEC2 a)
-{
-    PRECISE BASEVEC2 p = two_sqr(a.x);
-    p.y += BASEFLOAT(2) * a.x * a.y;
-    PRECISE BASEVEC2 s = quick_two_add(p.x, p.y);
-    return s;
-}
-BASEVEC2 emu_sqrt(BASEVEC2 a)
-{
-    PRECISE BASEFLOAT x = inversesqrt(a.x);
-    PRECISE BASEFLOAT ax = a.x * x;
-    PRECISE BASEFLOAT diff = emu_sub(a, emu_sqr(ax)).x;
-    PRECISE BASEFLOAT prod = diff * x * BASEFLOAT(0.5);
-    PRECISE BASEVEC2 r = two_add(prod, ax);
-    return r;
-}
-
-#endif
-
-/* Unify operations for native and emulated types. Necessary because
- * there is no operator overloading in GLSL. */
-
-FLOAT to_FLOAT(float x)
-{
-#if FLOAT_EMU
-    return FLOAT(x, BASEFLOAT(0));
-#else
-    return FLOAT(x);
-#endif
-}
-
-float to_float(FLOAT x)
-{
-#if FLOAT_EMU
-    return float(x.x);
-#else
-    return float(x);
-#endif
-}
-
-FLOAT xabs(FLOAT a)
-{
-#if FLOAT_EMU
-    return (a.x < BASEFLOAT(0) ? -a : a);
-#else
-    return abs(a);
-#endif
-}
-
-int xcmp(FLOAT a, float b)
-{
-#if FLOAT_EMU
-    if (a.x < b || (a.x == b && a.y < BASEFLOAT(0)))
-        return -1;
-    else if (a.x == b && a.y == 0.0)
-        return 0;
-    else //if (a.x > b || (a.x == b && a.y > BASEFLOAT(0.0)))
-        return +1;
-#else
-    return (a < b ? -1 : a > b ? +1 : 0);
-#endif
-}
-
-FLOAT xadd(FLOAT a, FLOAT b)
-{
-#if FLOAT_EMU
-    return emu_add(a, b);
-#else
-    return a + b;
-#endif
-}
-
-FLOAT xsub(FLOAT a, FLOAT b)
-{
-#if FLOAT_EMU
-    return emu_sub(a, b);
-#else
-    return a - b;
-#endif
-}
+smooth in vec2 vxy;
 
-FLOAT xmul(FLOAT a, FLOAT b)
-{
-#if FLOAT_EMU
-    return emu_mul(a, b);
-#else
-    return a * b;
+uniform FLOAT x0;
+uniform FLOAT xw;
+uniform FLOAT y0;
+uniform FLOAT yw;
+uniform ivec2 size;
+
+complex_t coord(vec2 t)
+{
+    FLOAT re = xadd(x0, xmul(to_FLOAT(t.x), xw));
+    FLOAT im = xadd(y0, xmul(to_FLOAT(t.y), yw));
+    return complex_t(re, im);
+}
+
+FLOAT pixel_size()
+{
+    return xdiv(xw, to_FLOAT(float(size.x)));
+}
+
+#if ADAPTIVE_SUPERSAMPLING
+
+/* Adaptive supersampling: the single-sample result of the normal fractal pass
+ * is given in the texture 'first_pass'. If the iteration values in the
+ * neighborhood of a pixel differ by more than the threshold, additional samples
+ * are computed on a 2x2 grid, and if these still differ, on the full grid with
+ * max_samples x max_samples subpixels. The colors of all samples are averaged.
+ * The color lookup must match coloring-fs.glsl.
+ * With MANDELBROT_DISTANCE, the distance estimates decide instead: a pixel
+ * gets more samples only if the boundary of the set passes through it, and
+ * the full grid only if the boundary also passes through the area of one of
+ * the 2x2 samples. */
+
+uniform sampler2D first_pass;
+uniform sampler2D colormap;
+uniform bool reverse;
+uniform float offset;
+uniform bool equalize;
+uniform usampler2D histogram_sums;
+uniform int bins;
+uniform float threshold;  // in normalized iteration values
+uniform int max_samples;  // per axis, >= 2
+
+layout(location = 0) out vec4 fcolor;
+layout(location = 1) out float fsamples;
+
+float equalized(float f)
+{
+    float total = float(texelFetch(histogram_sums, ivec2(bins - 1, 0), 0).r);
+    if (!(f > 0.0) || total <= 0.0)
+        return f;
+    float x = min(f, 1.0) * float(bins);
+    int b = min(int(x), bins - 1);
+    float lo = (b > 0 ? float(texelFetch(histogram_sums, ivec2(b - 1, 0), 0).r) : 0.0);
+    float hi = float(texelFetch(histogram_sums, ivec2(b, 0), 0).r);
+    return (lo + (x - float(b)) * (hi - lo)) / total;
+}
+
+vec4 color(vec2 fd)
+{
+    float f = fd.x;
+    if (equalize)
+        f = equalized(f);
+    if (reverse)
+        f = 1.0 - f;
+    float c = offset + f;
+    if (c > 1.0)
+        c -= 1.0;
+    else if (c < 0.0)
+        c += 1.0;
+    vec4 col = texture(colormap, vec2(c, 0.5));
+#if MANDELBROT_DISTANCE
+    if (fd.y > 0.0)
+        col.rgb *= min(fd.y, 1.0);
 #endif
-}
-
-FLOAT xdiv(FLOAT a, FLOAT b)
-{
-#if FLOAT_EMU
-    return emu_div(a, b);
+    return col;
+}
+
+// Add the colors of n x n subsamples to sum, and return whether they differ
+// enough from the single sample fd to need the full grid
+bool add_subsamples(int n, vec2 fd, inout vec4 sum)
+{
+    vec2 pixel = 1.0 / vec2(size);
+    float fmin = fd.x;
+    float fmax = fd.x;
+    bool refine = false;
+    for (int sy = 0; sy < n; sy++) {
+        for (int sx = 0; sx < n; sx++) {
+            vec2 subpixel = (vec2(sx, sy) + 0.5) / float(n) - 0.5;
+            vec2 g = fractal(coord(vxy + subpixel * pixel), pixel_size());
+#if MANDELBROT_DISTANCE
+            refine = refine || (g.y > 0.0 && g.y < 0.5) || ((g.y > 0.0) != (fd.y > 0.0));
 #else
-    return a / b;
+            fmin = min(fmin, g.x);
+            fmax = max(fmax, g.x);
 #endif
-}
-
-FLOAT xsqr(FLOAT a)
-{
-#if FLOAT_EMU
-    return emu_sqr(a);
-#else
-    return a * a;
+            sum += color(g);
+        }
+    }
+#if !MANDELBROT_DISTANCE
+    refine = (fmax - fmin > threshold);
 #endif
+    return refine;
 }
 
-FLOAT xsqrt(FLOAT a)
+void main(void)
 {
-#if FLOAT_EMU
-    return emu_sqrt(a);
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    vec2 fd = texelFetch(first_pass, p, 0).rg;
+#if MANDELBROT_DISTANCE
+    // The boundary passes through an exterior pixel if its distance estimate
+    // is less than a pixel, and through an interior pixel (distance 0) if
+    // one of its neighbors is exterior
+    bool refine = (fd.y > 0.0 && fd.y < 1.0);
+    if (fd.y <= 0.0) {
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                float g = texelFetch(first_pass, clamp(p + ivec2(dx, dy), ivec2(0), size - 1), 0).g;
+                refine = refine || g > 0.0;
+            }
+        }
+    }
 #else
-    return sqrt(a);
-#endif
-}
-
-
-/*
- *
- * PART 2: complex math based on the FLOAT type
- *
- */
-
-struct complex_t {
-    FLOAT re, im;
-};
-
-complex_t add(complex_t a, complex_t b)
-{
-    return complex_t(xadd(a.re, b.re), xadd(a.im, b.im));
-}
-
-complex_t sub(complex_t a, complex_t b)
-{
-    return complex_t(xsub(a.re, b.re), xsub(a.im, b.im));
-}
-
-complex_t mul(complex_t a, complex_t b)
-{
-    return complex_t(xsub(xmul(a.re, b.re), xmul(a.im, b.im)),
-            xadd(xmul(a.im, b.re), xmul(a.re, b.im)));
-}
-
-complex_t sqr(complex_t a)
-{
-    complex_t r;
-    r.re = xsub(xsqr(a.re), xsqr(a.im));
-    r.im = xmul(a.re, a.im);
-    r.im = xadd(r.im, r.im);
-    return r;
-}
-
-complex_t powui(complex_t a, int i) // i >= 1
-{
-    complex_t r = a;
-    int j = 1;
-    while (i >= 2 * j) {
-        r = sqr(r);
-        j *= 2;
+    float fmin = fd.x;
+    float fmax = fd.x;
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            float g = texelFetch(first_pass, clamp(p + ivec2(dx, dy), ivec2(0), size - 1), 0).r;
+            fmin = min(fmin, g);
+            fmax = max(fmax, g);
+        }
     }
-    for (int k = j; k < i; k++) {
-        r = mul(r, a);
+    bool refine = (fmax - fmin > threshold);
+#endif
+    vec4 sum = color(fd);
+    int samples = 1;
+    if (refine) {
+        refine = add_subsamples(2, fd, sum);
+        samples += 4;
+        if (refine && max_samples > 2) {
+            add_subsamples(max_samples, fd, sum);
+            samples += max_samples * max_samples;
+        }
     }
-    return r;
+    fcolor = sum / float(samples);
+    fsamples = float(samples);
 }
 
-FLOAT abs_sqr(complex_t a)
-{
-    return xadd(xsqr(a.re), xsqr(a.im));
-}
-
-FLOAT abs(complex_t a)
-{
-    return xsqrt(abs_sqr(a));
-}
+#elif MANDELBROT_DISTANCE
 
+layout(location = 0) out vec2 fcolor;
 
-/*
- *
- * PART 3: the fractal set
- *
- */
-
-// MANDELBROT_POWER: >= 2
-// MANDELBROT_LN_POWER: ln(MANDELBROT_POWER)
-// MANDELBROT_MAX_ITERATIONS: e.g. 256
-// MANDELBROT_BAILOUT: e.g. 4
-// MANDELBROT_SMOOTH: 0 or 1
-
-#define M_LN2 0.69314718055994530942
-
-float fractal(complex_t c)
+void main(void)
 {
-    int i = 0;
-    complex_t z = complex_t(to_FLOAT(0), to_FLOAT(0));
-    FLOAT abssqrz;
-    do {
-        z = add(powui(z, MANDELBROT_POWER), c);
-        i++;
-        abssqrz = abs_sqr(z);
-    }
-    while (xcmp(abssqrz, MANDELBROT_BAILOUT) < 0
-            && i < MANDELBROT_MAX_ITERATIONS);
-    float ret = 0.0;
-    if (i < MANDELBROT_MAX_ITERATIONS) {
-#if MANDELBROT_SMOOTH
-        ret = float(i) - log(log(to_float(xsqrt(abssqrz))) / M_LN2) / MANDELBROT_LN_POWER;
-        ret /= float(MANDELBROT_MAX_ITERATIONS - 1);
-#else
-        ret = float(i) / float(MANDELBROT_MAX_ITERATIONS - 1);
-#endif
-    }
-    return ret;
+    fcolor = fractal(coord(vxy), pixel_size());
 }
 
-
-/*
- *
- * PART 4: the main function
- *
- */
-
-smooth in vec2 vxy;
-
-uniform FLOAT x0;
-uniform FLOAT xw;
-uniform FLOAT y0;
-uniform FLOAT yw;
+#else
 
 layout(location = 0) out float fcolor;
 
 void main(void)
 {
-    FLOAT re = xadd(x0, xmul(to_FLOAT(vxy.x), xw));
-    FLOAT im = xadd(y0, xmul(to_FLOAT(vxy.y), yw));
-    fcolor = fractal(complex_t(re, im));
+    fcolor = fractal(coord(vxy), pixel_size()).x;
 }
+
+#endif
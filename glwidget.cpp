@@ -18,41 +18,40 @@
 
 #include <cstring>
 #include <cmath>
+#include <vector>
+#include <algorithm>
 
-#include <QOpenGLShaderProgram>
 #include <QElapsedTimer>
+#include <QTimer>
+#include <QImage>
 #include <QKeyEvent>
 #include <QMouseEvent>
-#include <QFile>
+#include <QCursor>
 
 #include <quadmath.h>
 
 #include "glwidget.hpp"
+#include "coloring.hpp"
 
 
-template<typename T>
-static void float128_to_pair(__float128 x, T* p0, T* p1)
-{
-    *p0 = x;
-    *p1 = x - *p0;
-}
-
 GLWidget::GLWidget() : QOpenGLWidget(), QOpenGLFunctions_3_3_Core(),
     have_arb_gpu_shader_fp64(false), have_arb_gpu_shader5(false),
-    _state(),
-    _mandelbrot_power(-1), _mandelbrot_max_iter(-1), _mandelbrot_bailout(-1.0f), _mandelbrot_smooth(false),
-    _precision_type(precision_native_float),
-    _colormap_reupload(true), _colormap_timer(new QElapsedTimer),
-    _x0(NAN), _xw(NAN), _y0(NAN), _yw(NAN),
+    _state(), _renderer(), _colormap_timer(new QElapsedTimer), _readback_timer(new QTimer(this)),
+    _x0(NAN), _xw(NAN), _y0(NAN), _yw(NAN), _still(false),
     _zoom_in(false), _zoom_out(false), _shift(false), _zoom_step(0.02Q),
     _navig_start_x(0), _navig_start_y(0), _navig_event_x(0), _navig_event_y(0)
 {
     setMinimumSize(256, 256);
     setFocusPolicy(Qt::StrongFocus);
+    _readback_timer->setInterval(5);
+    connect(_readback_timer, SIGNAL(timeout()), this, SLOT(poll_image()));
 }
 
 GLWidget::~GLWidget()
 {
+    makeCurrent();
+    _renderer.cleanup();
+    doneCurrent();
 }
 
 int GLWidget::heightForWidth(int w) const
@@ -64,81 +63,46 @@ int GLWidget::heightForWidth(int w) const
 void GLWidget::initializeGL()
 {
     initializeOpenGLFunctions();
-    have_arb_gpu_shader_fp64 = context()->hasExtension("GL_ARB_gpu_shader_fp64");
-    have_arb_gpu_shader5 = context()->hasExtension("GL_ARB_gpu_shader5");
-    glUniform1d = reinterpret_cast<void (*)(GLint, GLdouble)>(context()->getProcAddress("glUniform1d"));
-    glUniform2d = reinterpret_cast<void (*)(GLint, GLdouble, GLdouble)>(context()->getProcAddress("glUniform2d"));
-
-    const float p[] = {
-        -1.0f, +1.0f, 0.0f,
-        +1.0f, +1.0f, 0.0f,
-        +1.0f, -1.0f, 0.0f,
-        -1.0f, -1.0f, 0.0f
-    };
-    const float t[] = {
-        0.0f, 1.0f,
-        1.0f, 1.0f,
-        1.0f, 0.0f,
-        0.0f, 0.0f
-    };
-    const unsigned int i[] = {
-        0, 1, 3, 1, 2, 3
-    };
-
-    GLuint vao;
-    glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
-    GLuint position_buffer;
-    glGenBuffers(1, &position_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, position_buffer);
-    glBufferData(GL_ARRAY_BUFFER, 4 * 3 * sizeof(float), p, GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(0);
-    GLuint texcoord_buffer;
-    glGenBuffers(1, &texcoord_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, texcoord_buffer);
-    glBufferData(GL_ARRAY_BUFFER, 4 * 2 * sizeof(float), t, GL_STATIC_DRAW);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(1);
-    GLuint index_buffer;
-    glGenBuffers(1, &index_buffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, 6 * sizeof(unsigned int), i, GL_STATIC_DRAW);
-
-    glGenTextures(1, &_fractal_tex);
-    glBindTexture(GL_TEXTURE_2D, _fractal_tex);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-    glGenFramebuffers(1, &_fractal_fbo);
-
-    glGenTextures(1, &_colormap_tex);
-    glBindTexture(GL_TEXTURE_2D, _colormap_tex);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-
-    _fractal_prg = new QOpenGLShaderProgram();
-    _coloring_prg = new QOpenGLShaderProgram();
-    _coloring_prg->addShaderFromSourceFile(QOpenGLShader::Vertex, ":vs.glsl");
-    _coloring_prg->addShaderFromSourceFile(QOpenGLShader::Fragment, ":coloring-fs.glsl");
-
-    glClearColor(0.0, 0.0, 0.0, 1.0);
-    glDisable(GL_DEPTH_TEST);
+    _renderer.initialize();
+    have_arb_gpu_shader_fp64 = _renderer.have_arb_gpu_shader_fp64;
+    have_arb_gpu_shader5 = _renderer.have_arb_gpu_shader5;
 }
 
 void GLWidget::set_state(const State& state)
 {
     _state = state;
+    _still = false;
     update();
 }
 
 void GLWidget::state_has_new_colormap()
 {
-    _colormap_reupload = true;
+    _renderer.state_has_new_colormap();
+    _still = false;
+}
+
+void GLWidget::cursor_point(__float128* x, __float128* y, __float128* view_size) const
+{
+    __float128 x0, xw, y0, yw;
+    _state.region(width(), height(), &x0, &xw, &y0, &yw);
+    float fx = 0.5f;
+    float fy = 0.5f;
+    QPoint pos = mapFromGlobal(QCursor::pos());
+    if (rect().contains(pos)) {
+        fx = (pos.x() + 0.5f) / width();
+        fy = 1.0f - ((pos.y() + 0.5f) / height());
+    }
+    *x = x0 + fx * xw;
+    *y = y0 + fy * yw;
+    *view_size = std::min(xw, yw);
+}
+
+float GLWidget::current_colormap_offset() const
+{
+    qint64 animation_nsecs = 0;
+    if (_state.colormap.animation && _colormap_timer->isValid())
+        animation_nsecs = _colormap_timer->nsecsElapsed();
+    return colormap_offset(_state, animation_nsecs / 1e9);
 }
 
 void GLWidget::paintGL()
@@ -149,70 +113,19 @@ void GLWidget::paintGL()
 
     // Colormap animation timing. Always done at start of drawing in the hope
     // of getting regular results.
-    qint64 animation_nsecs = 0;
     if (_state.colormap.animation) {
         if (!_colormap_timer->isValid())
             _colormap_timer->start();
-        else
-            animation_nsecs = _colormap_timer->nsecsElapsed();
     } else {
         if (_colormap_timer->isValid())
             _colormap_timer->invalidate();
     }
-
-    // Re-initialize resources where necessary
-    bool reinitialize_everything = !_fractal_prg->isLinked();
-    bool rebuild_fractal_prg = false;
-    if (reinitialize_everything
-            || _state.fractal.mandelbrot.power != _mandelbrot_power
-            || _state.fractal.mandelbrot.max_iter != _mandelbrot_max_iter
-            || _state.fractal.mandelbrot.bailout != _mandelbrot_bailout
-            || _state.fractal.mandelbrot.smooth != _mandelbrot_smooth
-            || _state.precision.type != _precision_type) {
-        rebuild_fractal_prg = true;
-        _mandelbrot_power = _state.fractal.mandelbrot.power;
-        _mandelbrot_max_iter = _state.fractal.mandelbrot.max_iter;
-        _mandelbrot_bailout = _state.fractal.mandelbrot.bailout;
-        _mandelbrot_smooth = _state.fractal.mandelbrot.smooth;
-        _precision_type = _state.precision.type;
-    }
-    if (rebuild_fractal_prg) {
-        QFile file(":fractal-fs.glsl");
-        file.open(QIODevice::ReadOnly);
-        QTextStream ts(&file);
-        QString fs_src = ts.readAll();
-        fs_src.replace("HAVE_ARB_GPU_SHADER5", have_arb_gpu_shader5 ? "1" : "0");
-        fs_src.replace("FLOAT_TYPE", QString::number(_precision_type));
-        fs_src.replace("MANDELBROT_POWER", QString::number(_mandelbrot_power));
-        fs_src.replace("MANDELBROT_LN_POWER", QString::number(std::log(static_cast<float>(_mandelbrot_power))));
-        fs_src.replace("MANDELBROT_MAX_ITERATIONS", QString::number(_mandelbrot_max_iter));
-        fs_src.replace("MANDELBROT_BAILOUT", QString::number(_mandelbrot_bailout));
-        fs_src.replace("MANDELBROT_SMOOTH", _mandelbrot_smooth ? "1" : "0");
-        _fractal_prg->removeAllShaders();
-        _fractal_prg->addShaderFromSourceFile(QOpenGLShader::Vertex, ":vs.glsl");
-        _fractal_prg->addShaderFromSourceCode(QOpenGLShader::Fragment, fs_src);
-        _fractal_prg->bind();
-    }
-    glActiveTexture(GL_TEXTURE0);
-    GLint fractal_tex_width, fractal_tex_height;
-    glBindTexture(GL_TEXTURE_2D, _fractal_tex);
-    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &fractal_tex_width);
-    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &fractal_tex_height);
-    if (reinitialize_everything || fractal_tex_width != w || fractal_tex_height != h) {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, w, h, 0, GL_RED, GL_FLOAT, NULL);
-        glBindFramebuffer(GL_FRAMEBUFFER, _fractal_fbo);
-        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, _fractal_tex, 0);
-    }
-    if (reinitialize_everything || _colormap_reupload) {
-        glBindTexture(GL_TEXTURE_2D, _colormap_tex);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_SRGB8, _state.colormap.colors.size() / 3, 1, 0,
-                GL_RGB, GL_UNSIGNED_BYTE, _state.colormap.colors.data());
-        _colormap_reupload = false;
-    }
+    float offset = current_colormap_offset();
 
     // Navigate
+    bool navigating = (_zoom_in || _zoom_out || _shift);
     float new_zoom = _state.navigation.zoom;
-    if (_zoom_in || _zoom_out || _shift) {
+    if (navigating) {
         if (_zoom_in || _zoom_out) {
             float fx = (_navig_event_x + 0.5f) / w;
             float fy = 1.0f - ((_navig_event_y + 0.5f) / h);
@@ -239,95 +152,101 @@ void GLWidget::paintGL()
         _state.navigation.zoom = new_zoom;
         emit navigate(_state.navigation.x, _state.navigation.y, _state.navigation.zoom);
     }
-    __float128 fractal_ar = _state.fractal.mandelbrot.xw / _state.fractal.mandelbrot.yw;
-    __float128 viewport_ar = static_cast<__float128>(w) / h;
-    if (viewport_ar >= fractal_ar) {
-        _xw = _state.fractal.mandelbrot.xw / _state.navigation.zoom;
-        _yw = _xw / viewport_ar;
+    _state.region(w, h, &_x0, &_xw, &_y0, &_yw);
+
+    // Render and display. Parts that are shown from coarser cached tiles
+    // are refined in the following frames. The first frame that does not
+    // navigate computes the exact pixels. Once the view is complete and
+    // still, the following frames add jittered samples for anti-aliasing
+    // until the renderer has enough of them.
+    bool next_frame;
+    if (_still && !navigating) {
+        next_frame = _renderer.accumulate(_state, _x0, _xw, _y0, _yw, offset, defaultFramebufferObject(), w, h);
     } else {
-        _yw = _state.fractal.mandelbrot.yw / _state.navigation.zoom;
-        _xw = _yw * viewport_ar;
+        bool complete = _renderer.render(_state, _x0, _xw, _y0, _yw, offset, defaultFramebufferObject(), w, h,
+                navigating);
+        _still = (complete && !navigating && !_state.colormap.animation);
+        next_frame = (!complete || navigating || _state.colormap.animation || _still);
     }
-    _x0 = _state.navigation.x - 0.5Q * _xw;
-    _y0 = _state.navigation.y - 0.5Q * _yw;
+    if (next_frame)
+        update();
+}
 
-    // Render the fractal into _fractal_tex
-    glBindFramebuffer(GL_FRAMEBUFFER, _fractal_fbo);
-    _fractal_prg->bind();
-    switch (_precision_type) {
-    case precision_native_float:
-        glUniform1f(_fractal_prg->uniformLocation("x0"), _x0);
-        glUniform1f(_fractal_prg->uniformLocation("xw"), _xw);
-        glUniform1f(_fractal_prg->uniformLocation("y0"), _y0);
-        glUniform1f(_fractal_prg->uniformLocation("yw"), _yw);
-        break;
-    case precision_native_double:
-        glUniform1d(_fractal_prg->uniformLocation("x0"), _x0);
-        glUniform1d(_fractal_prg->uniformLocation("xw"), _xw);
-        glUniform1d(_fractal_prg->uniformLocation("y0"), _y0);
-        glUniform1d(_fractal_prg->uniformLocation("yw"), _yw);
-        break;
-    case precision_emu_doublefloat:
-        {
-            float d0, d1;
-            float128_to_pair(_x0, &d0, &d1);
-            glUniform2f(_fractal_prg->uniformLocation("x0"), d0, d1);
-            float128_to_pair(_xw, &d0, &d1);
-            glUniform2f(_fractal_prg->uniformLocation("xw"), d0, d1);
-            float128_to_pair(_y0, &d0, &d1);
-            glUniform2f(_fractal_prg->uniformLocation("y0"), d0, d1);
-            float128_to_pair(_yw, &d0, &d1);
-            glUniform2f(_fractal_prg->uniformLocation("yw"), d0, d1);
-        }
-        break;
-    case precision_emu_doubledouble:
-        {
-            double d0, d1;
-            float128_to_pair(_x0, &d0, &d1);
-            glUniform2d(_fractal_prg->uniformLocation("x0"), d0, d1);
-            float128_to_pair(_xw, &d0, &d1);
-            glUniform2d(_fractal_prg->uniformLocation("xw"), d0, d1);
-            float128_to_pair(_y0, &d0, &d1);
-            glUniform2d(_fractal_prg->uniformLocation("y0"), d0, d1);
-            float128_to_pair(_yw, &d0, &d1);
-            glUniform2d(_fractal_prg->uniformLocation("yw"), d0, d1);
-        }
-        break;
-    }
-    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+QImage GLWidget::render_image(int w, int h, const supersampling_t& supersampling, float* samples_per_pixel)
+{
+    makeCurrent();
+    QImage img = _renderer.render_image(_state, current_colormap_offset(), w, h, supersampling, samples_per_pixel);
+    glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+    glViewport(0, 0, width() * devicePixelRatioF(), height() * devicePixelRatioF());
+    doneCurrent();
+    return img;
+}
 
-    // Display a colored version of _fractal_tex
+bool GLWidget::render_iterations(int w, int h, int tx, int ty, int tw, int th, float* values)
+{
+    makeCurrent();
+    bool ok = _renderer.render_iterations(_state, w, h, tx, ty, tw, th, values);
     glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
-    _coloring_prg->bind();
-    glUniform1i(_coloring_prg->uniformLocation("fractal"), 0);
-    glUniform1i(_coloring_prg->uniformLocation("colormap"), 1);
-    double colormap_offset = _state.colormap.start;
-    if (_state.colormap.animation) {
-        double animation_offset = (_state.colormap.animation_speed / 60.0) * (animation_nsecs / 1e9);
-        animation_offset -= std::floor(animation_offset);
-        if (_state.colormap.animation_reverse)
-            colormap_offset += animation_offset;
-        else
-            colormap_offset -= animation_offset;
+    glViewport(0, 0, width() * devicePixelRatioF(), height() * devicePixelRatioF());
+    doneCurrent();
+    return ok;
+}
+
+bool GLWidget::start_image(int w, int h, const supersampling_t& supersampling)
+{
+    makeCurrent();
+    bool ok = _renderer.start_image(_state, current_colormap_offset(), w, h, supersampling);
+    glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+    glViewport(0, 0, width() * devicePixelRatioF(), height() * devicePixelRatioF());
+    doneCurrent();
+    if (ok)
+        _readback_timer->start();
+    return ok;
+}
+
+bool GLWidget::image_pending() const
+{
+    return _renderer.image_pending();
+}
+
+void GLWidget::poll_image()
+{
+    if (!_renderer.image_pending()) {
+        _readback_timer->stop();
+        return;
+    }
+    makeCurrent();
+    if (!_renderer.image_ready()) {
+        doneCurrent();
+        return;
     }
-    if (colormap_offset > 1.0)
-        colormap_offset -= 1.0;
-    else if (colormap_offset < 0.0)
-        colormap_offset += 1.0;
-    glUniform1i(_coloring_prg->uniformLocation("reverse"), _state.colormap.reverse ? 1 : 0);
-    glUniform1f(_coloring_prg->uniformLocation("offset"), colormap_offset);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, _fractal_tex);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, _colormap_tex);
-    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    _readback_timer->stop();
+    float samples_per_pixel;
+    QImage img = _renderer.finish_image(&samples_per_pixel);
+    doneCurrent();
+    emit image_finished(img, samples_per_pixel);
+}
 
-    if (_zoom_in || _zoom_out || _shift || _state.colormap.animation)
-        update();
+bool GLWidget::start_iterations(int w, int h, int tx, int ty, int tw, int th)
+{
+    makeCurrent();
+    bool ok = _renderer.start_iterations(_state, w, h, tx, ty, tw, th);
+    glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+    glViewport(0, 0, width() * devicePixelRatioF(), height() * devicePixelRatioF());
+    doneCurrent();
+    return ok;
+}
+
+void GLWidget::finish_iterations(float* values)
+{
+    makeCurrent();
+    _renderer.finish_iterations(values);
+    doneCurrent();
 }
 
 void GLWidget::resizeGL(int w, int h)
 {
+    _still = false;
     glViewport(0, 0, w * devicePixelRatioF(), h * devicePixelRatioF());
 }
 
@@ -342,6 +261,7 @@ void GLWidget::keyPressEvent(QKeyEvent* event)
             _state.navigation.y = defaults.navigation.y;
             _state.navigation.zoom = defaults.navigation.zoom;
             emit navigate(defaults.navigation.x, defaults.navigation.y, defaults.navigation.zoom);
+            _still = false;
             update();
         }
         break;
@@ -22,9 +22,11 @@
 #include <QOpenGLFunctions_3_3_Core>
 
 #include "state.hpp"
+#include "renderer.hpp"
 
-class QOpenGLShaderProgram;
 class QElapsedTimer;
+class QTimer;
+class QImage;
 
 class GLWidget : public QOpenGLWidget, protected QOpenGLFunctions_3_3_Core
 {
@@ -36,33 +38,25 @@ public:
 private:
     // The state to render next
     State _state;
-    // GLSL shader compile-time constants
-    int _mandelbrot_power;
-    int _mandelbrot_max_iter;
-    float _mandelbrot_bailout;
-    bool _mandelbrot_smooth;
-    precision_type_t _precision_type;
-    // Colormap reload flag
-    bool _colormap_reupload;
+    // The GPU rendering pipeline
+    Renderer _renderer;
     // Colormap animation timer
     QElapsedTimer *_colormap_timer;
+    // Polling timer for asynchronous image readback
+    QTimer* _readback_timer;
     // Last shown fractal region
     __float128 _x0, _xw, _y0, _yw;
+    // Whether the last frame showed the state completely and the view is
+    // still, so that the following frames can accumulate jittered samples
+    bool _still;
     // Navigation variables
     bool _zoom_in, _zoom_out, _shift;
     __float128 _zoom_step;
     __float128 _shift_start_x0, _shift_start_y0;
     int _navig_start_x, _navig_start_y;
     int _navig_event_x, _navig_event_y;
-    // GL resources
-    QOpenGLShaderProgram* _fractal_prg;
-    QOpenGLShaderProgram* _coloring_prg;
-    GLuint _fractal_fbo;
-    GLuint _fractal_tex;
-    GLuint _colormap_tex;
-    // GL extensions that are not available via QOpenGLFunctions_3_3_Core
-    void (*glUniform1d)(GLint location, GLdouble v0);
-    void (*glUniform2d)(GLint location, GLdouble v0, GLdouble v1);
+
+    float current_colormap_offset() const;
 
 public:
     GLWidget();
@@ -73,8 +67,41 @@ public:
     void set_state(const State& state);
     void state_has_new_colormap();
 
+    // The point of the complex plane under the mouse cursor, or the center
+    // of the view if the cursor is outside the widget, and the smaller of the
+    // view's extents in the complex plane
+    void cursor_point(__float128* x, __float128* y, __float128* view_size) const;
+
+    // Render the current state into an image of the given size, independent
+    // of the widget size. The average number of samples per pixel is returned
+    // in samples_per_pixel if it is not NULL.
+    QImage render_image(int w, int h, const supersampling_t& supersampling, float* samples_per_pixel = NULL);
+
+    // Render the normalized iteration values of the tile (tx, ty, tw, th) of
+    // an image of size w x h. Tile coordinates and the resulting rows go from
+    // top to bottom.
+    bool render_iterations(int w, int h, int tx, int ty, int tw, int th, float* values);
+
+    // Start rendering the current state into an image like render_image(),
+    // without waiting for the result. The image_finished() signal is emitted
+    // when the image is available. Returns false if the size is not
+    // supported. Only one image can be pending.
+    bool start_image(int w, int h, const supersampling_t& supersampling);
+    bool image_pending() const;
+
+    // Asynchronous tile rendering like render_iterations(): start the
+    // rendering and transfer of a tile, and wait for the oldest started tile.
+    // Start the next tile before finishing the previous one so that both
+    // overlap.
+    bool start_iterations(int w, int h, int tx, int ty, int tw, int th);
+    void finish_iterations(float* values);
+
 signals:
     void navigate(__float128 x, __float128 y, __float128 zoom);
+    void image_finished(const QImage& img, float samples_per_pixel);
+
+private slots:
+    void poll_image();
 
 protected:
     void initializeGL() override;
@@ -37,15 +37,26 @@
 #include <QMessageBox>
 #include <QFile>
 #include <QTextStream>
+#include <QDialog>
+#include <QDialogButtonBox>
+#include <QStatusBar>
+#include <QComboBox>
+#include <QProgressDialog>
 
 #include <quadmath.h>
 
 #include "gui.hpp"
-#include "glwidget.hpp"
+#include "iterbuf.hpp"
+#include "minibrot.hpp"
+#include "scenefile.hpp"
 
 
-GUI::GUI() : update_lock(false), state()
+GUI::GUI() : update_lock(false), state(), export_width(0), export_height(0)
 {
+    export_supersampling.enabled = false;
+    export_supersampling.threshold = 1.0f;
+    export_supersampling.max_samples = 4;
+
     setWindowTitle("GL Fractal Explorer");
     setWindowIcon(QIcon(":logo.png"));
     QWidget *widget = new QWidget;
@@ -80,6 +91,8 @@ GUI::GUI() : update_lock(false), state()
     fractal_box_layout->addWidget(mandelbrot_bailout_spinbox, 2, 1);
     mandelbrot_smooth_checkbox = new QCheckBox("Smoothness");
     fractal_box_layout->addWidget(mandelbrot_smooth_checkbox, 3, 0, 1, 2);
+    mandelbrot_distance_checkbox = new QCheckBox("Distance estimation");
+    fractal_box_layout->addWidget(mandelbrot_distance_checkbox, 4, 0, 1, 2);
     layout->addWidget(fractal_box, 0, 0);
 
     QGroupBox* precision_box = new QGroupBox("Precision");
@@ -107,7 +120,9 @@ GUI::GUI() : update_lock(false), state()
     connect(colormap_from_clipboard_btn, SIGNAL(clicked(bool)), this, SLOT(colormap_from_clipboard()));
     colormap_box_layout->addWidget(colormap_from_clipboard_btn, 1, 2, 1, 2);
     colormap_reverse_checkbox = new QCheckBox("Reverse");
-    colormap_box_layout->addWidget(colormap_reverse_checkbox, 2, 0, 1, 4);
+    colormap_box_layout->addWidget(colormap_reverse_checkbox, 2, 0, 1, 2);
+    colormap_equalize_checkbox = new QCheckBox("Equalize");
+    colormap_box_layout->addWidget(colormap_equalize_checkbox, 2, 2, 1, 2);
     QLabel* colormap_start_label = new QLabel("Start:");
     colormap_box_layout->addWidget(colormap_start_label, 3, 0);
     colormap_start_slider = new QSlider(Qt::Horizontal);
@@ -140,6 +155,12 @@ GUI::GUI() : update_lock(false), state()
     QAction* file_export_png_act = new QAction("&Export as PNG...", this);
     connect(file_export_png_act, SIGNAL(triggered()), this, SLOT(file_export_png()));
     file_menu->addAction(file_export_png_act);
+    QAction* file_export_iterbuf_act = new QAction("Export &iteration buffer...", this);
+    connect(file_export_iterbuf_act, SIGNAL(triggered()), this, SLOT(file_export_iterbuf()));
+    file_menu->addAction(file_export_iterbuf_act);
+    QAction* file_recolor_iterbuf_act = new QAction("&Recolor iteration buffer...", this);
+    connect(file_recolor_iterbuf_act, SIGNAL(triggered()), this, SLOT(file_recolor_iterbuf()));
+    file_menu->addAction(file_recolor_iterbuf_act);
     file_menu->addSeparator();
     QAction* quit_act = new QAction("&Quit...", this);
     quit_act->setShortcut(QKeySequence::Quit);
@@ -150,6 +171,11 @@ GUI::GUI() : update_lock(false), state()
     edit_copy_act->setShortcut(QKeySequence::Copy);
     connect(edit_copy_act, SIGNAL(triggered()), this, SLOT(edit_copy()));
     edit_menu->addAction(edit_copy_act);
+    QMenu* navigate_menu = menuBar()->addMenu("&Navigate");
+    QAction* navigate_find_minibrot_act = new QAction("Find nearby &minibrot", this);
+    navigate_find_minibrot_act->setShortcut(Qt::Key_M);
+    connect(navigate_find_minibrot_act, SIGNAL(triggered()), this, SLOT(navigate_find_minibrot()));
+    navigate_menu->addAction(navigate_find_minibrot_act);
     QMenu* help_menu = menuBar()->addMenu("&Help");
     QAction* help_about_act = new QAction("&About", this);
     connect(help_about_act, SIGNAL(triggered()), this, SLOT(help_about()));
@@ -158,6 +184,8 @@ GUI::GUI() : update_lock(false), state()
 
 GUI::~GUI()
 {
+    if (background_thread.joinable())
+        background_thread.join();
 }
 
 void GUI::activate()
@@ -173,15 +201,20 @@ void GUI::activate()
     connect(mandelbrot_max_iter_spinbox, SIGNAL(valueChanged(int)), this, SLOT(update()));
     connect(mandelbrot_bailout_spinbox, SIGNAL(valueChanged(double)), this, SLOT(update()));
     connect(mandelbrot_smooth_checkbox, SIGNAL(toggled(bool)), this, SLOT(update()));
+    connect(mandelbrot_distance_checkbox, SIGNAL(toggled(bool)), this, SLOT(update()));
     connect(precision_single_hw_btn, SIGNAL(toggled(bool)), this, SLOT(update()));
     connect(precision_double_emu_btn, SIGNAL(toggled(bool)), this, SLOT(update()));
     connect(precision_double_hw_btn, SIGNAL(toggled(bool)), this, SLOT(update()));
     connect(precision_quad_emu_btn, SIGNAL(toggled(bool)), this, SLOT(update()));
     connect(colormap_reverse_checkbox, SIGNAL(toggled(bool)), this, SLOT(update()));
+    connect(colormap_equalize_checkbox, SIGNAL(toggled(bool)), this, SLOT(update()));
     connect(colormap_start_slider, SIGNAL(valueChanged(int)), this, SLOT(update()));
     connect(colormap_animation_checkbox, SIGNAL(toggled(bool)), this, SLOT(update()));
     connect(colormap_animation_reverse_checkbox, SIGNAL(toggled(bool)), this, SLOT(update()));
     connect(colormap_animation_speed_slider, SIGNAL(valueChanged(int)), this, SLOT(update()));
+    connect(glwidget, SIGNAL(image_finished(const QImage&, float)), this, SLOT(image_finished(const QImage&, float)));
+    connect(this, SIGNAL(background_task_finished(bool, const QString&)),
+            this, SLOT(background_task_done(bool, const QString&)), Qt::QueuedConnection);
     connect(glwidget, SIGNAL(navigate(__float128, __float128, __float128)), this, SLOT(navigate(__float128, __float128, __float128)));
     update();
     glwidget->setFocus(Qt::OtherFocusReason);
@@ -194,6 +227,7 @@ void GUI::state_to_gui()
     mandelbrot_max_iter_spinbox->setValue(state.fractal.mandelbrot.max_iter);
     mandelbrot_bailout_spinbox->setValue(state.fractal.mandelbrot.bailout);
     mandelbrot_smooth_checkbox->setChecked(state.fractal.mandelbrot.smooth);
+    mandelbrot_distance_checkbox->setChecked(state.fractal.mandelbrot.distance_estimation);
     switch (state.precision.type) {
     case precision_native_float:
         precision_single_hw_btn->setChecked(true);
@@ -210,6 +244,7 @@ void GUI::state_to_gui()
     }
     update_colormap_label();
     colormap_reverse_checkbox->setChecked(state.colormap.reverse);
+    colormap_equalize_checkbox->setChecked(state.colormap.equalize);
     colormap_start_slider->setValue(state.colormap.start * 100.0f);
     colormap_animation_checkbox->setChecked(state.colormap.animation);
     colormap_animation_reverse_checkbox->setChecked(state.colormap.animation_reverse);
@@ -224,11 +259,13 @@ void GUI::gui_to_state()
     state.fractal.mandelbrot.max_iter = mandelbrot_max_iter_spinbox->value();
     state.fractal.mandelbrot.bailout = mandelbrot_bailout_spinbox->value();
     state.fractal.mandelbrot.smooth = mandelbrot_smooth_checkbox->isChecked();
+    state.fractal.mandelbrot.distance_estimation = mandelbrot_distance_checkbox->isChecked();
     state.precision.type = (precision_single_hw_btn->isChecked() ? precision_native_float
             : precision_double_hw_btn->isChecked() ? precision_native_double
             : precision_double_emu_btn->isChecked() ? precision_emu_doublefloat
             : precision_emu_doubledouble);
     state.colormap.reverse = colormap_reverse_checkbox->isChecked();
+    state.colormap.equalize = colormap_equalize_checkbox->isChecked();
     state.colormap.start = colormap_start_slider->value() / 100.0f;
     state.colormap.animation = colormap_animation_checkbox->isChecked();
     state.colormap.animation_reverse = colormap_animation_reverse_checkbox->isChecked();
@@ -357,7 +394,7 @@ void GUI::file_open(const QString& file_name)
     QString name;
     if (file_name.isEmpty()) {
         name = QFileDialog::getOpenFileName(this, QString(), QString(),
-                "Fractals (*.fract);; All files (*)");
+                "Fractals (*.fract *.fracts);; All files (*)");
     } else {
         name = file_name;
     }
@@ -372,28 +409,277 @@ void GUI::file_open(const QString& file_name)
 void GUI::file_save()
 {
     QString name = QFileDialog::getSaveFileName(this, QString(), QString(),
-            "Fractals (*.fract);; All files (*)");
-    if (!name.isEmpty()) {
+            "Fractals (*.fract);; Binary scene files (*.fracts);; All files (*)");
+    if (name.endsWith(".fracts", Qt::CaseInsensitive)) {
+        SceneFile file;
+        if (!file.create(name) || !file.write_scene(state) || !file.close())
+            QMessageBox::critical(this, "Error", "Cannot save scene file");
+    } else if (!name.isEmpty()) {
         state.save(name);
     }
 }
 
 void GUI::file_export_png()
 {
+    if (export_width <= 0 || export_height <= 0) {
+        export_width = glwidget->width() * glwidget->devicePixelRatioF();
+        export_height = glwidget->height() * glwidget->devicePixelRatioF();
+    }
+    QDialog dialog(this);
+    dialog.setWindowTitle("Export as PNG");
+    QGridLayout* layout = new QGridLayout;
+    QLabel* width_label = new QLabel("Width:");
+    layout->addWidget(width_label, 0, 0);
+    QSpinBox* width_spinbox = new QSpinBox;
+    width_spinbox->setRange(1, 16384);
+    width_spinbox->setValue(export_width);
+    layout->addWidget(width_spinbox, 0, 1);
+    QLabel* height_label = new QLabel("Height:");
+    layout->addWidget(height_label, 1, 0);
+    QSpinBox* height_spinbox = new QSpinBox;
+    height_spinbox->setRange(1, 16384);
+    height_spinbox->setValue(export_height);
+    layout->addWidget(height_spinbox, 1, 1);
+    QCheckBox* supersampling_checkbox = new QCheckBox("Adaptive anti-aliasing");
+    supersampling_checkbox->setChecked(export_supersampling.enabled);
+    layout->addWidget(supersampling_checkbox, 2, 0, 1, 2);
+    QLabel* threshold_label = new QLabel("Threshold (iterations):");
+    layout->addWidget(threshold_label, 3, 0);
+    QDoubleSpinBox* threshold_spinbox = new QDoubleSpinBox;
+    threshold_spinbox->setRange(0, 9999);
+    threshold_spinbox->setDecimals(2);
+    threshold_spinbox->setSingleStep(0.1);
+    threshold_spinbox->setValue(export_supersampling.threshold);
+    layout->addWidget(threshold_spinbox, 3, 1);
+    QLabel* max_samples_label = new QLabel("Max. samples per axis:");
+    layout->addWidget(max_samples_label, 4, 0);
+    QSpinBox* max_samples_spinbox = new QSpinBox;
+    max_samples_spinbox->setRange(2, 8);
+    max_samples_spinbox->setValue(export_supersampling.max_samples);
+    layout->addWidget(max_samples_spinbox, 4, 1);
+    threshold_spinbox->setEnabled(export_supersampling.enabled);
+    max_samples_spinbox->setEnabled(export_supersampling.enabled);
+    connect(supersampling_checkbox, SIGNAL(toggled(bool)), threshold_spinbox, SLOT(setEnabled(bool)));
+    connect(supersampling_checkbox, SIGNAL(toggled(bool)), max_samples_spinbox, SLOT(setEnabled(bool)));
+    QDialogButtonBox* button_box = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel);
+    connect(button_box, SIGNAL(accepted()), &dialog, SLOT(accept()));
+    connect(button_box, SIGNAL(rejected()), &dialog, SLOT(reject()));
+    layout->addWidget(button_box, 5, 0, 1, 2);
+    dialog.setLayout(layout);
+    if (dialog.exec() != QDialog::Accepted)
+        return;
+    export_width = width_spinbox->value();
+    export_height = height_spinbox->value();
+    export_supersampling.enabled = supersampling_checkbox->isChecked();
+    export_supersampling.threshold = threshold_spinbox->value();
+    export_supersampling.max_samples = max_samples_spinbox->value();
+
     QString name = QFileDialog::getSaveFileName(this, QString(), QString(),
             "PNG Images (*.png);; All files (*)");
     if (!name.isEmpty()) {
-        QApplication::setOverrideCursor(QCursor(Qt::WaitCursor));
-        QImage img = glwidget->grabFramebuffer();
-        img.save(name, "png");
-        QApplication::restoreOverrideCursor();
+        if (glwidget->image_pending()) {
+            QMessageBox::critical(this, "Error", "The previous image is not finished yet");
+        } else if (background_thread.joinable()) {
+            QMessageBox::critical(this, "Error", "The previous file operation is not finished yet");
+        } else if (!glwidget->start_image(export_width, export_height, export_supersampling)) {
+            QMessageBox::critical(this, "Error", "Image size exceeds the limits of the OpenGL implementation");
+        } else {
+            pending_image_name = name;
+            statusBar()->showMessage("Exporting image...");
+        }
+    }
+}
+
+void GUI::file_export_iterbuf()
+{
+    if (export_width <= 0 || export_height <= 0) {
+        export_width = glwidget->width() * glwidget->devicePixelRatioF();
+        export_height = glwidget->height() * glwidget->devicePixelRatioF();
+    }
+    QDialog dialog(this);
+    dialog.setWindowTitle("Export iteration buffer");
+    QGridLayout* layout = new QGridLayout;
+    QLabel* width_label = new QLabel("Width:");
+    layout->addWidget(width_label, 0, 0);
+    QSpinBox* width_spinbox = new QSpinBox;
+    width_spinbox->setRange(1, 1 << 20);
+    width_spinbox->setValue(export_width);
+    layout->addWidget(width_spinbox, 0, 1);
+    QLabel* height_label = new QLabel("Height:");
+    layout->addWidget(height_label, 1, 0);
+    QSpinBox* height_spinbox = new QSpinBox;
+    height_spinbox->setRange(1, 1 << 20);
+    height_spinbox->setValue(export_height);
+    layout->addWidget(height_spinbox, 1, 1);
+    QLabel* format_label = new QLabel("Format:");
+    layout->addWidget(format_label, 2, 0);
+    QComboBox* format_combobox = new QComboBox;
+    format_combobox->addItem("Automatic", -1);
+    format_combobox->addItem("32 bit floating point", static_cast<int>(iterbuf_float32));
+    format_combobox->addItem("16 bit fixed point", static_cast<int>(iterbuf_fixed16));
+    format_combobox->addItem("16 bit floating point", static_cast<int>(iterbuf_float16));
+    format_combobox->addItem("16 bit iteration + 8 bit fraction", static_cast<int>(iterbuf_packed24));
+    layout->addWidget(format_combobox, 2, 1);
+    QCheckBox* compressed_checkbox = new QCheckBox("Compress tiles");
+    layout->addWidget(compressed_checkbox, 3, 0, 1, 2);
+    QDialogButtonBox* button_box = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel);
+    connect(button_box, SIGNAL(accepted()), &dialog, SLOT(accept()));
+    connect(button_box, SIGNAL(rejected()), &dialog, SLOT(reject()));
+    layout->addWidget(button_box, 4, 0, 1, 2);
+    dialog.setLayout(layout);
+    if (dialog.exec() != QDialog::Accepted)
+        return;
+    export_width = width_spinbox->value();
+    export_height = height_spinbox->value();
+
+    QString name = QFileDialog::getSaveFileName(this, QString(), QString(),
+            "Iteration buffers (*.iterbuf);; All files (*)");
+    if (name.isEmpty())
+        return;
+    IterBuf buf;
+    buf.state = state;
+    buf.width = export_width;
+    buf.height = export_height;
+    int format = format_combobox->currentData().toInt();
+    buf.format = (format < 0
+            ? iterbuf_choose_format(state.fractal.mandelbrot.max_iter, state.fractal.mandelbrot.smooth)
+            : static_cast<iterbuf_format_t>(format));
+    buf.tile_size = 1024;
+    buf.compressed = compressed_checkbox->isChecked();
+    // Write to a temporary file that replaces the target only on success, so
+    // that no partial buffer is left behind
+    QString tmp_name = name + ".part";
+    bool ok = buf.create(tmp_name);
+    bool canceled = false;
+    int tiles = buf.tiles_x() * buf.tiles_y();
+    QProgressDialog progress("Rendering iteration buffer...", "Cancel", 0, tiles, this);
+    progress.setWindowModality(Qt::WindowModal);
+    std::vector<float> values(static_cast<size_t>(buf.tile_size) * buf.tile_size);
+    // Keep one tile ahead, so that rendering the next tile overlaps with
+    // the transfer of the current one
+    int started = 0;
+    int finished = 0;
+    for (int i = 0; ok && i < tiles; i++) {
+        progress.setValue(i);
+        if (progress.wasCanceled()) {
+            canceled = true;
+            break;
+        }
+        while (ok && started < tiles && started <= i + 1) {
+            int tx = started % buf.tiles_x();
+            int ty = started / buf.tiles_x();
+            ok = glwidget->start_iterations(buf.width, buf.height,
+                    tx * buf.tile_size, ty * buf.tile_size, buf.tile_width(tx), buf.tile_height(ty));
+            if (ok)
+                started++;
+        }
+        if (ok) {
+            glwidget->finish_iterations(values.data());
+            finished++;
+            ok = buf.write_tile(i % buf.tiles_x(), i / buf.tiles_x(), values.data());
+        }
+    }
+    for (; finished < started; finished++)
+        glwidget->finish_iterations(values.data());
+    progress.setValue(tiles);
+    ok = buf.close() && ok;
+    if (ok && !canceled) {
+        QFile::remove(name);
+        ok = QFile::rename(tmp_name, name);
+    }
+    if (!ok || canceled)
+        QFile::remove(tmp_name);
+    if (!ok)
+        QMessageBox::critical(this, "Error", "Cannot export iteration buffer");
+}
+
+void GUI::file_recolor_iterbuf()
+{
+    QString name = QFileDialog::getOpenFileName(this, QString(), QString(),
+            "Iteration buffers (*.iterbuf);; All files (*)");
+    if (name.isEmpty())
+        return;
+    QString image_name = QFileDialog::getSaveFileName(this, QString(), QString(),
+            "PNG Images (*.png);; PPM Images (*.ppm);; All files (*)");
+    if (image_name.isEmpty())
+        return;
+    State recolor_state = state;
+    if (start_background_task([=]() { return IterBuf::recolor(name, recolor_state, image_name); },
+                QString("Recolored %1").arg(image_name), "Cannot recolor iteration buffer")) {
+        statusBar()->showMessage("Recoloring iteration buffer...");
     }
 }
 
 void GUI::edit_copy()
 {
-    QImage img = glwidget->grabFramebuffer();
-    QApplication::clipboard()->setImage(img);
+    if (glwidget->image_pending()) {
+        statusBar()->showMessage("The previous image is not finished yet");
+        return;
+    }
+    supersampling_t no_supersampling = { false, 0.0f, 2 };
+    if (glwidget->start_image(glwidget->width() * glwidget->devicePixelRatioF(),
+                glwidget->height() * glwidget->devicePixelRatioF(), no_supersampling)) {
+        pending_image_name = QString();
+    }
+}
+
+void GUI::navigate_find_minibrot()
+{
+    __float128 x, y, view_size;
+    glwidget->cursor_point(&x, &y, &view_size);
+    // Search a disk that is small compared to the view, so that the
+    // minibrot is close to the cursor even if larger ones are in view
+    minibrot_t minibrot;
+    if (!find_minibrot(state.fractal.mandelbrot.power, x, y, view_size / 16,
+                mandelbrot_max_iter_spinbox->maximum(), &minibrot)) {
+        statusBar()->showMessage("No minibrot found near the cursor");
+        return;
+    }
+    show_minibrot(minibrot, mandelbrot_max_iter_spinbox->maximum(), &state);
+    state_to_gui();
+    glwidget->set_state(state);
+    statusBar()->showMessage(QString("Minibrot of period %1").arg(minibrot.period));
+}
+
+void GUI::image_finished(const QImage& img, float samples_per_pixel)
+{
+    if (pending_image_name.isEmpty()) {
+        QApplication::clipboard()->setImage(img);
+        return;
+    }
+    // PNG encoding of large images takes long, so it runs in the background
+    QString image_name = pending_image_name;
+    if (start_background_task([=]() { return img.save(image_name, "png"); },
+                QString("Exported %1x%2 image with %3 samples per pixel on average")
+                .arg(img.width()).arg(img.height()).arg(samples_per_pixel, 0, 'f', 2),
+                "Cannot save image file")) {
+        statusBar()->showMessage("Saving image...");
+    }
+}
+
+bool GUI::start_background_task(const std::function<bool ()>& task,
+        const QString& done_message, const QString& error_message)
+{
+    // An exported image that is still rendering is saved in the background
+    // when it is finished, so it counts as a running file operation
+    if (background_thread.joinable() || (glwidget->image_pending() && !pending_image_name.isEmpty())) {
+        statusBar()->showMessage("The previous file operation is not finished yet");
+        return false;
+    }
+    background_thread = std::thread([=]() {
+            bool ok = task();
+            emit background_task_finished(ok, ok ? done_message : error_message);
+    });
+    return true;
+}
+
+void GUI::background_task_done(bool ok, const QString& message)
+{
+    background_thread.join();
+    if (ok)
+        statusBar()->showMessage(message);
+    else
+        QMessageBox::critical(this, "Error", message);
 }
 
 void GUI::help_about()
@@ -18,9 +18,13 @@
 #ifndef GUI_HPP
 #define GUI_HPP
 
+#include <thread>
+#include <functional>
+
 #include <QMainWindow>
 
 #include "state.hpp"
+#include "glwidget.hpp"
 
 class QOpenGLShaderProgram;
 class QLabel;
@@ -33,8 +37,6 @@ class QCheckBox;
 class QElapsedTimer;
 class QImage;
 
-class GLWidget;
-
 class GUI : public QMainWindow
 {
 Q_OBJECT
@@ -56,6 +58,7 @@ private:
     QSpinBox* mandelbrot_max_iter_spinbox;
     QDoubleSpinBox* mandelbrot_bailout_spinbox;
     QCheckBox* mandelbrot_smooth_checkbox;
+    QCheckBox* mandelbrot_distance_checkbox;
 
     QRadioButton* precision_single_hw_btn;
     QRadioButton* precision_double_emu_btn;
@@ -64,15 +67,31 @@ private:
 
     QLabel* colormap_label;
     QCheckBox* colormap_reverse_checkbox;
+    QCheckBox* colormap_equalize_checkbox;
     QSlider* colormap_start_slider;
     QCheckBox* colormap_animation_checkbox;
     QCheckBox* colormap_animation_reverse_checkbox;
     QSlider* colormap_animation_speed_slider;
 
+    int export_width, export_height;
+    supersampling_t export_supersampling;
+    // Destination of the pending asynchronous image; empty for the clipboard
+    QString pending_image_name;
+    // Thread of the file operation that runs in the background, if any
+    std::thread background_thread;
+
     void state_to_gui();
     void gui_to_state();
     void colormap_from_img(const QImage& img);
     void update_colormap_label();
+    // Run a file operation in the background so that the GUI stays
+    // responsive. Only one can run at a time. When it is done, the
+    // corresponding message is shown.
+    bool start_background_task(const std::function<bool ()>& task,
+            const QString& done_message, const QString& error_message);
+
+signals:
+    void background_task_finished(bool ok, const QString& message);
 
 private slots:
     void navigate(__float128 x, __float128 y, __float128 zoom);
@@ -83,7 +102,12 @@ private slots:
 
     void file_save();
     void file_export_png();
+    void file_export_iterbuf();
+    void file_recolor_iterbuf();
     void edit_copy();
+    void navigate_find_minibrot();
+    void image_finished(const QImage& img, float samples_per_pixel);
+    void background_task_done(bool ok, const QString& message);
     void help_about();
 
 public slots:
@@ -0,0 +1,44 @@
+#version 430
+
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Counts the pixels of the fractal texture into the histogram for
+ * equalization, one invocation per pixel, with atomic integer additions to
+ * the bins in a shader storage buffer. Used instead of histogram-vs.glsl and
+ * histogram-fs.glsl when compute shaders are available; see
+ * Renderer::equalize(). The bins must match Equalization in coloring.hpp. */
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+uniform sampler2D fractal;
+uniform ivec2 size;
+uniform int bins;
+
+layout(std430, binding = 1) buffer histogram_buffer
+{
+    uint counts[];
+};
+
+void main(void)
+{
+    ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+    if (any(greaterThanEqual(p, size)))
+        return;
+    float f = texelFetch(fractal, p, 0).r;
+    if (f > 0.0)
+        atomicAdd(counts[min(int(min(f, 1.0) * float(bins)), bins - 1)], 1u);
+}
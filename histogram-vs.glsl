@@ -0,0 +1,40 @@
+#version 330
+
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Adds the pixels of the fractal texture to the histogram for equalization;
+ * see Renderer::equalize(). One point is drawn per pixel, at the bin of its
+ * value in a framebuffer of bins x 1 pixels, and additive blending counts the
+ * points. Float counts are exact only up to 2^24, so the pixels are drawn in
+ * passes of fewer points. Interior pixels are moved outside of the viewport.
+ * The bins must
+ * match Equalization in coloring.hpp. */
+
+uniform sampler2D fractal;
+uniform int width;
+uniform int bins;
+
+void main(void)
+{
+    float f = texelFetch(fractal, ivec2(gl_VertexID % width, gl_VertexID / width), 0).r;
+    float x = 2.0;
+    if (f > 0.0) {
+        int b = min(int(min(f, 1.0) * float(bins)), bins - 1);
+        x = (float(b) + 0.5) / float(bins) * 2.0 - 1.0;
+    }
+    gl_Position = vec4(x, 0.0, 0.0, 1.0);
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Test of the iteration buffer formats: encode and decode representative
+ * buffers of smooth and non-smooth normalized iteration values, and check
+ * the errors in iterations against the bounds given in iterbuf.hpp. The
+ * normalized values are floats themselves, so their rounding error, scaled
+ * to iterations, is added to each bound. */
+
+#include <cstdio>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+#include "iterbuf.hpp"
+
+
+static const char* format_name(iterbuf_format_t format)
+{
+    switch (format) {
+    case iterbuf_float32:
+        return "float32";
+    case iterbuf_fixed16:
+        return "fixed16";
+    case iterbuf_float16:
+        return "float16";
+    case iterbuf_packed24:
+        return "packed24";
+    }
+    return "";
+}
+
+// Non-smooth values: every iteration count, and 0 for the interior
+static std::vector<float> nonsmooth_values(int max_iter)
+{
+    std::vector<float> values;
+    values.push_back(0.0f);
+    for (int i = 1; i < max_iter; i++)
+        values.push_back(static_cast<float>(i) / (max_iter - 1));
+    return values;
+}
+
+// Smooth values: a range of fractions of every iteration count, negative
+// values of orbits that escape early, and 0 for the interior
+static std::vector<float> smooth_values(int max_iter)
+{
+    std::vector<float> values;
+    values.push_back(0.0f);
+    for (int k = 1; k <= 8 * iterbuf_iteration_offset; k++)
+        values.push_back(-k / 8.0f / (max_iter - 1));
+    for (int i = 0; i < max_iter - 1; i++)
+        for (int k = 0; k < 64; k++)
+            values.push_back((i + (k + 0.37f) / 64.0f) / (max_iter - 1));
+    return values;
+}
+
+static bool check(iterbuf_format_t format, int max_iter, bool smooth, float bound)
+{
+    std::vector<float> values = smooth ? smooth_values(max_iter) : nonsmooth_values(max_iter);
+    float error = iterbuf_format_error(format, max_iter, values.data(), values.size()) * (max_iter - 1);
+    bound += FLT_EPSILON * (max_iter - 1);
+    bool ok = (error <= bound);
+    fprintf(stderr, "%-8s max_iter %5d %-10s error %.6f iterations, bound %.6f: %s\n",
+            format_name(format), max_iter, smooth ? "smooth" : "non-smooth",
+            error, bound, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+// Non-smooth counts must be recovered by rounding, and the interior value 0
+// must be exact
+static bool check_rounding(iterbuf_format_t format, int max_iter)
+{
+    std::vector<float> values = nonsmooth_values(max_iter);
+    std::vector<unsigned char> data(values.size() * iterbuf_bytes_per_value(format));
+    std::vector<float> decoded(values.size());
+    iterbuf_encode(format, max_iter, values.data(), values.size(), data.data());
+    iterbuf_decode(format, max_iter, data.data(), values.size(), decoded.data());
+    bool ok = true;
+    for (size_t i = 0; i < values.size() && ok; i++)
+        ok = (std::round(decoded[i] * (max_iter - 1)) == std::round(values[i] * (max_iter - 1)));
+    ok = ok && decoded[0] == 0.0f;
+    fprintf(stderr, "%-8s max_iter %5d non-smooth counts recovered: %s\n",
+            format_name(format), max_iter, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(void)
+{
+    bool ok = true;
+    const int max_iters[] = { 256, 8160, 64512 };
+    for (int max_iter : max_iters) {
+        // fixed16: 65535 steps for the iterations including the offset
+        float fixed16_bound = 0.5f / 65535.0f * (max_iter - 1 + iterbuf_iteration_offset);
+        ok = check(iterbuf_fixed16, max_iter, false, fixed16_bound) && ok;
+        ok = check(iterbuf_fixed16, max_iter, true, fixed16_bound) && ok;
+        ok = check_rounding(iterbuf_fixed16, max_iter) && ok;
+        // float16: 11 significant bits, so the largest step is 2^-11 in
+        // normalized values
+        float float16_bound = std::ldexp(0.5f, -11) * (max_iter - 1);
+        ok = check(iterbuf_float16, max_iter, false, float16_bound) && ok;
+        ok = check(iterbuf_float16, max_iter, true, float16_bound) && ok;
+        // packed24: steps of 1/256 iteration
+        ok = check(iterbuf_packed24, max_iter, false, 0.0f) && ok;
+        ok = check(iterbuf_packed24, max_iter, true, 0.5f / 256.0f) && ok;
+        ok = check_rounding(iterbuf_packed24, max_iter) && ok;
+    }
+    // packed24 at its largest max_iter
+    ok = check(iterbuf_packed24, 65520, true, 0.5f / 256.0f) && ok;
+    ok = check_rounding(iterbuf_packed24, 65520) && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,529 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+
+#include <QFile>
+#include <QImage>
+#include <QByteArray>
+
+#include "iterbuf.hpp"
+#include "coloring.hpp"
+
+
+/* File layout (all values in host byte order, i.e. little endian in practice):
+ * char[8] magic "GLFRACTB"
+ * uint32 version (1)
+ * uint32 format (iterbuf_format_t)
+ * uint32 width, height, tile_size
+ * uint32 compressed (0 or 1)
+ * uint64 state_size
+ * state_size bytes: the serialized State
+ * tiles_x * tiles_y pairs of uint64: offset and size of each tile
+ * tile data, each tile starting at a multiple of 16 bytes
+ */
+
+static const char magic[8] = { 'G', 'L', 'F', 'R', 'A', 'C', 'T', 'B' };
+static const uint32_t version = 1;
+static const size_t header_size = 40;
+
+static uint16_t float_to_half(float x)
+{
+    uint32_t f;
+    std::memcpy(&f, &x, sizeof(f));
+    uint32_t sign = (f >> 16) & 0x8000;
+    int exponent = static_cast<int>((f >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = f & 0x7fffff;
+    if (exponent >= 31) {
+        // overflow, infinity, or NaN
+        return sign | 0x7c00 | (((f & 0x7f800000) == 0x7f800000 && mantissa) ? 0x200 : 0);
+    } else if (exponent <= 0) {
+        // subnormal or zero
+        if (exponent < -10)
+            return sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        uint32_t h = mantissa >> shift;
+        uint32_t rest = mantissa & ((1U << shift) - 1);
+        uint32_t halfway = 1U << (shift - 1);
+        if (rest > halfway || (rest == halfway && (h & 1)))
+            h++;
+        return sign | h;
+    } else {
+        uint32_t h = (exponent << 10) | (mantissa >> 13);
+        uint32_t rest = mantissa & 0x1fff;
+        if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+            h++; // may carry into the exponent, which is correct
+        return sign | h;
+    }
+}
+
+static float half_to_float(uint16_t h)
+{
+    uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t f;
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            f = sign;
+        } else {
+            // subnormal: normalize it
+            exponent = 127 - 15 + 1;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                exponent--;
+            }
+            f = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+        }
+    } else if (exponent == 31) {
+        f = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        f = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+    }
+    float x;
+    std::memcpy(&x, &f, sizeof(x));
+    return x;
+}
+
+// The fixed16 value that represents 0. The values below it represent at least
+// iterbuf_iteration_offset negative iterations, and 0 and 1 are exact.
+static int fixed16_zero(int max_iter)
+{
+    int iter_scale = std::max(max_iter - 1, 1);
+    int fixed_scale = iter_scale + iterbuf_iteration_offset;
+    return (65535 * iterbuf_iteration_offset + fixed_scale - 1) / fixed_scale;
+}
+
+iterbuf_format_t iterbuf_choose_format(int max_iter, bool smooth)
+{
+    if (max_iter <= (smooth ? 8160 : 64512))
+        return iterbuf_fixed16;
+    else if (max_iter <= 65536 - iterbuf_iteration_offset)
+        return iterbuf_packed24;
+    else
+        return iterbuf_float32;
+}
+
+size_t iterbuf_bytes_per_value(iterbuf_format_t format)
+{
+    switch (format) {
+    case iterbuf_float32:
+        return 4;
+    case iterbuf_fixed16:
+    case iterbuf_float16:
+        return 2;
+    case iterbuf_packed24:
+        return 3;
+    }
+    return 0;
+}
+
+void iterbuf_encode(iterbuf_format_t format, int max_iter, const float* values, size_t n, unsigned char* data)
+{
+    float iter_scale = std::max(max_iter - 1, 1);
+    float zero = fixed16_zero(max_iter);
+    for (size_t i = 0; i < n; i++) {
+        switch (format) {
+        case iterbuf_float32:
+            std::memcpy(data + 4 * i, values + i, 4);
+            break;
+        case iterbuf_fixed16:
+            {
+                float v = zero + values[i] * (65535.0f - zero);
+                uint16_t u = std::min(std::max(v, 0.0f), 65535.0f) + 0.5f;
+                std::memcpy(data + 2 * i, &u, 2);
+            }
+            break;
+        case iterbuf_float16:
+            {
+                uint16_t h = float_to_half(values[i]);
+                std::memcpy(data + 2 * i, &h, 2);
+            }
+            break;
+        case iterbuf_packed24:
+            {
+                float it = values[i] * iter_scale + iterbuf_iteration_offset;
+                it = std::min(std::max(it, 0.0f), 65535.0f);
+                uint32_t integer = it;
+                uint32_t fraction = (it - integer) * 256.0f + 0.5f;
+                if (fraction == 256) {
+                    fraction = (integer == 65535 ? 255 : 0);
+                    integer = std::min(integer + 1, 65535U);
+                }
+                uint16_t u = integer;
+                std::memcpy(data + 3 * i, &u, 2);
+                data[3 * i + 2] = fraction;
+            }
+            break;
+        }
+    }
+}
+
+void iterbuf_decode(iterbuf_format_t format, int max_iter, const unsigned char* data, size_t n, float* values)
+{
+    float iter_scale = std::max(max_iter - 1, 1);
+    float zero = fixed16_zero(max_iter);
+    for (size_t i = 0; i < n; i++) {
+        switch (format) {
+        case iterbuf_float32:
+            std::memcpy(values + i, data + 4 * i, 4);
+            break;
+        case iterbuf_fixed16:
+            {
+                uint16_t u;
+                std::memcpy(&u, data + 2 * i, 2);
+                values[i] = (u - zero) / (65535.0f - zero);
+            }
+            break;
+        case iterbuf_float16:
+            {
+                uint16_t h;
+                std::memcpy(&h, data + 2 * i, 2);
+                values[i] = half_to_float(h);
+            }
+            break;
+        case iterbuf_packed24:
+            {
+                uint16_t u;
+                std::memcpy(&u, data + 3 * i, 2);
+                values[i] = (u - iterbuf_iteration_offset + data[3 * i + 2] / 256.0f) / iter_scale;
+            }
+            break;
+        }
+    }
+}
+
+float iterbuf_format_error(iterbuf_format_t format, int max_iter, const float* values, size_t n)
+{
+    const size_t block_size = 4096;
+    std::vector<unsigned char> data(block_size * iterbuf_bytes_per_value(format));
+    std::vector<float> decoded(block_size);
+    float max_error = 0.0f;
+    for (size_t i = 0; i < n; i += block_size) {
+        size_t m = std::min(block_size, n - i);
+        iterbuf_encode(format, max_iter, values + i, m, data.data());
+        iterbuf_decode(format, max_iter, data.data(), m, decoded.data());
+        for (size_t j = 0; j < m; j++)
+            max_error = std::max(max_error, std::abs(decoded[j] - values[i + j]));
+    }
+    return max_error;
+}
+
+IterBuf::IterBuf() :
+    state(), width(0), height(0), format(iterbuf_float32), tile_size(256), compressed(false),
+    _file(NULL), _writable(false), _map(NULL), _index_offset(0)
+{
+}
+
+IterBuf::~IterBuf()
+{
+    close();
+}
+
+int IterBuf::tile_width(int tx) const
+{
+    return std::min(tile_size, width - tx * tile_size);
+}
+
+int IterBuf::tile_height(int ty) const
+{
+    return std::min(tile_size, height - ty * tile_size);
+}
+
+bool IterBuf::create(const QString& filename)
+{
+    close();
+    if (width < 1 || height < 1 || tile_size < 1)
+        return false;
+    _file = new QFile(filename);
+    if (!_file->open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        close();
+        return false;
+    }
+    _writable = true;
+    std::vector<unsigned char> state_data = state.serialize();
+    uint32_t header[6] = { version, static_cast<uint32_t>(format),
+        static_cast<uint32_t>(width), static_cast<uint32_t>(height),
+        static_cast<uint32_t>(tile_size), compressed ? 1U : 0U };
+    uint64_t state_size = state_data.size();
+    _index_offset = header_size + state_size;
+    _tile_offsets.assign(tiles_x() * tiles_y(), 0);
+    _tile_sizes.assign(tiles_x() * tiles_y(), 0);
+    std::vector<uint64_t> index(2 * _tile_offsets.size(), 0);
+    bool ok = (_file->write(magic, sizeof(magic)) == sizeof(magic)
+            && _file->write(reinterpret_cast<const char*>(header), sizeof(header)) == sizeof(header)
+            && _file->write(reinterpret_cast<const char*>(&state_size), sizeof(state_size)) == sizeof(state_size)
+            && _file->write(reinterpret_cast<const char*>(state_data.data()), state_size) == qint64(state_size)
+            && _file->write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(uint64_t))
+                == qint64(index.size() * sizeof(uint64_t)));
+    if (!ok)
+        close();
+    return ok;
+}
+
+bool IterBuf::write_tile(int tx, int ty, const float* values)
+{
+    if (!_file || !_writable)
+        return false;
+    size_t n = static_cast<size_t>(tile_width(tx)) * tile_height(ty);
+    QByteArray data(n * iterbuf_bytes_per_value(format), '\0');
+    iterbuf_encode(format, state.fractal.mandelbrot.max_iter, values, n, reinterpret_cast<unsigned char*>(data.data()));
+    if (compressed)
+        data = qCompress(data);
+    qint64 offset = _file->size();
+    if (offset % 16 != 0) {
+        char padding[16] = { 0 };
+        if (!_file->seek(offset) || _file->write(padding, 16 - offset % 16) != 16 - offset % 16)
+            return false;
+        offset += 16 - offset % 16;
+    }
+    if (!_file->seek(offset) || _file->write(data) != data.size())
+        return false;
+    _tile_offsets[ty * tiles_x() + tx] = offset;
+    _tile_sizes[ty * tiles_x() + tx] = data.size();
+    return true;
+}
+
+bool IterBuf::open(const QString& filename)
+{
+    close();
+    _file = new QFile(filename);
+    if (!_file->open(QIODevice::ReadOnly)) {
+        close();
+        return false;
+    }
+    qint64 file_size = _file->size();
+    _map = file_size >= qint64(header_size) ? _file->map(0, file_size) : NULL;
+    if (!_map) {
+        close();
+        return false;
+    }
+    uint32_t header[6];
+    uint64_t state_size;
+    std::memcpy(header, _map + sizeof(magic), sizeof(header));
+    std::memcpy(&state_size, _map + sizeof(magic) + sizeof(header), sizeof(state_size));
+    if (std::memcmp(_map, magic, sizeof(magic)) != 0
+            || header[0] != version
+            || header[1] > iterbuf_packed24
+            || header[2] < 1 || header[2] > (1U << 30)
+            || header[3] < 1 || header[3] > (1U << 30)
+            || header[4] < 1 || header[4] > (1U << 16)
+            || header[5] > 1
+            || state_size > uint64_t(file_size) - header_size
+            || !state.deserialize(_map + header_size, state_size)) {
+        close();
+        return false;
+    }
+    format = static_cast<iterbuf_format_t>(header[1]);
+    width = header[2];
+    height = header[3];
+    tile_size = header[4];
+    compressed = header[5];
+    size_t tiles = static_cast<size_t>(tiles_x()) * tiles_y();
+    _index_offset = header_size + state_size;
+    if (_index_offset + tiles * 2 * sizeof(uint64_t) > uint64_t(file_size)) {
+        close();
+        return false;
+    }
+    _tile_offsets.resize(tiles);
+    _tile_sizes.resize(tiles);
+    for (size_t i = 0; i < tiles; i++) {
+        std::memcpy(&(_tile_offsets[i]), _map + _index_offset + (2 * i + 0) * sizeof(uint64_t), sizeof(uint64_t));
+        std::memcpy(&(_tile_sizes[i]), _map + _index_offset + (2 * i + 1) * sizeof(uint64_t), sizeof(uint64_t));
+        if (_tile_offsets[i] > uint64_t(file_size) || _tile_sizes[i] > uint64_t(file_size) - _tile_offsets[i]) {
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool IterBuf::read_tile(int tx, int ty, float* values) const
+{
+    if (!_map)
+        return false;
+    size_t n = static_cast<size_t>(tile_width(tx)) * tile_height(ty);
+    const unsigned char* data = _map + _tile_offsets[ty * tiles_x() + tx];
+    size_t size = _tile_sizes[ty * tiles_x() + tx];
+    QByteArray uncompressed;
+    if (compressed) {
+        uncompressed = qUncompress(data, size);
+        data = reinterpret_cast<const unsigned char*>(uncompressed.constData());
+        size = uncompressed.size();
+    }
+    if (size != n * iterbuf_bytes_per_value(format))
+        return false;
+    iterbuf_decode(format, state.fractal.mandelbrot.max_iter, data, n, values);
+    return true;
+}
+
+// Read the tiles tx0, tx0 + step, ... of a tile row
+static void read_tiles(const IterBuf* buf, int ty, int tx0, int step, float* values, int* ok)
+{
+    std::vector<float> tile(static_cast<size_t>(buf->tile_size) * buf->tile_size);
+    for (int tx = tx0; *ok && tx < buf->tiles_x(); tx += step) {
+        if (!buf->read_tile(tx, ty, tile.data())) {
+            *ok = 0;
+            break;
+        }
+        int tw = buf->tile_width(tx);
+        for (int r = 0; r < buf->tile_height(ty); r++)
+            std::memcpy(values + static_cast<size_t>(r) * buf->width + tx * buf->tile_size,
+                    tile.data() + static_cast<size_t>(r) * tw, tw * sizeof(float));
+    }
+}
+
+bool IterBuf::read_tile_row(int y, float* values, int threads) const
+{
+    int ty = y / tile_size;
+    threads = std::max(1, std::min(threads, tiles_x()));
+    std::vector<std::thread> workers;
+    std::vector<int> ok(threads, 1);
+    for (int t = 1; t < threads; t++)
+        workers.push_back(std::thread(read_tiles, this, ty, t, threads, values, &(ok[t])));
+    read_tiles(this, ty, 0, threads, values, &(ok[0]));
+    for (size_t t = 0; t < workers.size(); t++)
+        workers[t].join();
+    return std::find(ok.begin(), ok.end(), 0) == ok.end();
+}
+
+const float* IterBuf::tile_data(int tx, int ty) const
+{
+    if (!_map || compressed || format != iterbuf_float32)
+        return NULL;
+    return reinterpret_cast<const float*>(_map + _tile_offsets[ty * tiles_x() + tx]);
+}
+
+bool IterBuf::close()
+{
+    bool ok = true;
+    if (_file) {
+        if (_writable) {
+            std::vector<uint64_t> index(2 * _tile_offsets.size());
+            for (size_t i = 0; i < _tile_offsets.size(); i++) {
+                index[2 * i + 0] = _tile_offsets[i];
+                index[2 * i + 1] = _tile_sizes[i];
+            }
+            qint64 index_size = index.size() * sizeof(uint64_t);
+            ok = (_file->seek(_index_offset)
+                    && _file->write(reinterpret_cast<const char*>(index.data()), index_size) == index_size
+                    && _file->flush());
+        }
+        if (_map)
+            _file->unmap(const_cast<unsigned char*>(_map));
+        _file->close();
+        delete _file;
+    }
+    _file = NULL;
+    _writable = false;
+    _map = NULL;
+    _tile_offsets.clear();
+    _tile_sizes.clear();
+    return ok;
+}
+
+// Color the rows [r0, r1) of a band of rows, either into the given RGBX
+// lines, or as RGB into rgb if that is not NULL
+static void recolor_rows(const Coloring* coloring, float offset, const Equalization* eq,
+        const float* values, int width, int r0, int r1, unsigned char* const* lines, unsigned char* rgb)
+{
+    std::vector<unsigned char> rgbx(rgb ? 4 * static_cast<size_t>(width) : 0);
+    for (int r = r0; r < r1; r++) {
+        const float* row_values = values + static_cast<size_t>(r) * width;
+        if (rgb) {
+            coloring->apply(offset, row_values, width, rgbx.data(), eq);
+            unsigned char* row_rgb = rgb + 3 * static_cast<size_t>(r) * width;
+            for (int x = 0; x < width; x++)
+                std::memcpy(row_rgb + 3 * x, &(rgbx[4 * x]), 3);
+        } else {
+            coloring->apply(offset, row_values, width, lines[r], eq);
+        }
+    }
+}
+
+bool IterBuf::recolor(const QString& iterbuf_filename, const State& state, const QString& image_filename,
+        int threads)
+{
+    if (threads < 1)
+        threads = std::thread::hardware_concurrency();
+    if (threads < 1)
+        threads = 1;
+    IterBuf buf;
+    if (!buf.open(iterbuf_filename))
+        return false;
+    Coloring coloring(state);
+    float offset = colormap_offset(state, 0.0);
+    bool ppm = image_filename.endsWith(".ppm", Qt::CaseInsensitive);
+    QImage img;
+    QFile ppm_file(image_filename);
+    if (ppm) {
+        QByteArray ppm_header = QByteArray("P6\n") + QByteArray::number(buf.width) + " "
+            + QByteArray::number(buf.height) + "\n255\n";
+        if (!ppm_file.open(QIODevice::WriteOnly | QIODevice::Truncate) || ppm_file.write(ppm_header) != ppm_header.size())
+            return false;
+    } else {
+        img = QImage(buf.width, buf.height, QImage::Format_RGBX8888);
+        if (img.isNull())
+            return false;
+    }
+    std::vector<float> values(static_cast<size_t>(buf.width) * buf.tile_size);
+    std::vector<unsigned char> rgb(ppm ? 3 * values.size() : 0);
+    std::vector<unsigned char*> lines(buf.tile_size);
+    // Histogram equalization needs a first pass over all values. The
+    // equalization uses max_iter of the buffer, which the values belong to.
+    Equalization equalization(buf.state);
+    const Equalization* eq = NULL;
+    if (state.colormap.equalize) {
+        for (int y = 0; y < buf.height; y += buf.tile_size) {
+            if (!buf.read_tile_row(y, values.data(), threads))
+                return false;
+            equalization.add(values.data(), static_cast<size_t>(buf.width) * buf.tile_height(y / buf.tile_size),
+                    threads);
+        }
+        equalization.update();
+        eq = &equalization;
+    }
+    // Each band of tile rows is decoded with one thread per tile column and
+    // colored with its rows split among the threads
+    for (int y = 0; y < buf.height; y += buf.tile_size) {
+        if (!buf.read_tile_row(y, values.data(), threads))
+            return false;
+        int rows = buf.tile_height(y / buf.tile_size);
+        if (!ppm)
+            for (int r = 0; r < rows; r++)
+                lines[r] = img.scanLine(y + r);
+        int chunk = (rows + threads - 1) / threads;
+        std::vector<std::thread> workers;
+        for (int t = 1; t < threads && t * chunk < rows; t++)
+            workers.push_back(std::thread(recolor_rows, &coloring, offset, eq, values.data(), buf.width,
+                        t * chunk, std::min(rows, (t + 1) * chunk), lines.data(), ppm ? rgb.data() : NULL));
+        recolor_rows(&coloring, offset, eq, values.data(), buf.width,
+                0, std::min(rows, chunk), lines.data(), ppm ? rgb.data() : NULL);
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
+        if (ppm) {
+            qint64 size = 3 * static_cast<qint64>(rows) * buf.width;
+            if (ppm_file.write(reinterpret_cast<const char*>(rgb.data()), size) != size)
+                return false;
+        }
+    }
+    return (ppm ? ppm_file.flush() : img.save(image_filename));
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ITERBUF_HPP
+#define ITERBUF_HPP
+
+#include <vector>
+#include <cstdint>
+
+#include <QString>
+
+#include "state.hpp"
+
+class QFile;
+
+typedef enum {
+    // These values are stored in files; do not change them!
+    iterbuf_float32 = 0,        // the normalized iteration value as float
+    iterbuf_fixed16 = 1,        // the normalized iteration value as 16 bit fixed point
+    iterbuf_float16 = 2,        // the normalized iteration value as half float
+    iterbuf_packed24 = 3        // offset 16 bit integer iteration plus 8 bit fraction
+} iterbuf_format_t;
+
+/* Smooth iteration values can be slightly negative for orbits that escape in
+ * the first iterations; see fractal.glsl. fixed16 and packed24 reserve room
+ * for values down to minus this number of iterations, and clamp smaller
+ * values. */
+const int iterbuf_iteration_offset = 16;
+
+/* Choose the most compact format that represents the values computed with
+ * the given maximum number of iterations and smoothness setting without
+ * visible error:
+ * - Without smoothing, the values are integer iteration counts. They are
+ *   recovered by rounding from fixed16 for up to 64512 iterations, and from
+ *   packed24 for up to 65520 iterations.
+ * - With smoothing, fixed16 has an error of at most 1/16 iteration for up to
+ *   8160 iterations, and packed24 has an error of at most 1/512 iteration for
+ *   up to 65520 iterations.
+ * - Everything else needs float32.
+ * These bounds hold up to the rounding error of the float values themselves.
+ * Note that float16 is never chosen: for normalized values in [0,1], its
+ * error is always larger than that of fixed16. */
+iterbuf_format_t iterbuf_choose_format(int max_iter, bool smooth);
+
+// Number of bytes per value in the given format
+size_t iterbuf_bytes_per_value(iterbuf_format_t format);
+
+// Convert n normalized iteration values to or from the given format
+void iterbuf_encode(iterbuf_format_t format, int max_iter, const float* values, size_t n, unsigned char* data);
+void iterbuf_decode(iterbuf_format_t format, int max_iter, const unsigned char* data, size_t n, float* values);
+
+// Return the maximum absolute error that the given format introduces for the
+// given normalized iteration values. Multiply by (max_iter - 1) to get the
+// error in iterations, or by the color map size to get it in color map entries.
+float iterbuf_format_error(iterbuf_format_t format, int max_iter, const float* values, size_t n);
+
+/* A file containing the normalized iteration values as computed by
+ * fractal.glsl, so that they can be recolored later without iterating
+ * again. The file consists of a header with the State, a tile index, and the
+ * tiles. Tiles are stored in row-major order, with rows from top to bottom,
+ * and are optionally compressed. The file is memory-mapped for reading, so
+ * that buffers much larger than main memory can be processed. */
+class IterBuf
+{
+public:
+    State state;
+    int width, height;
+    iterbuf_format_t format;
+    int tile_size;
+    bool compressed;
+
+private:
+    QFile* _file;
+    bool _writable;
+    const unsigned char* _map;
+    uint64_t _index_offset;
+    std::vector<uint64_t> _tile_offsets;
+    std::vector<uint64_t> _tile_sizes;
+
+public:
+    IterBuf();
+    ~IterBuf();
+
+    int tiles_x() const { return (width + tile_size - 1) / tile_size; }
+    int tiles_y() const { return (height + tile_size - 1) / tile_size; }
+    int tile_width(int tx) const;
+    int tile_height(int ty) const;
+
+    // Create a file. Set the public members first. Then write all tiles
+    // (in any order) with write_tile(), and finally call close().
+    bool create(const QString& filename);
+    bool write_tile(int tx, int ty, const float* values);
+
+    // Open a file for reading. The public members are set from the header.
+    bool open(const QString& filename);
+    // Read a tile, converted to float values.
+    bool read_tile(int tx, int ty, float* values) const;
+    // Read the pixel rows [y, y+tile_size) of the whole image, converted to
+    // float values. y must be a multiple of tile_size. The tiles are decoded
+    // with the given number of threads.
+    bool read_tile_row(int y, float* values, int threads = 1) const;
+    // Direct access to the mapped data of an uncompressed float32 tile, or
+    // NULL if not possible.
+    const float* tile_data(int tx, int ty) const;
+
+    bool close();
+
+    // Recolor a buffer file using the color map of the given state, and save
+    // the result as an image file. PPM files are written row by row, so they
+    // can be arbitrarily large; other image formats are limited by QImage.
+    // Decoding and coloring use the given number of threads, or one per core
+    // if it is 0.
+    static bool recolor(const QString& iterbuf_filename, const State& state, const QString& image_filename,
+            int threads = 0);
+};
+
+#endif
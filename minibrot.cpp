@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include <quadmath.h>
+
+#include "minibrot.hpp"
+
+
+typedef __complex128 complex_t;
+
+// Newton's method stops when a step is smaller than this, relative to |c|
+static const __float128 newton_tolerance = 64 * FLT128_EPSILON;
+static const int newton_max_steps = 64;
+
+static complex_t make_complex(__float128 re, __float128 im)
+{
+    complex_t c;
+    __real__ c = re;
+    __imag__ c = im;
+    return c;
+}
+
+// z^n for n >= 1
+static complex_t powi(complex_t z, int n)
+{
+    complex_t r = z;
+    for (int i = 1; i < n; i++)
+        r *= z;
+    return r;
+}
+
+// The smallest n for which the ball that contains z_n(c') for all c' in the
+// disk of the given radius around c contains 0, or 0 if there is none up to
+// max_period. For |e| <= r, |(z + e)^p - z^p| <= (|z| + r)^p - |z|^p, which
+// is expanded to avoid cancellation for tiny radii.
+static int find_period(int power, complex_t c, __float128 radius, int max_period)
+{
+    complex_t z = c;
+    __float128 r = radius;
+    for (int n = 1; n <= max_period; n++) {
+        __float128 abs_z = cabsq(z);
+        if (abs_z <= r)
+            return n;
+        if (abs_z - r > 2)
+            break; // the whole ball escaped
+        __float128 binomial = 1;
+        __float128 r_k = 1;
+        __float128 new_r = radius;
+        for (int k = 1; k <= power; k++) {
+            binomial = binomial * (power - k + 1) / k;
+            r_k *= r;
+            new_r += binomial * powq(abs_z, power - k) * r_k;
+        }
+        r = new_r;
+        z = powi(z, power) + c;
+    }
+    return 0;
+}
+
+// Whether the Newton step z / dz for finding a nucleus is negligible at c
+static bool newton_converged(complex_t z, complex_t dz, complex_t c)
+{
+    return cabsq(z) <= newton_tolerance * cabsq(c) * cabsq(dz);
+}
+
+// Refine c to a root of z_period(c) with Newton's method
+static bool find_nucleus(int power, int period, complex_t* c)
+{
+    for (int step = 0; step < newton_max_steps; step++) {
+        complex_t z = 0;
+        complex_t dz = 0;
+        for (int i = 0; i < period; i++) {
+            dz = static_cast<__float128>(power) * powi(z, power - 1) * dz + static_cast<__float128>(1);
+            z = powi(z, power) + *c;
+        }
+        if (cabsq(dz) == 0)
+            return false;
+        bool converged = newton_converged(z, dz, *c);
+        *c -= z / dz;
+        if (!(cabsq(*c) <= 2))
+            return false; // diverged or NaN
+        if (converged)
+            return true;
+    }
+    return false;
+}
+
+// Newton's method for a period might converge to the nucleus of a divisor
+// of that period, e.g. if the ball was large; return the actual period.
+static int exact_period(int power, int period, complex_t c)
+{
+    complex_t z = 0;
+    complex_t dz = 0;
+    for (int k = 1; k < period; k++) {
+        dz = static_cast<__float128>(power) * powi(z, power - 1) * dz + static_cast<__float128>(1);
+        z = powi(z, power) + c;
+        if (period % k == 0 && newton_converged(z, dz, c))
+            return k;
+    }
+    return period;
+}
+
+// The complex scale of the minibrot with the given nucleus. Near 0, the
+// period-th iterate is approximately z_period(c) + l * z^power, where l is
+// the derivative along the orbit, and b * l is its derivative with respect
+// to c; renormalizing this map to the form u^power + c' gives the scale
+// 1 / (b * l^(power / (power - 1))).
+static complex_t minibrot_scale(int power, int period, complex_t c)
+{
+    complex_t z = 0;
+    complex_t l = 1;
+    complex_t b = 1;
+    for (int i = 1; i < period; i++) {
+        z = powi(z, power) + c;
+        l = static_cast<__float128>(power) * powi(z, power - 1) * l;
+        b += static_cast<__float128>(1) / l;
+    }
+    complex_t l_pow = (power == 2 ? l * l
+            : cpowq(l, make_complex(static_cast<__float128>(power) / (power - 1), 0)));
+    return static_cast<__float128>(1) / (b * l_pow);
+}
+
+bool find_minibrot(int power, __float128 x, __float128 y, __float128 radius,
+        int max_period, minibrot_t* minibrot)
+{
+    complex_t c = make_complex(x, y);
+    int period = find_period(power, c, radius, max_period);
+    if (period == 0 || !find_nucleus(power, period, &c))
+        return false;
+    period = exact_period(power, period, c);
+    complex_t scale = minibrot_scale(power, period, c);
+    if (!(cabsq(scale) > 0) || isinfq(cabsq(scale)))
+        return false;
+    minibrot->period = period;
+    minibrot->x = __real__ c;
+    minibrot->y = __imag__ c;
+    minibrot->scale_re = __real__ scale;
+    minibrot->scale_im = __imag__ scale;
+    return true;
+}
+
+void show_minibrot(const minibrot_t& minibrot, int max_iter_limit, State* state)
+{
+    State defaults;
+    complex_t scale = make_complex(minibrot.scale_re, minibrot.scale_im);
+    complex_t center = make_complex(minibrot.x, minibrot.y)
+        + scale * make_complex(defaults.navigation.x, defaults.navigation.y);
+    state->navigation.x = __real__ center;
+    state->navigation.y = __imag__ center;
+    state->navigation.zoom = defaults.navigation.zoom / cabsq(scale);
+    // One iteration of the dynamics inside the minibrot takes period
+    // iterations, so the default detail needs period times the iterations
+    long long max_iter = static_cast<long long>(minibrot.period) * defaults.fractal.mandelbrot.max_iter;
+    max_iter = std::max(max_iter, static_cast<long long>(state->fractal.mandelbrot.max_iter));
+    state->fractal.mandelbrot.max_iter = std::min(max_iter, static_cast<long long>(max_iter_limit));
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MINIBROT_HPP
+#define MINIBROT_HPP
+
+#include "state.hpp"
+
+/* A minibrot, i.e. a small copy of the Mandelbrot set, or more generally a
+ * hyperbolic component of the set. Its nucleus is the point c for which the
+ * orbit of 0 is periodic with the given period. The minibrot looks like the
+ * whole set scaled and rotated by the complex factor scale around the
+ * nucleus: the point u of the whole set corresponds to nucleus + scale * u. */
+typedef struct {
+    int period;
+    __float128 x, y;
+    __float128 scale_re, scale_im;
+} minibrot_t;
+
+/* Find the minibrot with the lowest period in the disk of the given radius
+ * around (x, y). The period is detected by iterating the disk with ball
+ * arithmetic until it contains 0, the nucleus is found with Newton's method,
+ * and the scale is estimated from the derivatives along its orbit.
+ * All computations use __float128. Returns false if no period up to
+ * max_period was found or Newton's method did not converge. */
+bool find_minibrot(int power, __float128 x, __float128 y, __float128 radius,
+        int max_period, minibrot_t* minibrot);
+
+/* Set the navigation of the state so that it shows the minibrot like the
+ * default navigation shows the whole set, and raise max_iter accordingly,
+ * but not above max_iter_limit. */
+void show_minibrot(const minibrot_t& minibrot, int max_iter_limit, State* state);
+
+#endif
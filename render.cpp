@@ -0,0 +1,416 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* glfract-render: render many fractals without a display.
+ *
+ * Jobs are either given as a list of .fract files, which are rendered with a
+ * common size and output format, or as a manifest file with one job per line:
+ *   input.fract output.png [key=value ...]
+ * Binary scene files (.fracts, see SceneFile) can be used instead of .fract
+ * files. In the list, a scene file with several scenes gives one job per
+ * scene, with the scene number appended to the output name, e.g.
+ * scenes-000000.png; in a manifest, its first scene is used.
+ * Empty lines and lines starting with '#' are ignored. The output format is
+ * determined by the file name extension; it can be any image format, or
+ * .iterbuf for an iteration buffer file. The following keys override the
+ * defaults from the command line and the state from the input file:
+ *   width, height, x, y, zoom, power, max_iter, bailout, smooth,
+ *   distance_estimation, precision (native_float, native_double,
+ *   emu_doublefloat, emu_doubledouble), colormap_start, colormap_reverse,
+ *   colormap_equalize
+ *
+ * With the CPU backends, jobs are processed in parallel, and the available
+ * threads are split among them. The fixed backend ignores the precision and
+ * computes with as many fixed-point limbs as the zoom depth requires; it is
+ * slower, but does not break down at deep zooms. The GL backend renders with
+ * the same shaders as the glfract GUI on an offscreen surface, one job at a
+ * time. Images with distance estimation require the GL backend; iteration
+ * buffers do not contain distance estimates. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+
+#include <getopt.h>
+
+#include <QString>
+#include <QStringList>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QImage>
+#include <QElapsedTimer>
+#include <QGuiApplication>
+
+#include <quadmath.h>
+
+#include "state.hpp"
+#include "scenefile.hpp"
+#include "engine.hpp"
+#include "renderer.hpp"
+#include "coloring.hpp"
+#include "iterbuf.hpp"
+
+
+class Job
+{
+public:
+    QString input;
+    QString output;
+    int width, height;
+    State state;
+};
+
+static bool apply_override(Job& job, const QString& key, const QString& value)
+{
+    bool ok = true;
+    if (key == "width") {
+        job.width = value.toInt(&ok);
+        ok = ok && job.width > 0;
+    } else if (key == "height") {
+        job.height = value.toInt(&ok);
+        ok = ok && job.height > 0;
+    } else if (key == "x") {
+        job.state.navigation.x = strtoflt128(qPrintable(value), 0);
+    } else if (key == "y") {
+        job.state.navigation.y = strtoflt128(qPrintable(value), 0);
+    } else if (key == "zoom") {
+        job.state.navigation.zoom = strtoflt128(qPrintable(value), 0);
+        ok = job.state.navigation.zoom > 0;
+    } else if (key == "power") {
+        job.state.fractal.mandelbrot.power = value.toInt(&ok);
+        ok = ok && job.state.fractal.mandelbrot.power >= 2;
+    } else if (key == "max_iter") {
+        job.state.fractal.mandelbrot.max_iter = value.toInt(&ok);
+        ok = ok && job.state.fractal.mandelbrot.max_iter >= 2;
+    } else if (key == "bailout") {
+        job.state.fractal.mandelbrot.bailout = value.toFloat(&ok);
+    } else if (key == "smooth") {
+        job.state.fractal.mandelbrot.smooth = (value == "true" || value == "1");
+    } else if (key == "distance_estimation") {
+        job.state.fractal.mandelbrot.distance_estimation = (value == "true" || value == "1");
+    } else if (key == "precision") {
+        if (value == "native_float")
+            job.state.precision.type = precision_native_float;
+        else if (value == "native_double")
+            job.state.precision.type = precision_native_double;
+        else if (value == "emu_doublefloat")
+            job.state.precision.type = precision_emu_doublefloat;
+        else if (value == "emu_doubledouble")
+            job.state.precision.type = precision_emu_doubledouble;
+        else
+            ok = false;
+    } else if (key == "colormap_start") {
+        job.state.colormap.start = value.toFloat(&ok);
+    } else if (key == "colormap_reverse") {
+        job.state.colormap.reverse = (value == "true" || value == "1");
+    } else if (key == "colormap_equalize") {
+        job.state.colormap.equalize = (value == "true" || value == "1");
+    } else {
+        ok = false;
+    }
+    return ok;
+}
+
+static bool read_manifest(const QString& name, int width, int height, std::vector<Job>& jobs)
+{
+    QFile file(name);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        fprintf(stderr, "Cannot open %s\n", qPrintable(name));
+        return false;
+    }
+    // Relative file names are relative to the manifest
+    QDir dir = QFileInfo(name).dir();
+    int line_number = 0;
+    while (!file.atEnd()) {
+        QString line = QString::fromUtf8(file.readLine()).trimmed();
+        line_number++;
+        if (line.isEmpty() || line.startsWith('#'))
+            continue;
+        QStringList fields = line.split(' ', Qt::SkipEmptyParts);
+        if (fields.size() < 2) {
+            fprintf(stderr, "%s:%d: missing output file\n", qPrintable(name), line_number);
+            return false;
+        }
+        Job job;
+        job.input = dir.filePath(fields[0]);
+        job.output = dir.filePath(fields[1]);
+        job.width = width;
+        job.height = height;
+        if (!QFileInfo(job.input).isReadable()) {
+            fprintf(stderr, "%s:%d: %s is not readable\n", qPrintable(name), line_number, qPrintable(job.input));
+            return false;
+        }
+        job.state.load(job.input, true);
+        for (int i = 2; i < fields.size(); i++) {
+            int j = fields[i].indexOf('=');
+            if (j < 0 || !apply_override(job, fields[i].left(j), fields[i].mid(j + 1))) {
+                fprintf(stderr, "%s:%d: invalid setting %s\n", qPrintable(name), line_number, qPrintable(fields[i]));
+                return false;
+            }
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+// Render a job with the renderer if it is not NULL, and with the engine otherwise
+static bool render(const Job& job, const Engine& engine, bool fixed, Renderer* renderer)
+{
+    if (job.output.endsWith(".iterbuf", Qt::CaseInsensitive)) {
+        // Render tile by tile, so that the size is not limited by memory
+        IterBuf buf;
+        buf.state = job.state;
+        buf.width = job.width;
+        buf.height = job.height;
+        buf.format = iterbuf_choose_format(job.state.fractal.mandelbrot.max_iter, job.state.fractal.mandelbrot.smooth);
+        buf.compressed = true;
+        if (!buf.create(job.output))
+            return false;
+        std::vector<float> values(buf.tile_size * buf.tile_size);
+        bool ok = true;
+        for (int ty = 0; ok && ty < buf.tiles_y(); ty++) {
+            for (int tx = 0; ok && tx < buf.tiles_x(); tx++) {
+                if (renderer) {
+                    ok = renderer->render_iterations(job.state, job.width, job.height,
+                            tx * buf.tile_size, ty * buf.tile_size,
+                            buf.tile_width(tx), buf.tile_height(ty), values.data());
+                } else if (fixed) {
+                    engine.render_fixed(job.state, job.width, job.height,
+                            tx * buf.tile_size, ty * buf.tile_size,
+                            buf.tile_width(tx), buf.tile_height(ty), values.data());
+                } else {
+                    engine.render(job.state, job.width, job.height,
+                            tx * buf.tile_size, ty * buf.tile_size,
+                            buf.tile_width(tx), buf.tile_height(ty), values.data());
+                }
+                ok = ok && buf.write_tile(tx, ty, values.data());
+            }
+        }
+        // Do not leave an incomplete buffer behind
+        ok = buf.close() && ok;
+        if (!ok)
+            QFile::remove(job.output);
+        return ok;
+    } else if (renderer) {
+        supersampling_t supersampling = { false, 0.0f, 2 };
+        QImage img = renderer->render_image(job.state, colormap_offset(job.state, 0.0),
+                job.width, job.height, supersampling);
+        if (img.isNull())
+            return false;
+        return img.save(job.output);
+    } else {
+        if (job.state.fractal.mandelbrot.distance_estimation) {
+            fprintf(stderr, "%s: distance estimation requires the gl backend\n", qPrintable(job.input));
+            return false;
+        }
+        std::vector<float> values(static_cast<size_t>(job.width) * job.height);
+        if (fixed)
+            engine.render_fixed(job.state, job.width, job.height, values.data());
+        else
+            engine.render(job.state, job.width, job.height, values.data());
+        QImage img(job.width, job.height, QImage::Format_RGBX8888);
+        if (img.isNull())
+            return false;
+        Coloring coloring(job.state);
+        float offset = colormap_offset(job.state, 0.0);
+        Equalization equalization(job.state);
+        if (job.state.colormap.equalize) {
+            equalization.add(values.data(), values.size(), engine.threads());
+            equalization.update();
+        }
+        for (int y = 0; y < job.height; y++)
+            coloring.apply(offset, values.data() + static_cast<size_t>(y) * job.width, job.width, img.scanLine(y),
+                    job.state.colormap.equalize ? &equalization : NULL);
+        return img.save(job.output);
+    }
+}
+
+static void work(const std::vector<Job>* jobs, std::atomic<size_t>* next_job, int threads,
+        bool fixed, Renderer* renderer, std::mutex* report_mutex, int* done, int* failed)
+{
+    Engine engine(threads);
+    size_t i;
+    while ((i = (*next_job)++) < jobs->size()) {
+        const Job& job = (*jobs)[i];
+        QElapsedTimer timer;
+        timer.start();
+        bool ok = render(job, engine, fixed, renderer);
+        std::lock_guard<std::mutex> lock(*report_mutex);
+        (*done)++;
+        if (!ok)
+            (*failed)++;
+        fprintf(stderr, "[%d/%d] %s %s (%.2f s)\n", *done, static_cast<int>(jobs->size()),
+                qPrintable(job.output), ok ? "done" : "FAILED", timer.elapsed() / 1000.0);
+    }
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [options] fractal.fract|scenes.fracts [...]\n"
+            "       %s [options] --manifest=jobs.txt\n"
+            "Options:\n"
+            "  -w, --width=W        Default image width (default 1920)\n"
+            "  -h, --height=H       Default image height (default 1080)\n"
+            "  -f, --format=EXT     Output format for .fract arguments, e.g. png or\n"
+            "                       iterbuf (default png)\n"
+            "  -o, --output=DIR     Output directory for .fract arguments (default:\n"
+            "                       the directory of each input file)\n"
+            "  -m, --manifest=FILE  Read jobs from FILE\n"
+            "  -b, --backend=B      Render with cpu, fixed, or gl (default cpu)\n"
+            "  -j, --jobs=J         Number of jobs processed in parallel (default 1;\n"
+            "                       always 1 with the gl backend)\n"
+            "  -t, --threads=T      Total number of threads (default: one per core)\n",
+            argv0, argv0);
+}
+
+int main(int argc, char* argv[])
+{
+    int width = 1920;
+    int height = 1080;
+    QString format = "png";
+    QString output_dir;
+    QString manifest;
+    QString backend = "cpu";
+    int parallel_jobs = 1;
+    int threads = 0;
+
+    const struct option options[] = {
+        { "width",    required_argument, NULL, 'w' },
+        { "height",   required_argument, NULL, 'h' },
+        { "format",   required_argument, NULL, 'f' },
+        { "output",   required_argument, NULL, 'o' },
+        { "manifest", required_argument, NULL, 'm' },
+        { "backend",  required_argument, NULL, 'b' },
+        { "jobs",     required_argument, NULL, 'j' },
+        { "threads",  required_argument, NULL, 't' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "w:h:f:o:m:b:j:t:", options, NULL)) != -1) {
+        switch (c) {
+        case 'w':
+            width = atoi(optarg);
+            break;
+        case 'h':
+            height = atoi(optarg);
+            break;
+        case 'f':
+            format = optarg;
+            break;
+        case 'o':
+            output_dir = optarg;
+            break;
+        case 'm':
+            manifest = optarg;
+            break;
+        case 'b':
+            backend = optarg;
+            break;
+        case 'j':
+            parallel_jobs = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if ((manifest.isEmpty() && optind == argc) || (!manifest.isEmpty() && optind < argc)
+            || (backend != "cpu" && backend != "fixed" && backend != "gl")
+            || width < 1 || height < 1 || parallel_jobs < 1 || threads < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<Job> jobs;
+    if (!manifest.isEmpty()) {
+        if (!read_manifest(manifest, width, height, jobs))
+            return 1;
+    } else {
+        for (int i = optind; i < argc; i++) {
+            QString input = argv[i];
+            QFileInfo info(input);
+            std::vector<State> states;
+            if (!info.isReadable() || !SceneFile::load_all(input, states)) {
+                fprintf(stderr, "%s is not readable\n", qPrintable(input));
+                return 1;
+            }
+            QDir dir = (output_dir.isEmpty() ? info.dir() : QDir(output_dir));
+            for (size_t j = 0; j < states.size(); j++) {
+                Job job;
+                job.input = input;
+                QString base = info.completeBaseName();
+                if (states.size() > 1)
+                    base += QString("-%1").arg(j, 6, 10, QChar('0'));
+                job.output = dir.filePath(base + '.' + format);
+                job.width = width;
+                job.height = height;
+                job.state = states[j];
+                jobs.push_back(job);
+            }
+        }
+    }
+
+    // The GL backend needs a Qt application; it works without a display
+    // when the offscreen platform plugin is used
+    QGuiApplication* app = NULL;
+    OffscreenRenderer* renderer = NULL;
+    if (backend == "gl") {
+        if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+            qputenv("QT_QPA_PLATFORM", "offscreen");
+        app = new QGuiApplication(argc, argv);
+        renderer = new OffscreenRenderer;
+        if (!renderer->initialize()) {
+            fprintf(stderr, "Cannot create an OpenGL 3.3 core context\n");
+            return 1;
+        }
+        parallel_jobs = 1;
+    }
+
+    // Split the threads among the jobs that run in parallel
+    if (threads == 0)
+        threads = Engine().threads();
+    if (parallel_jobs > static_cast<int>(jobs.size()))
+        parallel_jobs = jobs.size();
+    int threads_per_job = std::max(1, threads / parallel_jobs);
+    bool fixed = (backend == "fixed");
+
+    std::atomic<size_t> next_job(0);
+    std::mutex report_mutex;
+    int done = 0;
+    int failed = 0;
+    std::vector<std::thread> workers;
+    for (int i = 1; i < parallel_jobs; i++)
+        workers.push_back(std::thread(work, &jobs, &next_job, threads_per_job, fixed, renderer, &report_mutex, &done, &failed));
+    work(&jobs, &next_job, threads_per_job, fixed, renderer, &report_mutex, &done, &failed);
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    delete renderer;
+    delete app;
+    if (failed > 0) {
+        fprintf(stderr, "%d of %d jobs failed\n", failed, done);
+        return 1;
+    }
+    return 0;
+}
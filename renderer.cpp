@@ -0,0 +1,1312 @@
+/*
+ * Copyright (C) 2015, 2016, 2017, 2018, 2019, 2020, 2021, 2022, 2023
+ * Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include <QElapsedTimer>
+#include <QOpenGLShaderProgram>
+#include <QOpenGLContext>
+#include <QOffscreenSurface>
+#include <QSurfaceFormat>
+#include <QImage>
+#include <QFile>
+#include <QTextStream>
+
+#include <quadmath.h>
+
+#include "renderer.hpp"
+#include "coloring.hpp"
+
+
+// The number of persistent workgroups of the compute shader; enough to keep
+// current GPUs busy, while surplus workgroups find the tile queue empty
+static const GLuint compute_workgroups = 256;
+// The size of the tiles of the compute shader's queue; see TILE_SIZE in
+// fractal-cs.glsl. A workgroup takes at most compute_max_tiles_per_group
+// tiles per dispatch, and fewer for large iteration limits, so that its
+// loop runs at most about compute_max_batches times; see render_fractal().
+static const int compute_tile_size = 8;
+static const int compute_max_tiles_per_group = 16;
+static const int compute_max_batches = 4096;
+
+// The number of iterations between escape checks in the shaders, per
+// precision type; see iterate() in fractal.glsl
+static const int escape_check_intervals[] = { 4, 4, 8, 8 };
+
+// Display tiles have tile_size x tile_size pixels. By default, the tile cache
+// holds up to 4096 tiles with 32 bit values.
+static const int tile_size = 128;
+static const size_t default_tile_cache_size = 256 << 20;
+// The number of finer levels from which a missing tile may be built, and the
+// number of coarser levels that are searched for a preview of a missing tile
+static const int tile_finer_levels = 2;
+static const int tile_coarser_levels = 8;
+// While there are previews for missing tiles, spend at most this many
+// milliseconds per frame on computing them
+static const qint64 tile_time_budget = 40;
+
+// The maximum number of jittered samples per pixel that accumulate() adds up
+static const int accumulation_max_samples = 64;
+
+// Reprojected pixels are recomputed if the iteration counts in their
+// neighborhood differ by more than this; see reproject()
+static const float reprojection_threshold = 0.5f;
+
+template<typename T>
+static void float128_to_pair(__float128 x, T* p0, T* p1)
+{
+    *p0 = x;
+    *p1 = x - *p0;
+}
+
+Renderer::Renderer() : QOpenGLFunctions_3_3_Core(),
+    have_arb_gpu_shader_fp64(false), have_arb_gpu_shader5(false), have_compute_shader(false),
+    _mandelbrot_power(-1), _mandelbrot_max_iter(-1), _mandelbrot_bailout(-1.0f), _mandelbrot_smooth(false),
+    _mandelbrot_distance(false),
+    _precision_type(precision_native_float),
+    _use_compute_shader(false), _compute_prg_failed(false),
+    _colormap_reupload(true),
+    _fractal_prg(NULL), _coloring_prg(NULL), _supersampling_prg(NULL), _compute_prg(NULL),
+    _histogram_prg(NULL), _histogram_cs_prg(NULL), _scan_prg(NULL), _accumulation_prg(NULL), _reprojection_prg(NULL),
+    _fractal_valid(false), _fractal_exact(false), _reprojection_refresh(0),
+    _histogram_bins(0),
+    _accumulation_samples(0), _accumulation_query_pending(false), _accumulation_converged(false),
+    _image_pending(false), _image_supersampling(false),
+    _tile_cache(default_tile_cache_size), _tile_prg(NULL)
+{
+}
+
+Renderer::~Renderer()
+{
+    cleanup();
+}
+
+void Renderer::cleanup()
+{
+    if (_image_pending)
+        finish_image();
+    for (size_t i = 0; i < _iterations_readbacks.size(); i++) {
+        glDeleteBuffers(1, &_iterations_readbacks[i].pbo);
+        glDeleteSync(_iterations_readbacks[i].fence);
+    }
+    _iterations_readbacks.clear();
+    std::vector<unsigned int> tiles;
+    _tile_cache.clear(tiles);
+    delete_tiles(tiles);
+    delete _fractal_prg;
+    delete _coloring_prg;
+    delete _supersampling_prg;
+    delete _compute_prg;
+    delete _histogram_prg;
+    delete _histogram_cs_prg;
+    delete _scan_prg;
+    delete _accumulation_prg;
+    delete _reprojection_prg;
+    delete _tile_prg;
+    _fractal_prg = NULL;
+    _coloring_prg = NULL;
+    _supersampling_prg = NULL;
+    _compute_prg = NULL;
+    _histogram_prg = NULL;
+    _histogram_cs_prg = NULL;
+    _scan_prg = NULL;
+    _accumulation_prg = NULL;
+    _reprojection_prg = NULL;
+    _tile_prg = NULL;
+}
+
+void Renderer::initialize()
+{
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    initializeOpenGLFunctions();
+    have_arb_gpu_shader_fp64 = context->hasExtension("GL_ARB_gpu_shader_fp64");
+    have_arb_gpu_shader5 = context->hasExtension("GL_ARB_gpu_shader5");
+    glUniform1d = reinterpret_cast<void (*)(GLint, GLdouble)>(context->getProcAddress("glUniform1d"));
+    glUniform2d = reinterpret_cast<void (*)(GLint, GLdouble, GLdouble)>(context->getProcAddress("glUniform2d"));
+    glDispatchCompute = reinterpret_cast<void (*)(GLuint, GLuint, GLuint)>(context->getProcAddress("glDispatchCompute"));
+    glMemoryBarrier = reinterpret_cast<void (*)(GLbitfield)>(context->getProcAddress("glMemoryBarrier"));
+    glBindImageTexture = reinterpret_cast<void (*)(GLuint, GLuint, GLint, GLboolean, GLint, GLenum, GLenum)>(
+            context->getProcAddress("glBindImageTexture"));
+    QSurfaceFormat format = context->format();
+    have_compute_shader = (format.majorVersion() > 4 || (format.majorVersion() == 4 && format.minorVersion() >= 3))
+        && glDispatchCompute && glMemoryBarrier && glBindImageTexture;
+    _use_compute_shader = have_compute_shader;
+
+    const float p[] = {
+        -1.0f, +1.0f, 0.0f,
+        +1.0f, +1.0f, 0.0f,
+        +1.0f, -1.0f, 0.0f,
+        -1.0f, -1.0f, 0.0f
+    };
+    const float t[] = {
+        0.0f, 1.0f,
+        1.0f, 1.0f,
+        1.0f, 0.0f,
+        0.0f, 0.0f
+    };
+    const unsigned int i[] = {
+        0, 1, 3, 1, 2, 3
+    };
+
+    // The histogram points have no vertex attributes; they need their own
+    // vertex array object
+    glGenVertexArrays(1, &_points_vao);
+    glGenVertexArrays(1, &_vao);
+    glBindVertexArray(_vao);
+    GLuint position_buffer;
+    glGenBuffers(1, &position_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, position_buffer);
+    glBufferData(GL_ARRAY_BUFFER, 4 * 3 * sizeof(float), p, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(0);
+    GLuint texcoord_buffer;
+    glGenBuffers(1, &texcoord_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, texcoord_buffer);
+    glBufferData(GL_ARRAY_BUFFER, 4 * 2 * sizeof(float), t, GL_STATIC_DRAW);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    glEnableVertexAttribArray(1);
+    GLuint index_buffer;
+    glGenBuffers(1, &index_buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, 6 * sizeof(unsigned int), i, GL_STATIC_DRAW);
+
+    glGenTextures(1, &_fractal_tex);
+    _fractal_tex_format = GL_R32F;
+    glBindTexture(GL_TEXTURE_2D, _fractal_tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glGenFramebuffers(1, &_fractal_fbo);
+    glGenTextures(1, &_reprojection_tex);
+    glBindTexture(GL_TEXTURE_2D, _reprojection_tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glGenRenderbuffers(1, &_reprojection_stencil);
+
+    glGenTextures(1, &_colormap_tex);
+    glBindTexture(GL_TEXTURE_2D, _colormap_tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    _fractal_prg = new QOpenGLShaderProgram();
+    _coloring_prg = new QOpenGLShaderProgram();
+    _coloring_prg->addShaderFromSourceFile(QOpenGLShader::Vertex, ":vs.glsl");
+    _coloring_prg->addShaderFromSourceFile(QOpenGLShader::Fragment, ":coloring-fs.glsl");
+    _supersampling_prg = new QOpenGLShaderProgram();
+    _compute_prg = new QOpenGLShaderProgram();
+    _tile_prg = new QOpenGLShaderProgram();
+    _tile_prg->addShaderFromSourceFile(QOpenGLShader::Vertex, ":tile-vs.glsl");
+    _tile_prg->addShaderFromSourceFile(QOpenGLShader::Fragment, ":tile-fs.glsl");
+    glGenFramebuffers(1, &_tile_fbo);
+    _histogram_prg = new QOpenGLShaderProgram();
+    _histogram_prg->addShaderFromSourceFile(QOpenGLShader::Vertex, ":histogram-vs.glsl");
+    _histogram_prg->addShaderFromSourceFile(QOpenGLShader::Fragment, ":histogram-fs.glsl");
+    _scan_prg = new QOpenGLShaderProgram();
+    _scan_prg->addShaderFromSourceFile(QOpenGLShader::Vertex, ":vs.glsl");
+    _scan_prg->addShaderFromSourceFile(QOpenGLShader::Fragment, ":scan-fs.glsl");
+    if (have_compute_shader) {
+        _histogram_cs_prg = new QOpenGLShaderProgram();
+        _histogram_cs_prg->addShaderFromSourceFile(QOpenGLShader::Compute, ":histogram-cs.glsl");
+        glGenBuffers(1, &_histogram_buffer);
+    }
+    glGenFramebuffers(1, &_histogram_fbo);
+    glGenTextures(2, _histogram_tex);
+    glGenTextures(1, &_histogram_count_tex);
+    for (int i = 0; i < 3; i++) {
+        glBindTexture(GL_TEXTURE_2D, i < 2 ? _histogram_tex[i] : _histogram_count_tex);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    _accumulation_prg = new QOpenGLShaderProgram();
+    _accumulation_prg->addShaderFromSourceFile(QOpenGLShader::Vertex, ":vs.glsl");
+    _accumulation_prg->addShaderFromSourceFile(QOpenGLShader::Fragment, ":accumulation-fs.glsl");
+    glGenFramebuffers(1, &_accumulation_fbo);
+    glGenTextures(2, _accumulation_tex);
+    for (int i = 0; i < 2; i++) {
+        glBindTexture(GL_TEXTURE_2D, _accumulation_tex[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    glGenQueries(1, &_accumulation_query);
+    _reprojection_prg = new QOpenGLShaderProgram();
+    _reprojection_prg->addShaderFromSourceFile(QOpenGLShader::Vertex, ":vs.glsl");
+    _reprojection_prg->addShaderFromSourceFile(QOpenGLShader::Fragment, ":reprojection-fs.glsl");
+    if (have_compute_shader) {
+        glGenBuffers(1, &_queue_buffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _queue_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+    }
+
+    glClearColor(0.0, 0.0, 0.0, 1.0);
+    glDisable(GL_DEPTH_TEST);
+}
+
+const char* Renderer::gl_renderer()
+{
+    return reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+}
+
+void Renderer::state_has_new_colormap()
+{
+    _colormap_reupload = true;
+}
+
+void Renderer::set_compute_shader(bool enable)
+{
+    _use_compute_shader = enable && have_compute_shader;
+}
+
+bool Renderer::compute_shader() const
+{
+    return _use_compute_shader;
+}
+
+void Renderer::set_tile_cache_size(size_t bytes)
+{
+    std::vector<unsigned int> evicted;
+    _tile_cache.set_max_size(bytes, evicted);
+    delete_tiles(evicted);
+}
+
+size_t Renderer::tile_cache_size() const
+{
+    return _tile_cache.max_size();
+}
+
+// The source of fractal-fs.glsl or fractal-cs.glsl, with fractal.glsl
+// inserted and the compile-time constants replaced
+QString Renderer::shader_source(const QString& name, bool adaptive_supersampling)
+{
+    QFile file(name);
+    file.open(QIODevice::ReadOnly);
+    QTextStream ts(&file);
+    QString src = ts.readAll();
+    QFile common_file(":fractal.glsl");
+    common_file.open(QIODevice::ReadOnly);
+    QTextStream common_ts(&common_file);
+    src.replace("#include \"fractal.glsl\"", common_ts.readAll());
+    src.replace("HAVE_ARB_GPU_SHADER5", have_arb_gpu_shader5 ? "1" : "0");
+    src.replace("FLOAT_TYPE", QString::number(_precision_type));
+    src.replace("MANDELBROT_POWER", QString::number(_mandelbrot_power));
+    src.replace("MANDELBROT_LN_POWER", QString::number(std::log(static_cast<float>(_mandelbrot_power))));
+    src.replace("MANDELBROT_MAX_ITERATIONS", QString::number(_mandelbrot_max_iter));
+    src.replace("MANDELBROT_BAILOUT", QString::number(_mandelbrot_bailout));
+    src.replace("MANDELBROT_SMOOTH", _mandelbrot_smooth ? "1" : "0");
+    src.replace("MANDELBROT_DISTANCE", _mandelbrot_distance ? "1" : "0");
+    src.replace("ESCAPE_CHECK_INTERVAL", QString::number(_mandelbrot_bailout >= 4.0f
+                ? escape_check_intervals[_precision_type] : 1));
+    src.replace("ADAPTIVE_SUPERSAMPLING", adaptive_supersampling ? "1" : "0");
+    return src;
+}
+
+void Renderer::build_fractal_prg(QOpenGLShaderProgram* prg, bool adaptive_supersampling)
+{
+    prg->removeAllShaders();
+    prg->addShaderFromSourceFile(QOpenGLShader::Vertex, ":vs.glsl");
+    prg->addShaderFromSourceCode(QOpenGLShader::Fragment, shader_source(":fractal-fs.glsl", adaptive_supersampling));
+    prg->bind();
+}
+
+// Rebuild the fractal program and re-upload the color map texture if
+// necessary. Returns true if the program was rebuilt.
+bool Renderer::update(const State& state)
+{
+    bool reinitialize_everything = !_fractal_prg->isLinked();
+    if (reinitialize_everything
+            || state.fractal.mandelbrot.power != _mandelbrot_power
+            || state.fractal.mandelbrot.max_iter != _mandelbrot_max_iter
+            || state.fractal.mandelbrot.bailout != _mandelbrot_bailout
+            || state.fractal.mandelbrot.smooth != _mandelbrot_smooth
+            || state.fractal.mandelbrot.distance_estimation != _mandelbrot_distance
+            || state.precision.type != _precision_type) {
+        _mandelbrot_power = state.fractal.mandelbrot.power;
+        _mandelbrot_max_iter = state.fractal.mandelbrot.max_iter;
+        _mandelbrot_bailout = state.fractal.mandelbrot.bailout;
+        _mandelbrot_smooth = state.fractal.mandelbrot.smooth;
+        _mandelbrot_distance = state.fractal.mandelbrot.distance_estimation;
+        _precision_type = state.precision.type;
+        build_fractal_prg(_fractal_prg, false);
+        _fractal_valid = false;
+        // The supersampling program is only needed for exports, and the
+        // compute program only if enabled; build them on demand
+        _supersampling_prg->removeAllShaders();
+        _compute_prg->removeAllShaders();
+        _compute_prg_failed = false;
+    }
+    if (reinitialize_everything || _colormap_reupload || state.colormap.colors != _colormap_colors) {
+        _colormap_colors = state.colormap.colors;
+        glBindTexture(GL_TEXTURE_2D, _colormap_tex);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_SRGB8, _colormap_colors.size() / 3, 1, 0,
+                GL_RGB, GL_UNSIGNED_BYTE, _colormap_colors.data());
+        _colormap_reupload = false;
+    }
+    return reinitialize_everything;
+}
+
+GLint Renderer::fractal_tex_format() const
+{
+    // Distance estimates need a second channel with a large range. The
+    // compact formats of iterbuf.hpp are not used here: they would change
+    // the colors, e.g. because smooth values can be slightly negative and
+    // the coloring wraps them around the color map.
+    return _mandelbrot_distance ? GL_RG32F : GL_R32F;
+}
+
+void Renderer::set_fractal_region(QOpenGLShaderProgram* prg, __float128 x0, __float128 xw, __float128 y0, __float128 yw)
+{
+    switch (_precision_type) {
+    case precision_native_float:
+        glUniform1f(prg->uniformLocation("x0"), x0);
+        glUniform1f(prg->uniformLocation("xw"), xw);
+        glUniform1f(prg->uniformLocation("y0"), y0);
+        glUniform1f(prg->uniformLocation("yw"), yw);
+        break;
+    case precision_native_double:
+        glUniform1d(prg->uniformLocation("x0"), x0);
+        glUniform1d(prg->uniformLocation("xw"), xw);
+        glUniform1d(prg->uniformLocation("y0"), y0);
+        glUniform1d(prg->uniformLocation("yw"), yw);
+        break;
+    case precision_emu_doublefloat:
+        {
+            float d0, d1;
+            float128_to_pair(x0, &d0, &d1);
+            glUniform2f(prg->uniformLocation("x0"), d0, d1);
+            float128_to_pair(xw, &d0, &d1);
+            glUniform2f(prg->uniformLocation("xw"), d0, d1);
+            float128_to_pair(y0, &d0, &d1);
+            glUniform2f(prg->uniformLocation("y0"), d0, d1);
+            float128_to_pair(yw, &d0, &d1);
+            glUniform2f(prg->uniformLocation("yw"), d0, d1);
+        }
+        break;
+    case precision_emu_doubledouble:
+        {
+            double d0, d1;
+            float128_to_pair(x0, &d0, &d1);
+            glUniform2d(prg->uniformLocation("x0"), d0, d1);
+            float128_to_pair(xw, &d0, &d1);
+            glUniform2d(prg->uniformLocation("xw"), d0, d1);
+            float128_to_pair(y0, &d0, &d1);
+            glUniform2d(prg->uniformLocation("y0"), d0, d1);
+            float128_to_pair(yw, &d0, &d1);
+            glUniform2d(prg->uniformLocation("yw"), d0, d1);
+        }
+        break;
+    }
+}
+
+// Render the fractal with one sample per pixel into the texture tex of size
+// w x h, which is attached to the current framebuffer and has the format
+// fractal_tex_format(). The viewport must be set.
+void Renderer::render_fractal(GLuint tex, int w, int h, __float128 x0, __float128 xw, __float128 y0, __float128 yw)
+{
+    bool use_compute_shader = _use_compute_shader && !_compute_prg_failed;
+    if (use_compute_shader && !_compute_prg->isLinked()) {
+        _compute_prg->addShaderFromSourceCode(QOpenGLShader::Compute, shader_source(":fractal-cs.glsl", false));
+        if (!_compute_prg->bind()) {
+            // The GL implementation may fail to build this variant only, e.g.
+            // a precision it cannot handle in compute shaders; the fragment
+            // shader renders into the r32f texture, too
+            _compute_prg->removeAllShaders();
+            _compute_prg_failed = true;
+            use_compute_shader = false;
+        }
+    }
+    if (use_compute_shader) {
+        _compute_prg->bind();
+        // A pixel takes at most max_iter / 64 batches, so a tile of 64
+        // pixels in 64 slots takes about as many loop iterations
+        int tiles_per_group = std::max(1, std::min(compute_max_tiles_per_group,
+                    compute_max_batches * 64 / std::max(_mandelbrot_max_iter, 1)));
+        int tiles = ((w + compute_tile_size - 1) / compute_tile_size) * ((h + compute_tile_size - 1) / compute_tile_size);
+        set_fractal_region(_compute_prg, x0, xw, y0, yw);
+        glUniform2i(_compute_prg->uniformLocation("size"), w, h);
+        glUniform1i(_compute_prg->uniformLocation("tiles_per_group"), tiles_per_group);
+        const GLuint zero = 0;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _queue_buffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &zero);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, _queue_buffer);
+        glBindImageTexture(0, tex, 0, GL_FALSE, 0, GL_WRITE_ONLY, fractal_tex_format());
+        // Each dispatch takes up to compute_workgroups * tiles_per_group
+        // tiles from the queue, which keeps its position between dispatches
+        for (int dispatched = 0; dispatched < tiles; dispatched += compute_workgroups * tiles_per_group) {
+            glDispatchCompute(compute_workgroups, 1, 1);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        }
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT);
+    } else {
+        _fractal_prg->bind();
+        set_fractal_region(_fractal_prg, x0, xw, y0, yw);
+        glUniform2i(_fractal_prg->uniformLocation("size"), w, h);
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    }
+}
+
+/* Render the fractal for the region of size w x h into _fractal_tex by
+ * reprojecting the previous region shown in _fractal_tex where possible, e.g.
+ * during continuous zooming or shifting: pixels whose neighborhood had almost
+ * uniform iteration counts are interpolated from the previous values (see
+ * reprojection-fs.glsl), and all other pixels are computed with the fragment
+ * shader, which a stencil test restricts to these pixels. The cost of a frame
+ * thus depends on the length of the boundaries in the view, not on its area.
+ * A rotating subset of 1/16 of the pixels is always recomputed, so that
+ * interpolation errors do not accumulate over many frames. Returns false if
+ * the previous region is not valid, is the same as the current one, which
+ * then needs a full pass, or is too different. The previous values are kept
+ * in _reprojection_tex. The framebuffer _fractal_fbo must be bound. */
+bool Renderer::reproject(int w, int h, __float128 x0, __float128 xw, __float128 y0, __float128 yw)
+{
+    if (!_fractal_valid || (x0 == _fractal_x0 && xw == _fractal_xw && y0 == _fractal_y0 && yw == _fractal_yw))
+        return false;
+    __float128 scale_x = xw / _fractal_xw;
+    __float128 scale_y = yw / _fractal_yw;
+    __float128 offset_x = (x0 - _fractal_x0) / _fractal_xw;
+    __float128 offset_y = (y0 - _fractal_y0) / _fractal_yw;
+    if (!(scale_x >= 0.5Q && scale_x <= 2 && scale_y >= 0.5Q && scale_y <= 2
+                && offset_x > -scale_x && offset_x < 1 && offset_y > -scale_y && offset_y < 1))
+        return false;
+
+    std::swap(_fractal_tex, _reprojection_tex);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, _fractal_tex, 0);
+    glClearStencil(1);
+    glClear(GL_STENCIL_BUFFER_BIT);
+    glEnable(GL_STENCIL_TEST);
+    // Reproject. Discarded pixels keep the stencil value 1.
+    glStencilFunc(GL_ALWAYS, 0, 0xff);
+    glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+    _reprojection_prg->bind();
+    glUniform1i(_reprojection_prg->uniformLocation("previous"), 0);
+    glUniform2i(_reprojection_prg->uniformLocation("size"), w, h);
+    glUniform2f(_reprojection_prg->uniformLocation("offset"), offset_x, offset_y);
+    glUniform2f(_reprojection_prg->uniformLocation("scale"), scale_x, scale_y);
+    glUniform1f(_reprojection_prg->uniformLocation("threshold"),
+            reprojection_threshold / std::max(_mandelbrot_max_iter - 1, 1));
+    glUniform1i(_reprojection_prg->uniformLocation("refresh"), _reprojection_refresh);
+    glUniform1i(_reprojection_prg->uniformLocation("distance_estimation"), _mandelbrot_distance ? 1 : 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, _reprojection_tex);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    // Compute the remaining pixels. The compute shader would ignore the
+    // stencil test, so always use the fragment shader.
+    glStencilFunc(GL_EQUAL, 1, 0xff);
+    glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+    _fractal_prg->bind();
+    set_fractal_region(_fractal_prg, x0, xw, y0, yw);
+    glUniform2i(_fractal_prg->uniformLocation("size"), w, h);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    glDisable(GL_STENCIL_TEST);
+    _reprojection_refresh = (_reprojection_refresh + 1) % 16;
+    return true;
+}
+
+// Build the histogram of the values in the fractal texture tex of size w x h
+// and its prefix sums for histogram equalization, without reading anything
+// back. All counts and sums are integers, because float counts stop at 2^24,
+// which the dominant bins of large exports exceed. With compute shaders, the
+// histogram is counted with atomic additions (see histogram-cs.glsl).
+// Otherwise, it is counted by additive blending of one point per pixel (see
+// histogram-vs.glsl) into float counts, in passes that stay below 2^24
+// points, and each pass is added to the integer sums. The prefix sums are
+// computed in log2(bins) passes that each add the values stride places
+// before (see scan-fs.glsl). Returns the texture with the prefix sums, or 0
+// if bins exceeds the maximum texture size. The framebuffer binding and
+// viewport are changed.
+GLuint Renderer::equalize(GLuint tex, int w, int h, int bins)
+{
+    GLint max_tex_size;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_tex_size);
+    if (bins > max_tex_size)
+        return 0;
+    if (bins != _histogram_bins) {
+        for (int i = 0; i < 2; i++) {
+            glBindTexture(GL_TEXTURE_2D, _histogram_tex[i]);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, bins, 1, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+        }
+        glBindTexture(GL_TEXTURE_2D, _histogram_count_tex);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, bins, 1, 0, GL_RED, GL_FLOAT, NULL);
+        if (_histogram_cs_prg) {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, _histogram_buffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, bins * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+        }
+        _histogram_bins = bins;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, _histogram_fbo);
+    glViewport(0, 0, bins, 1);
+    glActiveTexture(GL_TEXTURE0);
+    int src = 0;
+    if (_histogram_cs_prg && _histogram_cs_prg->bind()) {
+        std::vector<GLuint> zeros(bins, 0);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _histogram_buffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, bins * sizeof(GLuint), zeros.data());
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, _histogram_buffer);
+        glUniform1i(_histogram_cs_prg->uniformLocation("fractal"), 0);
+        glUniform2i(_histogram_cs_prg->uniformLocation("size"), w, h);
+        glUniform1i(_histogram_cs_prg->uniformLocation("bins"), bins);
+        glBindTexture(GL_TEXTURE_2D, tex);
+        glDispatchCompute((w + 7) / 8, (h + 7) / 8, 1);
+        glMemoryBarrier(GL_PIXEL_BUFFER_BARRIER_BIT);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _histogram_buffer);
+        glBindTexture(GL_TEXTURE_2D, _histogram_tex[src]);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, bins, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, 0);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    } else {
+        const GLuint zero[4] = { 0, 0, 0, 0 };
+        const int points_per_pass = (1 << 24) - 1;
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, _histogram_tex[src], 0);
+        glClearBufferuiv(GL_COLOR, 0, zero);
+        for (int first = 0; first < w * h; first += points_per_pass) {
+            glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, _histogram_count_tex, 0);
+            glClear(GL_COLOR_BUFFER_BIT);
+            _histogram_prg->bind();
+            glUniform1i(_histogram_prg->uniformLocation("fractal"), 0);
+            glUniform1i(_histogram_prg->uniformLocation("width"), w);
+            glUniform1i(_histogram_prg->uniformLocation("bins"), bins);
+            glBindTexture(GL_TEXTURE_2D, tex);
+            glBlendFunc(GL_ONE, GL_ONE);
+            glEnable(GL_BLEND);
+            glBindVertexArray(_points_vao);
+            glDrawArrays(GL_POINTS, first, std::min(points_per_pass, w * h - first));
+            glBindVertexArray(_vao);
+            glDisable(GL_BLEND);
+            _scan_prg->bind();
+            glUniform1i(_scan_prg->uniformLocation("sums"), 0);
+            glUniform1i(_scan_prg->uniformLocation("counts"), 1);
+            glUniform1i(_scan_prg->uniformLocation("stride"), 0);
+            glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, _histogram_tex[1 - src], 0);
+            glBindTexture(GL_TEXTURE_2D, _histogram_tex[src]);
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, _histogram_count_tex);
+            glActiveTexture(GL_TEXTURE0);
+            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+            src = 1 - src;
+        }
+    }
+
+    _scan_prg->bind();
+    glUniform1i(_scan_prg->uniformLocation("sums"), 0);
+    glUniform1i(_scan_prg->uniformLocation("counts"), 1);
+    for (int stride = 1; stride < bins; stride *= 2) {
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, _histogram_tex[1 - src], 0);
+        glBindTexture(GL_TEXTURE_2D, _histogram_tex[src]);
+        glUniform1i(_scan_prg->uniformLocation("stride"), stride);
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+        src = 1 - src;
+    }
+    return _histogram_tex[src];
+}
+
+// Set the equalization uniforms of coloring-fs.glsl or the supersampling
+// program. Equalization is disabled if histogram_sums is 0.
+void Renderer::set_equalization(QOpenGLShaderProgram* prg, GLuint histogram_sums, int bins)
+{
+    glUniform1i(prg->uniformLocation("equalize"), histogram_sums ? 1 : 0);
+    glUniform1i(prg->uniformLocation("histogram_sums"), 2);
+    glUniform1i(prg->uniformLocation("bins"), bins);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, histogram_sums);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+tile_key_t Renderer::tile_key(int level, long long x, long long y) const
+{
+    tile_key_t key = { _mandelbrot_power, _mandelbrot_max_iter, _mandelbrot_bailout, _mandelbrot_smooth,
+        _mandelbrot_distance, _precision_type, level, x, y };
+    return key;
+}
+
+// The size of a new tile in bytes
+size_t Renderer::tile_bytes() const
+{
+    size_t value_size = (fractal_tex_format() == GL_RG32F ? 8 : 4);
+    return static_cast<size_t>(tile_size) * tile_size * value_size;
+}
+
+void Renderer::delete_tiles(const std::vector<unsigned int>& tiles)
+{
+    if (tiles.size() > 0)
+        glDeleteTextures(tiles.size(), tiles.data());
+}
+
+// Create a texture for a tile and make it the target of _tile_fbo
+GLuint Renderer::new_tile()
+{
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, fractal_tex_format(), tile_size, tile_size, 0, GL_RED, GL_FLOAT, NULL);
+    glBindFramebuffer(GL_FRAMEBUFFER, _tile_fbo);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex, 0);
+    glViewport(0, 0, tile_size, tile_size);
+    return tex;
+}
+
+// Draw the part texrect of a tile of the given level into the part rect of
+// the current framebuffer, whose pixels have the given size. Rectangles are
+// given as lower left corner and size.
+void Renderer::draw_tile(GLuint tile, int level, const float* rect, const float* texrect, __float128 pixel_size)
+{
+    __float128 tile_pixel_size = ldexpq(tile_cache_root_size, -level) / tile_size;
+    _tile_prg->bind();
+    glUniform4fv(_tile_prg->uniformLocation("rect"), 1, rect);
+    glUniform4fv(_tile_prg->uniformLocation("texrect"), 1, texrect);
+    glUniform1i(_tile_prg->uniformLocation("tile"), 0);
+    glUniform1f(_tile_prg->uniformLocation("distance_scale"), tile_pixel_size / pixel_size);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, tile);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+}
+
+// Compute a tile and insert it into the cache. The framebuffer binding and
+// viewport are changed.
+GLuint Renderer::compute_tile(const tile_key_t& key)
+{
+    __float128 width = ldexpq(tile_cache_root_size, -key.level);
+    GLuint tex = new_tile();
+    render_fractal(tex, tile_size, tile_size, key.x * width, width, key.y * width, width);
+    std::vector<unsigned int> evicted;
+    _tile_cache.insert(key, tex, tile_bytes(), evicted);
+    delete_tiles(evicted);
+    return tex;
+}
+
+// Whether a tile is cached, or can be built from cached tiles on the up to
+// depth finer levels
+bool Renderer::tile_available(const tile_key_t& key, int depth) const
+{
+    if (_tile_cache.contains(key))
+        return true;
+    if (depth <= 0 || key.level == tile_cache_max_level)
+        return false;
+    for (int j = 0; j < 2; j++)
+        for (int i = 0; i < 2; i++)
+            if (!tile_available(tile_key(key.level + 1, 2 * key.x + i, 2 * key.y + j), depth - 1))
+                return false;
+    return true;
+}
+
+// Return a tile from the cache, or build it from its four children and
+// insert it, if tile_available() says so. The children are minified with
+// nearest neighbor sampling, so the coarser tile keeps one of every four
+// samples. The framebuffer binding and viewport are changed.
+GLuint Renderer::cached_tile(const tile_key_t& key, int depth)
+{
+    GLuint tex = _tile_cache.find(key);
+    if (tex)
+        return tex;
+    tex = new_tile();
+    __float128 pixel_size = ldexpq(tile_cache_root_size, -key.level) / tile_size;
+    for (int j = 0; j < 2; j++) {
+        for (int i = 0; i < 2; i++) {
+            tile_key_t child_key = tile_key(key.level + 1, 2 * key.x + i, 2 * key.y + j);
+            // Building or computing the child changes the framebuffer
+            // binding. Computing is only necessary if building the other
+            // children evicted this one.
+            GLuint child = (tile_available(child_key, depth - 1) ? cached_tile(child_key, depth - 1) : compute_tile(child_key));
+            glBindFramebuffer(GL_FRAMEBUFFER, _tile_fbo);
+            glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex, 0);
+            glViewport(0, 0, tile_size, tile_size);
+            const float rect[] = { -1.0f + i, -1.0f + j, 1.0f, 1.0f };
+            const float texrect[] = { 0.0f, 0.0f, 1.0f, 1.0f };
+            draw_tile(child, key.level + 1, rect, texrect, pixel_size);
+        }
+    }
+    std::vector<unsigned int> evicted;
+    _tile_cache.insert(key, tex, tile_bytes(), evicted);
+    delete_tiles(evicted);
+    return tex;
+}
+
+// Floor division by a power of two, for negative tile coordinates
+static long long floor_div(long long x, int log2_d)
+{
+    long long d = 1LL << log2_d;
+    return (x >= 0 ? x : x - (d - 1)) / d;
+}
+
+/* Render the fractal into _fractal_tex, which is attached to _fractal_fbo,
+ * from the tile cache. Tiles are chosen from the quadtree level on which tile
+ * pixels are closest to display pixels in size, i.e. between 0.71 and 1.41
+ * display pixels wide, so that computing all tiles of a region costs about as
+ * much as computing the region directly. These sizes do not match the display
+ * grid, so render() uses the tiles only while navigating. Tiles are computed
+ * only if they are neither cached nor can be built from finer cached tiles.
+ * While coarser cached tiles are available as previews, computing missing
+ * tiles stops when the time budget for the frame is used up, the preview is
+ * shown, and *complete is set to false.
+ * Returns false if the cache cannot be used for this region, because it is
+ * disabled, the level is out of range, or the visible tiles do not fit into
+ * the cache. */
+bool Renderer::render_tiles(int w, int h, __float128 x0, __float128 xw, __float128 y0, __float128 yw,
+        bool* complete)
+{
+    __float128 pixel_size = xw / w;
+    __float128 l = roundq(log2q(tile_cache_root_size / (tile_size * pixel_size)));
+    if (!(l >= 0 && l <= tile_cache_max_level))
+        return false;
+    int level = l;
+    __float128 width = ldexpq(tile_cache_root_size, -level);
+    long long tx0 = floorq(x0 / width);
+    long long tx1 = ceilq((x0 + xw) / width) - 1;
+    long long ty0 = floorq(y0 / width);
+    long long ty1 = ceilq((y0 + yw) / width) - 1;
+    size_t tiles = (tx1 - tx0 + 1) * (ty1 - ty0 + 1);
+    if (tiles * tile_bytes() > _tile_cache.max_size())
+        return false;
+
+    // Process the tiles from the center outwards, so that the center is
+    // refined first
+    std::vector<std::pair<long long, long long> > order;
+    for (long long ty = ty0; ty <= ty1; ty++)
+        for (long long tx = tx0; tx <= tx1; tx++)
+            order.push_back(std::make_pair(tx, ty));
+    long long cx2 = tx0 + tx1;
+    long long cy2 = ty0 + ty1;
+    std::sort(order.begin(), order.end(),
+            [cx2, cy2](const std::pair<long long, long long>& a, const std::pair<long long, long long>& b) {
+                long long ax = 2 * a.first - cx2, ay = 2 * a.second - cy2;
+                long long bx = 2 * b.first - cx2, by = 2 * b.second - cy2;
+                return ax * ax + ay * ay < bx * bx + by * by;
+            });
+
+    QElapsedTimer timer;
+    timer.start();
+    *complete = true;
+    for (size_t t = 0; t < order.size(); t++) {
+        long long tx = order[t].first;
+        long long ty = order[t].second;
+        tile_key_t key = tile_key(level, tx, ty);
+        const float rect[] = {
+            static_cast<float>(-1 + 2 * (tx * width - x0) / xw),
+            static_cast<float>(-1 + 2 * (ty * width - y0) / yw),
+            static_cast<float>(2 * width / xw),
+            static_cast<float>(2 * width / yw)
+        };
+        float texrect[] = { 0.0f, 0.0f, 1.0f, 1.0f };
+        int tex_level = level;
+        GLuint tex = 0;
+        if (tile_available(key, tile_finer_levels)) {
+            tex = cached_tile(key, tile_finer_levels);
+        } else {
+            // Look for a preview on the coarser levels
+            GLuint preview = 0;
+            int a;
+            for (a = 1; a <= tile_coarser_levels && a <= level && !preview; a++)
+                preview = _tile_cache.find(tile_key(level - a, floor_div(tx, a), floor_div(ty, a)));
+            a--;
+            if (preview && timer.elapsed() >= tile_time_budget) {
+                long long n = 1LL << a;
+                tex = preview;
+                tex_level = level - a;
+                texrect[0] = static_cast<float>(tx - floor_div(tx, a) * n) / n;
+                texrect[1] = static_cast<float>(ty - floor_div(ty, a) * n) / n;
+                texrect[2] = 1.0f / n;
+                texrect[3] = 1.0f / n;
+                *complete = false;
+            } else {
+                tex = compute_tile(key);
+                // Wait for the result so that the time budget applies to
+                // the GPU work
+                if (preview)
+                    glFinish();
+            }
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, _fractal_fbo);
+        glViewport(0, 0, w, h);
+        draw_tile(tex, tex_level, rect, texrect, pixel_size);
+    }
+    return true;
+}
+
+bool Renderer::render(const State& state, __float128 x0, __float128 xw, __float128 y0, __float128 yw,
+        float colormap_offset, GLuint fbo, int w, int h, bool navigating)
+{
+    // Re-initialize resources where necessary
+    bool reinitialize_everything = update(state);
+    glActiveTexture(GL_TEXTURE0);
+    GLint fractal_tex_width, fractal_tex_height;
+    glBindTexture(GL_TEXTURE_2D, _fractal_tex);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &fractal_tex_width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &fractal_tex_height);
+    if (reinitialize_everything || fractal_tex_width != w || fractal_tex_height != h
+            || fractal_tex_format() != _fractal_tex_format) {
+        _fractal_tex_format = fractal_tex_format();
+        glTexImage2D(GL_TEXTURE_2D, 0, _fractal_tex_format, w, h, 0, GL_RED, GL_FLOAT, NULL);
+        glBindTexture(GL_TEXTURE_2D, _reprojection_tex);
+        glTexImage2D(GL_TEXTURE_2D, 0, _fractal_tex_format, w, h, 0, GL_RED, GL_FLOAT, NULL);
+        glBindRenderbuffer(GL_RENDERBUFFER, _reprojection_stencil);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, w, h);
+        glBindFramebuffer(GL_FRAMEBUFFER, _fractal_fbo);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, _fractal_tex, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, _reprojection_stencil);
+        _fractal_valid = false;
+    }
+
+    // Render the fractal into _fractal_tex. Tile pixels are 0.71 to 1.41
+    // display pixels wide and are drawn with nearest neighbor sampling, which
+    // doubles or drops display pixels, so a still view is computed on the
+    // exact display grid instead.
+    glBindFramebuffer(GL_FRAMEBUFFER, _fractal_fbo);
+    glViewport(0, 0, w, h);
+    bool complete = true;
+    _fractal_exact = false;
+    if (!navigating || !render_tiles(w, h, x0, xw, y0, yw, &complete)) {
+        if (reproject(w, h, x0, xw, y0, yw)) {
+            complete = false;
+        } else {
+            render_fractal(_fractal_tex, w, h, x0, xw, y0, yw);
+            _fractal_exact = true;
+        }
+    }
+    _fractal_valid = true;
+    _fractal_x0 = x0;
+    _fractal_xw = xw;
+    _fractal_y0 = y0;
+    _fractal_yw = yw;
+    int bins = equalization_bins(_mandelbrot_max_iter);
+    GLuint histogram_sums = (state.colormap.equalize ? equalize(_fractal_tex, w, h, bins) : 0);
+
+    // Render a colored version of _fractal_tex
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glViewport(0, 0, w, h);
+    color_fractal(state, colormap_offset, histogram_sums, bins);
+    _accumulation_samples = 0;
+    return complete;
+}
+
+// Color _fractal_tex into the current framebuffer
+void Renderer::color_fractal(const State& state, float colormap_offset, GLuint histogram_sums, int bins)
+{
+    _coloring_prg->bind();
+    set_equalization(_coloring_prg, histogram_sums, bins);
+    glUniform1i(_coloring_prg->uniformLocation("fractal"), 0);
+    glUniform1i(_coloring_prg->uniformLocation("colormap"), 1);
+    glUniform1i(_coloring_prg->uniformLocation("reverse"), state.colormap.reverse ? 1 : 0);
+    glUniform1f(_coloring_prg->uniformLocation("offset"), colormap_offset);
+    glUniform1i(_coloring_prg->uniformLocation("distance_estimation"), _mandelbrot_distance ? 1 : 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, _fractal_tex);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, _colormap_tex);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// The radical inverse of i in the given base, for the Halton sequence
+static float radical_inverse(int i, int base)
+{
+    float r = 0.0f;
+    float f = 1.0f / base;
+    for (; i > 0; i /= base, f /= base)
+        r += f * (i % base);
+    return r;
+}
+
+/* Each sample is computed directly at the pixel positions plus an offset, not
+ * from the tile cache, whose tiles do not match the pixel grid. The first
+ * sample has no offset; it is taken from _fractal_tex if the preceding
+ * render() call computed the exact pixels of this region, so that the full
+ * pass is not repeated. The following ones are spread over the pixel
+ * area with the Halton sequence in bases 2 and 3, so that the average
+ * approximates a box filter like the adaptive supersampling of exported
+ * images. The colors of the samples are summed up, so that the result does
+ * not depend on the coloring being linear in the iteration values. Before
+ * each sample is added, an occlusion query counts the pixels whose average
+ * changes by at least half a step of 8 bit colors; it is read in the next
+ * call, so that waiting for it does not stall the pipeline. */
+bool Renderer::accumulate(const State& state, __float128 x0, __float128 xw, __float128 y0, __float128 yw,
+        float colormap_offset, GLuint fbo, int w, int h)
+{
+    update(state);
+    if (_accumulation_samples == 0) {
+        for (int i = 0; i < 2; i++) {
+            GLint tex_width, tex_height;
+            glBindTexture(GL_TEXTURE_2D, _accumulation_tex[i]);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &tex_width);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &tex_height);
+            if (tex_width != w || tex_height != h)
+                glTexImage2D(GL_TEXTURE_2D, 0, i == 0 ? GL_RGBA32F : GL_RGBA16F, w, h, 0, GL_RGBA, GL_FLOAT, NULL);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, _accumulation_fbo);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, _accumulation_tex[0], 0);
+        if (_fractal_valid && _fractal_exact
+                && _fractal_x0 == x0 && _fractal_xw == xw && _fractal_y0 == y0 && _fractal_yw == yw) {
+            // Start the sums with the colors of the unjittered sample
+            int bins = equalization_bins(_mandelbrot_max_iter);
+            GLuint histogram_sums = (state.colormap.equalize ? equalize(_fractal_tex, w, h, bins) : 0);
+            glBindFramebuffer(GL_FRAMEBUFFER, _accumulation_fbo);
+            glViewport(0, 0, w, h);
+            color_fractal(state, colormap_offset, histogram_sums, bins);
+            _accumulation_samples = 1;
+        } else {
+            glClearColor(0.0, 0.0, 0.0, 0.0);
+            glClear(GL_COLOR_BUFFER_BIT);
+            glClearColor(0.0, 0.0, 0.0, 1.0);
+        }
+        _accumulation_query_pending = false;
+        _accumulation_converged = false;
+    }
+    if (_accumulation_query_pending) {
+        GLuint changed_pixels;
+        glGetQueryObjectuiv(_accumulation_query, GL_QUERY_RESULT, &changed_pixels);
+        _accumulation_query_pending = false;
+        _accumulation_converged = (changed_pixels == 0);
+    }
+
+    bool add_sample = (_accumulation_samples < accumulation_max_samples && !_accumulation_converged);
+    if (add_sample) {
+        float jx = 0.0f, jy = 0.0f;
+        if (_accumulation_samples > 0) {
+            jx = radical_inverse(_accumulation_samples, 2) - 0.5f;
+            jy = radical_inverse(_accumulation_samples, 3) - 0.5f;
+        }
+        // Render the sample into _fractal_tex and color it
+        glBindFramebuffer(GL_FRAMEBUFFER, _fractal_fbo);
+        glViewport(0, 0, w, h);
+        render_fractal(_fractal_tex, w, h, x0 + jx * xw / w, xw, y0 + jy * yw / h, yw);
+        _fractal_x0 = x0 + jx * xw / w;
+        _fractal_y0 = y0 + jy * yw / h;
+        _fractal_exact = (_accumulation_samples == 0);
+        int bins = equalization_bins(_mandelbrot_max_iter);
+        GLuint histogram_sums = (state.colormap.equalize ? equalize(_fractal_tex, w, h, bins) : 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, _accumulation_fbo);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, _accumulation_tex[1], 0);
+        glViewport(0, 0, w, h);
+        color_fractal(state, colormap_offset, histogram_sums, bins);
+
+        _accumulation_prg->bind();
+        glUniform1i(_accumulation_prg->uniformLocation("sums"), 0);
+        glUniform1i(_accumulation_prg->uniformLocation("colors"), 1);
+        glUniform1i(_accumulation_prg->uniformLocation("samples"), _accumulation_samples);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, _accumulation_tex[1]);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, _accumulation_tex[0]);
+        // Count the visibly changed pixels. Nothing is written; the target
+        // is fbo because the sums cannot be read and be attached.
+        if (_accumulation_samples > 0) {
+            glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+            glUniform1i(_accumulation_prg->uniformLocation("mode"), 1);
+            glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            glBeginQuery(GL_SAMPLES_PASSED, _accumulation_query);
+            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+            glEndQuery(GL_SAMPLES_PASSED);
+            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+            _accumulation_query_pending = true;
+        }
+        // Add the colors to the sums
+        glBindFramebuffer(GL_FRAMEBUFFER, _accumulation_fbo);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, _accumulation_tex[0], 0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glUniform1i(_accumulation_prg->uniformLocation("mode"), 0);
+        glBlendFunc(GL_ONE, GL_ONE);
+        glEnable(GL_BLEND);
+        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+        glDisable(GL_BLEND);
+        _accumulation_samples++;
+    }
+
+    // Show the average
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glViewport(0, 0, w, h);
+    _accumulation_prg->bind();
+    glUniform1i(_accumulation_prg->uniformLocation("sums"), 0);
+    glUniform1i(_accumulation_prg->uniformLocation("samples"), _accumulation_samples);
+    glUniform1i(_accumulation_prg->uniformLocation("mode"), 2);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, _accumulation_tex[0]);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    return add_sample;
+}
+
+// Start the transfer of the given color attachment of the current framebuffer
+// into a new pixel buffer object. The fence is flushed so that it can be
+// polled without blocking.
+void Renderer::start_readback(readback_t* rb, GLenum attachment, GLenum format, GLenum type, int pixel_size, int w, int h)
+{
+    rb->w = w;
+    rb->h = h;
+    rb->size = static_cast<size_t>(w) * h * pixel_size;
+    glGenBuffers(1, &rb->pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, rb->size, NULL, GL_STREAM_READ);
+    glReadBuffer(attachment);
+    glReadPixels(0, 0, w, h, format, type, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    rb->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+}
+
+// Wait for a transfer to complete and map its buffer
+const unsigned char* Renderer::map_readback(readback_t* rb)
+{
+    while (glClientWaitSync(rb->fence, 0, 1000000) == GL_TIMEOUT_EXPIRED)
+        ;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+    return static_cast<const unsigned char*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, rb->size, GL_MAP_READ_BIT));
+}
+
+// Unmap the buffer and free the resources of a transfer
+void Renderer::finish_readback(readback_t* rb)
+{
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glDeleteBuffers(1, &rb->pbo);
+    glDeleteSync(rb->fence);
+}
+
+QImage Renderer::render_image(const State& state, float colormap_offset, int w, int h,
+        const supersampling_t& supersampling, float* samples_per_pixel)
+{
+    if (_image_pending)
+        finish_image();
+    if (!start_image(state, colormap_offset, w, h, supersampling))
+        return QImage();
+    return finish_image(samples_per_pixel);
+}
+
+bool Renderer::start_image(const State& state, float colormap_offset, int w, int h,
+        const supersampling_t& supersampling)
+{
+    GLint max_tex_size;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_tex_size);
+    if (_image_pending || w > max_tex_size || h > max_tex_size)
+        return false;
+
+    update(state);
+    if (supersampling.enabled && !_supersampling_prg->isLinked())
+        build_fractal_prg(_supersampling_prg, true);
+    __float128 x0, xw, y0, yw;
+    state.region(w, h, &x0, &xw, &y0, &yw);
+
+    // Temporary resources: fractal texture, color texture, samples texture
+    GLuint fbo;
+    glGenFramebuffers(1, &fbo);
+    GLuint tex[3];
+    glGenTextures(3, tex);
+    for (int i = 0; i < 3; i++) {
+        glBindTexture(GL_TEXTURE_2D, tex[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        if (i == 0)
+            glTexImage2D(GL_TEXTURE_2D, 0, fractal_tex_format(), w, h, 0, GL_RED, GL_FLOAT, NULL);
+        else if (i == 1)
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        else if (supersampling.enabled)
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, w, h, 0, GL_RED, GL_FLOAT, NULL);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glViewport(0, 0, w, h);
+
+    // Render the fractal with one sample per pixel
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex[0], 0);
+    render_fractal(tex[0], w, h, x0, xw, y0, yw);
+    int bins = equalization_bins(_mandelbrot_max_iter);
+    GLuint histogram_sums = 0;
+    if (state.colormap.equalize) {
+        histogram_sums = equalize(tex[0], w, h, bins);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glViewport(0, 0, w, h);
+    }
+
+    // Color it, with adaptive supersampling if requested
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex[1], 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, tex[0]);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, _colormap_tex);
+    QOpenGLShaderProgram* prg;
+    if (supersampling.enabled) {
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, tex[2], 0);
+        const GLenum draw_buffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+        glDrawBuffers(2, draw_buffers);
+        prg = _supersampling_prg;
+        prg->bind();
+        set_fractal_region(prg, x0, xw, y0, yw);
+        glUniform2i(prg->uniformLocation("size"), w, h);
+        glUniform1i(prg->uniformLocation("first_pass"), 0);
+        glUniform1f(prg->uniformLocation("threshold"), supersampling.threshold / std::max(_mandelbrot_max_iter - 1, 1));
+        glUniform1i(prg->uniformLocation("max_samples"), supersampling.max_samples);
+    } else {
+        prg = _coloring_prg;
+        prg->bind();
+        glUniform1i(prg->uniformLocation("fractal"), 0);
+        glUniform1i(prg->uniformLocation("distance_estimation"), _mandelbrot_distance ? 1 : 0);
+    }
+    glUniform1i(prg->uniformLocation("colormap"), 1);
+    glUniform1i(prg->uniformLocation("reverse"), state.colormap.reverse ? 1 : 0);
+    glUniform1f(prg->uniformLocation("offset"), colormap_offset);
+    set_equalization(prg, histogram_sums, bins);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+
+    // Start the transfer of the results. The temporary resources can be
+    // deleted immediately; GL keeps them alive until the transfer is done.
+    start_readback(&_image_readback, GL_COLOR_ATTACHMENT0, GL_RGBA, GL_UNSIGNED_BYTE, 4, w, h);
+    if (supersampling.enabled)
+        start_readback(&_samples_readback, GL_COLOR_ATTACHMENT1, GL_RED, GL_FLOAT, sizeof(float), w, h);
+    _image_pending = true;
+    _image_supersampling = supersampling.enabled;
+    glDeleteTextures(3, tex);
+    glDeleteFramebuffers(1, &fbo);
+    return true;
+}
+
+bool Renderer::image_pending() const
+{
+    return _image_pending;
+}
+
+bool Renderer::image_ready()
+{
+    if (!_image_pending)
+        return false;
+    readback_t* rb = (_image_supersampling ? &_samples_readback : &_image_readback);
+    GLenum r = glClientWaitSync(rb->fence, 0, 0);
+    return (r == GL_ALREADY_SIGNALED || r == GL_CONDITION_SATISFIED);
+}
+
+QImage Renderer::finish_image(float* samples_per_pixel)
+{
+    if (!_image_pending)
+        return QImage();
+    int w = _image_readback.w;
+    int h = _image_readback.h;
+    QImage img(w, h, QImage::Format_RGBX8888);
+    const unsigned char* data = map_readback(&_image_readback);
+    // OpenGL has its origin at the bottom left
+    for (int y = 0; y < h; y++)
+        std::memcpy(img.scanLine(y), data + static_cast<size_t>(h - 1 - y) * w * 4, w * 4);
+    finish_readback(&_image_readback);
+    if (_image_supersampling) {
+        const float* samples = reinterpret_cast<const float*>(map_readback(&_samples_readback));
+        double sum = 0.0;
+        for (size_t i = 0; i < static_cast<size_t>(w) * h; i++)
+            sum += samples[i];
+        finish_readback(&_samples_readback);
+        if (samples_per_pixel)
+            *samples_per_pixel = sum / (static_cast<size_t>(w) * h);
+    } else if (samples_per_pixel) {
+        *samples_per_pixel = 1.0f;
+    }
+    _image_pending = false;
+    return img;
+}
+
+bool Renderer::render_iterations(const State& state, int w, int h, int tx, int ty, int tw, int th, float* values)
+{
+    if (!start_iterations(state, w, h, tx, ty, tw, th))
+        return false;
+    finish_iterations(values);
+    return true;
+}
+
+bool Renderer::start_iterations(const State& state, int w, int h, int tx, int ty, int tw, int th)
+{
+    GLint max_tex_size;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_tex_size);
+    if (tw > max_tex_size || th > max_tex_size)
+        return false;
+
+    update(state);
+    __float128 x0, xw, y0, yw;
+    state.region(w, h, &x0, &xw, &y0, &yw);
+    __float128 tile_x0 = x0 + tx * xw / w;
+    __float128 tile_xw = tw * xw / w;
+    __float128 tile_y0 = y0 + (h - (ty + th)) * yw / h;
+    __float128 tile_yw = th * yw / h;
+
+    GLuint fbo, tex;
+    glGenFramebuffers(1, &fbo);
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, _mandelbrot_distance ? GL_RG32F : GL_R32F, tw, th, 0, GL_RED, GL_FLOAT, NULL);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex, 0);
+    glViewport(0, 0, tw, th);
+    render_fractal(tex, tw, th, tile_x0, tile_xw, tile_y0, tile_yw);
+    readback_t rb;
+    start_readback(&rb, GL_COLOR_ATTACHMENT0, GL_RED, GL_FLOAT, sizeof(float), tw, th);
+    _iterations_readbacks.push_back(rb);
+    glDeleteTextures(1, &tex);
+    glDeleteFramebuffers(1, &fbo);
+    return true;
+}
+
+void Renderer::finish_iterations(float* values)
+{
+    readback_t rb = _iterations_readbacks.front();
+    _iterations_readbacks.pop_front();
+    const float* rows = reinterpret_cast<const float*>(map_readback(&rb));
+    // OpenGL has its origin at the bottom left
+    for (int y = 0; y < rb.h; y++)
+        std::memcpy(values + static_cast<size_t>(y) * rb.w, rows + static_cast<size_t>(rb.h - 1 - y) * rb.w, rb.w * sizeof(float));
+    finish_readback(&rb);
+}
+
+OffscreenRenderer::OffscreenRenderer() : Renderer(), _context(NULL), _surface(NULL)
+{
+}
+
+OffscreenRenderer::~OffscreenRenderer()
+{
+    // The shader programs must be destroyed while the context is current
+    if (_context && _context->makeCurrent(_surface)) {
+        cleanup();
+        _context->doneCurrent();
+    }
+    delete _context;
+    delete _surface;
+}
+
+bool OffscreenRenderer::initialize()
+{
+    QSurfaceFormat format;
+    format.setVersion(3, 3);
+    format.setProfile(QSurfaceFormat::CoreProfile);
+    _surface = new QOffscreenSurface();
+    _surface->setFormat(format);
+    _surface->create();
+    _context = new QOpenGLContext();
+    _context->setFormat(format);
+    if (!_surface->isValid() || !_context->create() || !_context->makeCurrent(_surface))
+        return false;
+    if (_context->format().majorVersion() < 3
+            || (_context->format().majorVersion() == 3 && _context->format().minorVersion() < 3))
+        return false;
+    Renderer::initialize();
+    return true;
+}
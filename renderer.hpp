@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RENDERER_HPP
+#define RENDERER_HPP
+
+#include <vector>
+#include <deque>
+
+#include <QOpenGLFunctions_3_3_Core>
+#include <QString>
+
+#include "state.hpp"
+#include "tilecache.hpp"
+
+class QOpenGLShaderProgram;
+class QOpenGLContext;
+class QOffscreenSurface;
+class QImage;
+
+// Adaptive supersampling for exported images
+typedef struct {
+    bool enabled;
+    float threshold;    // in iterations, >= 0
+    int max_samples;    // per axis, >= 2
+} supersampling_t;
+
+/* The GPU rendering pipeline: the shader programs built from vs.glsl,
+ * fractal-fs.glsl or fractal-cs.glsl, and coloring-fs.glsl, the fractal FBO
+ * and texture, and the color map texture. The fractal is computed with the
+ * compute shader if the context supports OpenGL 4.3, and with the fragment
+ * shader otherwise. All functions require the GL context that was current
+ * when initialize() was called. The renderer is used by GLWidget for display,
+ * and by OffscreenRenderer without a window, so that both produce identical
+ * images. For display only, render() keeps the fractal in a cache of quadtree
+ * tiles (see tilecache.hpp) while navigating, so that regions that were
+ * visible before are shown at once. For histogram equalization, the
+ * histogram of the fractal texture and its prefix sums are computed on the
+ * GPU as well, so that no values need to be read back. While the view is
+ * still, accumulate() refines the displayed image with jittered samples.
+ * Without the tile cache, the fractal of the previous frame is reprojected
+ * while the view moves, and only pixels near boundaries are recomputed; see
+ * reproject(). */
+class Renderer : protected QOpenGLFunctions_3_3_Core
+{
+public:
+    bool have_arb_gpu_shader_fp64;
+    bool have_arb_gpu_shader5;
+    bool have_compute_shader;
+
+private:
+    // GLSL shader compile-time constants
+    int _mandelbrot_power;
+    int _mandelbrot_max_iter;
+    float _mandelbrot_bailout;
+    bool _mandelbrot_smooth;
+    bool _mandelbrot_distance;
+    precision_type_t _precision_type;
+    // Whether the compute shader is used for the fractal
+    bool _use_compute_shader;
+    // Whether the compute program failed to build for the current shader
+    // constants; the fragment shader is used until the next rebuild
+    bool _compute_prg_failed;
+    // Colormap reload flag and the currently uploaded colormap
+    bool _colormap_reupload;
+    std::vector<unsigned char> _colormap_colors;
+    // GL resources
+    QOpenGLShaderProgram* _fractal_prg;
+    QOpenGLShaderProgram* _coloring_prg;
+    QOpenGLShaderProgram* _supersampling_prg;
+    QOpenGLShaderProgram* _compute_prg;
+    QOpenGLShaderProgram* _histogram_prg;
+    QOpenGLShaderProgram* _histogram_cs_prg;
+    QOpenGLShaderProgram* _scan_prg;
+    QOpenGLShaderProgram* _accumulation_prg;
+    QOpenGLShaderProgram* _reprojection_prg;
+    GLuint _vao;
+    GLuint _points_vao;
+    GLuint _queue_buffer;
+    GLuint _fractal_fbo;
+    GLuint _fractal_tex;
+    GLint _fractal_tex_format;
+    // The region shown in _fractal_tex, if it is valid for the current
+    // fractal parameters, and the resources to reproject it; see reproject()
+    bool _fractal_valid;
+    __float128 _fractal_x0, _fractal_xw, _fractal_y0, _fractal_yw;
+    // Whether _fractal_tex holds the exact values at the pixel centers of
+    // its region, so that accumulate() can start with them
+    bool _fractal_exact;
+    GLuint _reprojection_tex;
+    GLuint _reprojection_stencil;
+    int _reprojection_refresh;
+    GLuint _colormap_tex;
+    // Histogram and prefix sums for equalization; see equalize()
+    GLuint _histogram_fbo;
+    GLuint _histogram_tex[2];
+    GLuint _histogram_count_tex;
+    GLuint _histogram_buffer;
+    int _histogram_bins;
+    // Color sums of the jittered samples and colors of the latest sample,
+    // and the query that counts visibly changed pixels; see accumulate()
+    GLuint _accumulation_fbo;
+    GLuint _accumulation_tex[2];
+    GLuint _accumulation_query;
+    int _accumulation_samples;
+    bool _accumulation_query_pending;
+    bool _accumulation_converged;
+    // Pending transfers from the GPU to pixel buffer objects
+    typedef struct {
+        GLuint pbo;
+        GLsync fence;
+        int w, h;
+        size_t size;
+    } readback_t;
+    bool _image_pending;
+    bool _image_supersampling;
+    readback_t _image_readback;
+    readback_t _samples_readback;
+    std::deque<readback_t> _iterations_readbacks;
+    // Cache of display tiles; see render_tiles()
+    TileCache _tile_cache;
+    QOpenGLShaderProgram* _tile_prg;
+    GLuint _tile_fbo;
+    // GL extensions that are not available via QOpenGLFunctions_3_3_Core
+    void (*glUniform1d)(GLint location, GLdouble v0);
+    void (*glUniform2d)(GLint location, GLdouble v0, GLdouble v1);
+    void (*glDispatchCompute)(GLuint num_groups_x, GLuint num_groups_y, GLuint num_groups_z);
+    void (*glMemoryBarrier)(GLbitfield barriers);
+    void (*glBindImageTexture)(GLuint unit, GLuint texture, GLint level, GLboolean layered,
+            GLint layer, GLenum access, GLenum format);
+
+    QString shader_source(const QString& name, bool adaptive_supersampling);
+    void build_fractal_prg(QOpenGLShaderProgram* prg, bool adaptive_supersampling);
+    bool update(const State& state);
+    GLint fractal_tex_format() const;
+    void set_fractal_region(QOpenGLShaderProgram* prg, __float128 x0, __float128 xw, __float128 y0, __float128 yw);
+    void render_fractal(GLuint tex, int w, int h, __float128 x0, __float128 xw, __float128 y0, __float128 yw);
+    bool reproject(int w, int h, __float128 x0, __float128 xw, __float128 y0, __float128 yw);
+    GLuint equalize(GLuint tex, int w, int h, int bins);
+    void set_equalization(QOpenGLShaderProgram* prg, GLuint histogram_sums, int bins);
+    void color_fractal(const State& state, float colormap_offset, GLuint histogram_sums, int bins);
+    void start_readback(readback_t* rb, GLenum attachment, GLenum format, GLenum type, int pixel_size, int w, int h);
+    const unsigned char* map_readback(readback_t* rb);
+    void finish_readback(readback_t* rb);
+    tile_key_t tile_key(int level, long long x, long long y) const;
+    size_t tile_bytes() const;
+    void delete_tiles(const std::vector<unsigned int>& tiles);
+    GLuint new_tile();
+    void draw_tile(GLuint tile, int level, const float* rect, const float* texrect, __float128 pixel_size);
+    GLuint compute_tile(const tile_key_t& key);
+    bool tile_available(const tile_key_t& key, int depth) const;
+    GLuint cached_tile(const tile_key_t& key, int depth);
+    bool render_tiles(int w, int h, __float128 x0, __float128 xw, __float128 y0, __float128 yw, bool* complete);
+
+public:
+    Renderer();
+    virtual ~Renderer();
+
+    // Initialize the GL resources in the current context
+    void initialize();
+    // Destroy the shader programs; requires the context to be current
+    void cleanup();
+
+    // The GL_RENDERER string of the OpenGL implementation
+    const char* gl_renderer();
+
+    // Force a re-upload of the color map texture
+    void state_has_new_colormap();
+
+    // Use the compute shader if it is available (the default), or always the
+    // fragment shader
+    void set_compute_shader(bool enable);
+    bool compute_shader() const;
+
+    // The maximum size of the display tile cache in bytes. Zero disables
+    // the cache.
+    void set_tile_cache_size(size_t bytes);
+    size_t tile_cache_size() const;
+
+    // Render the given region of the state with the given color map offset
+    // into the framebuffer fbo, which has size w x h. While navigating, the
+    // region is shown from the tile cache, whose tile pixels do not match
+    // the display pixels, and parts may be shown from coarser cached tiles
+    // first; otherwise, or without the tile cache, most of the region may be
+    // reprojected from the previous call if the region moved. In these
+    // cases, false is returned, and further calls refine the result. A call
+    // that is not navigating and returns true has computed every display
+    // pixel exactly.
+    bool render(const State& state, __float128 x0, __float128 xw, __float128 y0, __float128 yw,
+            float colormap_offset, GLuint fbo, int w, int h, bool navigating);
+
+    // Progressive anti-aliasing of a still view: after render() returned
+    // true, each call with the same arguments adds one sample per pixel at a
+    // sub-pixel offset and shows the average of all samples so far. The
+    // exact pixels of a render() call that did not navigate are the first
+    // sample. Returns
+    // false when no samples were added because the maximum number is
+    // reached or the last sample did not visibly change the image; the
+    // average is shown anyway. The next render() call starts over.
+    bool accumulate(const State& state, __float128 x0, __float128 xw, __float128 y0, __float128 yw,
+            float colormap_offset, GLuint fbo, int w, int h);
+
+    // Render the state into an image of the given size. The average number
+    // of samples per pixel is returned in samples_per_pixel if it is not NULL.
+    // Returns a null image if the size is not supported. The framebuffer
+    // binding and viewport are changed.
+    QImage render_image(const State& state, float colormap_offset, int w, int h,
+            const supersampling_t& supersampling, float* samples_per_pixel = NULL);
+
+    // Asynchronous version of render_image(): start_image() renders the
+    // image and starts its transfer into a pixel buffer object, image_ready()
+    // checks without blocking whether the transfer is complete, and
+    // finish_image() waits for it and returns the image. Only one image can
+    // be pending. start_image() returns false if the size is not supported.
+    bool start_image(const State& state, float colormap_offset, int w, int h,
+            const supersampling_t& supersampling);
+    bool image_pending() const;
+    bool image_ready();
+    QImage finish_image(float* samples_per_pixel = NULL);
+
+    // Render the normalized iteration values of the tile (tx, ty, tw, th) of
+    // an image of size w x h. Tile coordinates and the resulting rows go from
+    // top to bottom. The framebuffer binding and viewport are changed. This
+    // must not be mixed with pending asynchronous tiles (see below).
+    bool render_iterations(const State& state, int w, int h, int tx, int ty, int tw, int th, float* values);
+
+    // Asynchronous version of render_iterations(): start_iterations()
+    // renders a tile and starts its transfer, and finish_iterations() waits
+    // for the oldest pending tile and returns its values. Starting the next
+    // tile before finishing the previous one overlaps rendering and transfer.
+    bool start_iterations(const State& state, int w, int h, int tx, int ty, int tw, int th);
+    void finish_iterations(float* values);
+};
+
+/* A Renderer with its own context on an offscreen surface, for rendering to
+ * memory without a window, e.g. on servers. This requires a QGuiApplication.
+ * On Linux systems without a display, use the offscreen Qt platform plugin
+ * with Mesa's surfaceless EGL platform:
+ * QT_QPA_PLATFORM=offscreen EGL_PLATFORM=surfaceless */
+class OffscreenRenderer : public Renderer
+{
+private:
+    QOpenGLContext* _context;
+    QOffscreenSurface* _surface;
+
+public:
+    OffscreenRenderer();
+    ~OffscreenRenderer();
+
+    // Create the context and initialize the renderer. Returns false if no
+    // suitable OpenGL implementation is available.
+    bool initialize();
+};
+
+#endif
@@ -0,0 +1,75 @@
+#version 330
+
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Reprojection of the fractal texture of the previous frame into the region
+ * of the current frame; see Renderer::reproject(). A pixel is interpolated
+ * from the previous values if the values in its neighborhood differ by at
+ * most the threshold. Otherwise, and for pixels whose neighborhood is not
+ * completely inside the previous region, and for one of every 16 pixels in a
+ * pattern that changes with each frame, the fragment is discarded so that
+ * the pixel is recomputed. */
+
+uniform sampler2D previous;
+uniform ivec2 size;
+// Texture coordinates t of the current frame map to offset + scale * t in
+// the previous frame
+uniform vec2 offset;
+uniform vec2 scale;
+uniform float threshold;    // in normalized iteration values
+uniform int refresh;        // in [0,15]
+// Whether the texture has distance estimates in its second channel; see
+// fractal.glsl. They are given in units of pixels and need to be scaled.
+uniform bool distance_estimation;
+
+layout(location = 0) out vec2 fvalue;
+
+void main(void)
+{
+    ivec2 q = ivec2(gl_FragCoord.xy);
+    if ((q.x % 4) + 4 * (q.y % 4) == refresh)
+        discard;
+    vec2 pp = (offset + scale * gl_FragCoord.xy / vec2(size)) * vec2(size) - 0.5;
+    ivec2 p = ivec2(floor(pp + 0.5));
+    if (any(lessThan(p, ivec2(1))) || any(greaterThanEqual(p, size - 1)))
+        discard;
+    vec2 vmin = vec2(+1.0e30);
+    vec2 vmax = vec2(-1.0e30);
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            vec2 v = texelFetch(previous, p + ivec2(dx, dy), 0).rg;
+            vmin = min(vmin, v);
+            vmax = max(vmax, v);
+        }
+    }
+    if (vmax.x - vmin.x > threshold)
+        discard;
+    // The boundary of the set passes through the neighborhood
+    if (distance_estimation && vmax.y > 0.0 && vmin.y < 1.0)
+        discard;
+    // Bilinear interpolation of the four nearest previous values, which are
+    // all in the neighborhood
+    ivec2 p0 = ivec2(floor(pp));
+    vec2 a = pp - vec2(p0);
+    vec2 v00 = texelFetch(previous, p0, 0).rg;
+    vec2 v10 = texelFetch(previous, p0 + ivec2(1, 0), 0).rg;
+    vec2 v01 = texelFetch(previous, p0 + ivec2(0, 1), 0).rg;
+    vec2 v11 = texelFetch(previous, p0 + ivec2(1, 1), 0).rg;
+    vec2 v = mix(mix(v00, v10, a.x), mix(v01, v11, a.x), a.y);
+    fvalue = vec2(v.x, v.y / scale.x);
+}
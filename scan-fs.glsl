@@ -0,0 +1,40 @@
+#version 330
+
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* One step of a parallel prefix sum over a texture of n x 1 integer values:
+ * each value gets the value stride places before it added. After the steps
+ * with stride 1, 2, 4, ... < n, each value is the sum of itself and all
+ * values before it. With stride 0, the float counts of one histogram pass
+ * are added instead. See Renderer::equalize(). */
+
+uniform usampler2D sums;
+uniform sampler2D counts;
+uniform int stride;
+
+layout(location = 0) out uint fsum;
+
+void main(void)
+{
+    int i = int(gl_FragCoord.x);
+    uint s = texelFetch(sums, ivec2(i, 0), 0).r;
+    if (stride == 0)
+        s += uint(texelFetch(counts, ivec2(i, 0), 0).r);
+    else if (i >= stride)
+        s += texelFetch(sums, ivec2(i - stride, 0), 0).r;
+    fsum = s;
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+
+#include <QFile>
+
+#include "scenefile.hpp"
+
+
+/* File layout (all values in host byte order, i.e. little endian in practice):
+ * char[8] magic "GLFRACTS"
+ * uint32 version (1)
+ * uint32 number of scenes
+ * uint64 index offset
+ * the scenes, each serialized by State::serialize() and starting at a
+ *   multiple of 16 bytes
+ * at the index offset, one pair of uint64 for each scene: offset and size
+ * The number of scenes and the index offset are written by close(); they are
+ * zero in incomplete files.
+ */
+
+static const char magic[8] = { 'G', 'L', 'F', 'R', 'A', 'C', 'T', 'S' };
+static const uint32_t version = 1;
+static const size_t header_size = 24;
+
+SceneFile::SceneFile() :
+    _file(NULL), _writable(false), _map(NULL), _index_offset(0), _scenes(0)
+{
+}
+
+SceneFile::~SceneFile()
+{
+    close();
+}
+
+// Append data at a multiple of 16 bytes and return its offset, or -1
+static qint64 append(QFile* file, const void* data, qint64 size)
+{
+    qint64 offset = file->size();
+    if (offset % 16 != 0) {
+        char padding[16] = { 0 };
+        if (!file->seek(offset) || file->write(padding, 16 - offset % 16) != 16 - offset % 16)
+            return -1;
+        offset += 16 - offset % 16;
+    }
+    if (!file->seek(offset) || file->write(static_cast<const char*>(data), size) != size)
+        return -1;
+    return offset;
+}
+
+bool SceneFile::create(const QString& filename)
+{
+    close();
+    _file = new QFile(filename);
+    if (!_file->open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        close();
+        return false;
+    }
+    _writable = true;
+    uint32_t header[2] = { version, 0 };
+    uint64_t index_offset = 0;
+    bool ok = (_file->write(magic, sizeof(magic)) == sizeof(magic)
+            && _file->write(reinterpret_cast<const char*>(header), sizeof(header)) == sizeof(header)
+            && _file->write(reinterpret_cast<const char*>(&index_offset), sizeof(index_offset))
+                == sizeof(index_offset));
+    if (!ok)
+        close();
+    return ok;
+}
+
+bool SceneFile::write_scene(const State& state)
+{
+    if (!_file || !_writable || _scenes == UINT32_MAX)
+        return false;
+    std::vector<unsigned char> data = state.serialize();
+    qint64 offset = append(_file, data.data(), data.size());
+    if (offset < 0)
+        return false;
+    _index.push_back(offset);
+    _index.push_back(data.size());
+    _scenes++;
+    return true;
+}
+
+bool SceneFile::open(const QString& filename)
+{
+    close();
+    _file = new QFile(filename);
+    if (!_file->open(QIODevice::ReadOnly)) {
+        close();
+        return false;
+    }
+    qint64 file_size = _file->size();
+    _map = file_size >= qint64(header_size) ? _file->map(0, file_size) : NULL;
+    if (!_map) {
+        close();
+        return false;
+    }
+    uint32_t header[2];
+    std::memcpy(header, _map + sizeof(magic), sizeof(header));
+    std::memcpy(&_index_offset, _map + sizeof(magic) + sizeof(header), sizeof(_index_offset));
+    _scenes = header[1];
+    if (std::memcmp(_map, magic, sizeof(magic)) != 0
+            || header[0] != version
+            || _index_offset < header_size || _index_offset > uint64_t(file_size)
+            || _scenes > (uint64_t(file_size) - _index_offset) / (2 * sizeof(uint64_t))) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool SceneFile::read_scene(int i, State* state) const
+{
+    if (!_map || i < 0 || uint32_t(i) >= _scenes)
+        return false;
+    uint64_t entry[2];
+    std::memcpy(entry, _map + _index_offset + 2 * i * sizeof(uint64_t), sizeof(entry));
+    if (entry[0] < header_size || entry[0] > _index_offset || entry[1] > _index_offset - entry[0])
+        return false;
+    return state->deserialize(_map + entry[0], entry[1]);
+}
+
+bool SceneFile::close()
+{
+    bool ok = true;
+    if (_file) {
+        if (_writable) {
+            qint64 index_size = _index.size() * sizeof(uint64_t);
+            qint64 index_offset = append(_file, _index.data(), index_size);
+            uint64_t header_index_offset = index_offset;
+            ok = (index_offset >= 0
+                    && _file->seek(sizeof(magic) + sizeof(uint32_t))
+                    && _file->write(reinterpret_cast<const char*>(&_scenes), sizeof(_scenes)) == sizeof(_scenes)
+                    && _file->write(reinterpret_cast<const char*>(&header_index_offset), sizeof(header_index_offset))
+                        == sizeof(header_index_offset)
+                    && _file->flush());
+        }
+        if (_map)
+            _file->unmap(const_cast<unsigned char*>(_map));
+        _file->close();
+        delete _file;
+    }
+    _file = NULL;
+    _writable = false;
+    _map = NULL;
+    _index_offset = 0;
+    _scenes = 0;
+    _index.clear();
+    return ok;
+}
+
+bool SceneFile::is_scene_file(const QString& filename)
+{
+    QFile file(filename);
+    char m[sizeof(magic)];
+    return (file.open(QIODevice::ReadOnly)
+            && file.read(m, sizeof(m)) == sizeof(m)
+            && std::memcmp(m, magic, sizeof(magic)) == 0);
+}
+
+bool SceneFile::load_all(const QString& filename, std::vector<State>& states)
+{
+    if (!is_scene_file(filename)) {
+        State state;
+        state.load(filename, true);
+        states.push_back(state);
+        return true;
+    }
+    SceneFile file;
+    if (!file.open(filename))
+        return false;
+    size_t first = states.size();
+    states.resize(first + file.scenes());
+    for (int i = 0; i < file.scenes(); i++) {
+        if (!file.read_scene(i, &(states[first + i]))) {
+            states.resize(first);
+            return false;
+        }
+    }
+    return true;
+}
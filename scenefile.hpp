@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCENEFILE_HPP
+#define SCENEFILE_HPP
+
+#include <vector>
+#include <cstdint>
+
+#include <QString>
+
+#include "state.hpp"
+
+class QFile;
+
+/* A binary file containing any number of states (scenes), e.g. a single
+ * fractal or all jobs of a batch or video. Each scene is stored as
+ * serialized by State::serialize(), so that __float128 values are exact and
+ * the color map is one block, instead of the text of .fract files.
+ * Scenes are written one after the other, so that files of any length can be
+ * written without keeping the scenes in memory. The file is memory-mapped for
+ * reading, and scenes are deserialized directly from the mapping. */
+class SceneFile
+{
+private:
+    QFile* _file;
+    bool _writable;
+    const unsigned char* _map;
+    uint64_t _index_offset;
+    uint32_t _scenes;
+    // Offsets and sizes of the scenes written so far
+    std::vector<uint64_t> _index;
+
+public:
+    SceneFile();
+    ~SceneFile();
+
+    // Create a file, then add scenes with write_scene(), and finally call
+    // close().
+    bool create(const QString& filename);
+    bool write_scene(const State& state);
+
+    // Open a file for reading.
+    bool open(const QString& filename);
+    int scenes() const { return _scenes; }
+    // Read scene i. Returns false if its data is invalid.
+    bool read_scene(int i, State* state) const;
+
+    bool close();
+
+    // Whether the file starts like a scene file, regardless of its name
+    static bool is_scene_file(const QString& filename);
+
+    // Append all scenes of a scene file, or the state of a .fract file, to
+    // states. Returns false if the file cannot be read.
+    static bool load_all(const QString& filename, std::vector<State>& states);
+};
+
+#endif
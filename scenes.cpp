@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* glfract-scenes: convert between .fract files and binary scene files.
+ *
+ * Pack .fract files and the scenes of other scene files, in the given order,
+ * into one binary scene file:
+ *   glfract-scenes -o scenes.fracts a.fract b.fract more.fracts
+ * Extract the scenes of scene files into .fract files named after the scene
+ * file and the scene number, e.g. scenes-000000.fract:
+ *   glfract-scenes -x [-o DIR] scenes.fracts */
+
+#include <cstdio>
+#include <vector>
+
+#include <getopt.h>
+
+#include <QString>
+#include <QFileInfo>
+#include <QDir>
+
+#include "state.hpp"
+#include "scenefile.hpp"
+
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s -o scenes.fracts fractal.fract|scenes.fracts [...]\n"
+            "       %s -x [-o DIR] scenes.fracts [...]\n"
+            "Options:\n"
+            "  -o, --output=FILE    The scene file to write, or the output directory\n"
+            "                       for --extract (default: the directory of each\n"
+            "                       input file)\n"
+            "  -x, --extract        Extract scenes into .fract files\n",
+            argv0, argv0);
+}
+
+int main(int argc, char* argv[])
+{
+    QString output;
+    bool extract = false;
+
+    const struct option options[] = {
+        { "output",  required_argument, NULL, 'o' },
+        { "extract", no_argument,       NULL, 'x' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "o:x", options, NULL)) != -1) {
+        switch (c) {
+        case 'o':
+            output = optarg;
+            break;
+        case 'x':
+            extract = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc || (!extract && output.isEmpty())) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (extract) {
+        for (int i = optind; i < argc; i++) {
+            QString name = argv[i];
+            QFileInfo info(name);
+            SceneFile file;
+            if (!file.open(name)) {
+                fprintf(stderr, "%s is not a readable scene file\n", qPrintable(name));
+                return 1;
+            }
+            QDir dir = (output.isEmpty() ? info.dir() : QDir(output));
+            for (int j = 0; j < file.scenes(); j++) {
+                State state;
+                if (!file.read_scene(j, &state)) {
+                    fprintf(stderr, "%s: scene %d is invalid\n", qPrintable(name), j);
+                    return 1;
+                }
+                state.save(dir.filePath(info.completeBaseName() + QString("-%1.fract").arg(j, 6, 10, QChar('0'))));
+            }
+            fprintf(stderr, "%s: %d scenes extracted\n", qPrintable(name), file.scenes());
+        }
+        return 0;
+    }
+
+    SceneFile file;
+    if (!file.create(output)) {
+        fprintf(stderr, "Cannot create %s\n", qPrintable(output));
+        return 1;
+    }
+    size_t scenes = 0;
+    for (int i = optind; i < argc; i++) {
+        QString name = argv[i];
+        std::vector<State> states;
+        if (!QFileInfo(name).isReadable() || !SceneFile::load_all(name, states)) {
+            fprintf(stderr, "%s is not readable\n", qPrintable(name));
+            return 1;
+        }
+        for (size_t j = 0; j < states.size(); j++) {
+            if (!file.write_scene(states[j])) {
+                fprintf(stderr, "Cannot write %s\n", qPrintable(output));
+                return 1;
+            }
+        }
+        scenes += states.size();
+    }
+    if (!file.close()) {
+        fprintf(stderr, "Cannot write %s\n", qPrintable(output));
+        return 1;
+    }
+    fprintf(stderr, "%s: %zu scenes packed\n", qPrintable(output), scenes);
+    return 0;
+}
@@ -17,9 +17,11 @@
  */
 
 #include "state.hpp"
+#include "scenefile.hpp"
 
 #include <cstring>
 #include <cmath>
+#include <cstdint>
 
 #include <QSettings>
 #include <QString>
@@ -73,6 +75,25 @@ static unsigned char default_colormap[] = {
 static size_t default_colormap_size = sizeof(default_colormap) / sizeof(unsigned char);
 
 
+template<typename T>
+static void put(std::vector<unsigned char>& v, T x)
+{
+    size_t i = v.size();
+    v.resize(i + sizeof(T));
+    std::memcpy(v.data() + i, &x, sizeof(T));
+}
+
+template<typename T>
+static bool get(const unsigned char* data, size_t size, size_t* i, T* x)
+{
+    if (*i + sizeof(T) > size)
+        return false;
+    std::memcpy(x, data + *i, sizeof(T));
+    *i += sizeof(T);
+    return true;
+}
+
+
 State::State()
 {
     fractal.type = fractal_mandelbrot;
@@ -80,6 +101,7 @@ State::State()
     fractal.mandelbrot.max_iter = 170;
     fractal.mandelbrot.bailout = 4.0f;
     fractal.mandelbrot.smooth = true;
+    fractal.mandelbrot.distance_estimation = false;
     fractal.mandelbrot.x0 = -2.5Q;
     fractal.mandelbrot.xw = 1.0Q - fractal.mandelbrot.x0;
     fractal.mandelbrot.y0 = -1.25Q;
@@ -88,6 +110,7 @@ State::State()
     colormap.colors.insert(colormap.colors.begin(), default_colormap, default_colormap + default_colormap_size);
     colormap.reverse = true;
     colormap.start = 0.0f;
+    colormap.equalize = false;
     colormap.animation = false;
     colormap.animation_reverse = false;
     colormap.animation_speed = 20;
@@ -96,6 +119,21 @@ State::State()
     navigation.zoom = 1.0Q;
 }
 
+void State::region(int w, int h, __float128* x0, __float128* xw, __float128* y0, __float128* yw) const
+{
+    __float128 fractal_ar = fractal.mandelbrot.xw / fractal.mandelbrot.yw;
+    __float128 viewport_ar = static_cast<__float128>(w) / h;
+    if (viewport_ar >= fractal_ar) {
+        *xw = fractal.mandelbrot.xw / navigation.zoom;
+        *yw = *xw / viewport_ar;
+    } else {
+        *yw = fractal.mandelbrot.yw / navigation.zoom;
+        *xw = *yw * viewport_ar;
+    }
+    *x0 = navigation.x - 0.5Q * *xw;
+    *y0 = navigation.y - 0.5Q * *yw;
+}
+
 void State::save(const QString& filename) const
 {
     char buf[64];
@@ -112,6 +150,7 @@ void State::save(const QString& filename) const
     settings.setValue("max_iter", fractal.mandelbrot.max_iter);
     settings.setValue("bailout", QString::number(fractal.mandelbrot.bailout));
     settings.setValue("smooth", fractal.mandelbrot.smooth);
+    settings.setValue("distance_estimation", fractal.mandelbrot.distance_estimation);
     quadmath_snprintf(buf, sizeof(buf), "%.36Qg", fractal.mandelbrot.x0);
     settings.setValue("x0", QString(buf));
     quadmath_snprintf(buf, sizeof(buf), "%.36Qg", fractal.mandelbrot.xw);
@@ -150,6 +189,7 @@ void State::save(const QString& filename) const
     }
     settings.setValue("reverse", colormap.reverse);
     settings.setValue("start", QString::number(colormap.start));
+    settings.setValue("equalize", colormap.equalize);
     settings.setValue("animation", colormap.animation);
     settings.setValue("animation_reverse", colormap.animation_reverse);
     settings.setValue("animation_speed", colormap.animation_speed);
@@ -167,10 +207,23 @@ void State::save(const QString& filename) const
 
 void State::load(const QString& filename, bool enable_double_based_precisions)
 {
-    QSettings settings(filename, QSettings::IniFormat);
     State defaults;
     QString tmp;
 
+    // Binary scene files: use the first scene
+    if (SceneFile::is_scene_file(filename)) {
+        SceneFile file;
+        *this = defaults;
+        if (file.open(filename) && !file.read_scene(0, this))
+            *this = defaults;
+        if (!enable_double_based_precisions
+                && (precision.type == precision_native_double || precision.type == precision_emu_doubledouble))
+            precision.type = defaults.precision.type;
+        return;
+    }
+
+    QSettings settings(filename, QSettings::IniFormat);
+
     settings.beginGroup("fractal");
     fractal.type = defaults.fractal.type;
     tmp = settings.value("type").toString();
@@ -181,6 +234,8 @@ void State::load(const QString& filename, bool enable_double_based_precisions)
     fractal.mandelbrot.max_iter = settings.value("max_iter", QString::number(defaults.fractal.mandelbrot.max_iter)).toInt();
     fractal.mandelbrot.bailout = settings.value("bailout", QString::number(defaults.fractal.mandelbrot.bailout)).toFloat();
     fractal.mandelbrot.smooth = settings.value("smooth", QString::number(defaults.fractal.mandelbrot.smooth)).toBool();
+    fractal.mandelbrot.distance_estimation = settings.value("distance_estimation",
+            QString::number(defaults.fractal.mandelbrot.distance_estimation)).toBool();
     fractal.mandelbrot.x0 = defaults.fractal.mandelbrot.x0;
     tmp = settings.value("x0").toString();
     if (!tmp.isEmpty())
@@ -233,6 +288,7 @@ void State::load(const QString& filename, bool enable_double_based_precisions)
     }
     colormap.reverse = settings.value("reverse", QString(defaults.colormap.reverse ? "true" : "false")).toBool();
     colormap.start = settings.value("start", QString::number(defaults.colormap.start)).toFloat();
+    colormap.equalize = settings.value("equalize", QString(defaults.colormap.equalize ? "true" : "false")).toBool();
     colormap.animation = settings.value("animation", QString(defaults.colormap.animation ? "true" : "false")).toBool();
     colormap.animation_reverse = settings.value("animation_reverse", QString(defaults.colormap.animation_reverse ? "true" : "false")).toBool();
     colormap.animation_speed = settings.value("animation_speed", QString::number(defaults.colormap.animation_speed)).toInt();
@@ -253,3 +309,80 @@ void State::load(const QString& filename, bool enable_double_based_precisions)
         navigation.zoom = strtoflt128(qPrintable(tmp), 0);
     settings.endGroup();
 }
+
+std::vector<unsigned char> State::serialize() const
+{
+    std::vector<unsigned char> v;
+    put<int32_t>(v, fractal.type);
+    put<int32_t>(v, fractal.mandelbrot.power);
+    put<int32_t>(v, fractal.mandelbrot.max_iter);
+    put<float>(v, fractal.mandelbrot.bailout);
+    put<uint8_t>(v, fractal.mandelbrot.smooth);
+    put<__float128>(v, fractal.mandelbrot.x0);
+    put<__float128>(v, fractal.mandelbrot.xw);
+    put<__float128>(v, fractal.mandelbrot.y0);
+    put<__float128>(v, fractal.mandelbrot.yw);
+    put<int32_t>(v, precision.type);
+    put<uint32_t>(v, colormap.colors.size() / 3);
+    v.insert(v.end(), colormap.colors.begin(), colormap.colors.end());
+    put<uint8_t>(v, colormap.reverse);
+    put<float>(v, colormap.start);
+    put<uint8_t>(v, colormap.animation);
+    put<uint8_t>(v, colormap.animation_reverse);
+    put<int32_t>(v, colormap.animation_speed);
+    put<__float128>(v, navigation.x);
+    put<__float128>(v, navigation.y);
+    put<__float128>(v, navigation.zoom);
+    put<uint8_t>(v, fractal.mandelbrot.distance_estimation);
+    put<uint8_t>(v, colormap.equalize);
+    return v;
+}
+
+bool State::deserialize(const unsigned char* data, size_t size)
+{
+    size_t i = 0;
+    int32_t fractal_type, precision_type;
+    uint8_t smooth, reverse, animation, animation_reverse;
+    uint32_t n;
+    if (!get(data, size, &i, &fractal_type)
+            || !get(data, size, &i, &fractal.mandelbrot.power)
+            || !get(data, size, &i, &fractal.mandelbrot.max_iter)
+            || !get(data, size, &i, &fractal.mandelbrot.bailout)
+            || !get(data, size, &i, &smooth)
+            || !get(data, size, &i, &fractal.mandelbrot.x0)
+            || !get(data, size, &i, &fractal.mandelbrot.xw)
+            || !get(data, size, &i, &fractal.mandelbrot.y0)
+            || !get(data, size, &i, &fractal.mandelbrot.yw)
+            || !get(data, size, &i, &precision_type)
+            || !get(data, size, &i, &n)
+            || n < 1 || n > 1024 || i + 3 * n > size)
+        return false;
+    fractal.type = static_cast<fractal_type_t>(fractal_type);
+    fractal.mandelbrot.smooth = smooth;
+    precision.type = static_cast<precision_type_t>(precision_type);
+    colormap.colors.assign(data + i, data + i + 3 * n);
+    i += 3 * n;
+    if (!get(data, size, &i, &reverse)
+            || !get(data, size, &i, &colormap.start)
+            || !get(data, size, &i, &animation)
+            || !get(data, size, &i, &animation_reverse)
+            || !get(data, size, &i, &colormap.animation_speed)
+            || !get(data, size, &i, &navigation.x)
+            || !get(data, size, &i, &navigation.y)
+            || !get(data, size, &i, &navigation.zoom))
+        return false;
+    colormap.reverse = reverse;
+    colormap.animation = animation;
+    colormap.animation_reverse = animation_reverse;
+    // Data from older versions ends here
+    uint8_t distance_estimation = 0;
+    if (i < size && !get(data, size, &i, &distance_estimation))
+        return false;
+    fractal.mandelbrot.distance_estimation = distance_estimation;
+    uint8_t equalize = 0;
+    if (i < size && !get(data, size, &i, &equalize))
+        return false;
+    colormap.equalize = equalize;
+    return (fractal.type == fractal_mandelbrot
+            && precision.type >= precision_native_float && precision.type <= precision_emu_doubledouble);
+}
@@ -19,6 +19,7 @@
 #define STATE_HPP
 
 #include <vector>
+#include <cstddef>
 
 class QString;
 
@@ -45,6 +46,9 @@ public:
             int max_iter;
             float bailout;
             bool smooth;
+            // Compute an exterior distance estimate in addition to the
+            // iteration value; see fractal.glsl
+            bool distance_estimation;
             __float128 x0, xw, y0, yw;
         } mandelbrot;
     } fractal;
@@ -59,6 +63,8 @@ public:
         std::vector<unsigned char> colors;
         bool reverse;
         float start; // in [0,1]
+        // Histogram equalization of the iteration values; see Equalization
+        bool equalize;
         bool animation;
         bool animation_reverse;
         int animation_speed; // in cycles-per-minute, >= 1
@@ -71,8 +77,18 @@ public:
 
     State();
 
+    // Compute the fractal region that is shown in a viewport of the given size
+    void region(int w, int h, __float128* x0, __float128* xw, __float128* y0, __float128* yw) const;
+
+    // Save and load .fract files. load() also reads the first scene of a
+    // binary scene file (see SceneFile).
     void save(const QString& filename) const;
     void load(const QString& filename, bool enable_double_based_precisions);
+
+    // Binary serialization, e.g. for file headers. deserialize() returns
+    // false if the data is invalid.
+    std::vector<unsigned char> serialize() const;
+    bool deserialize(const unsigned char* data, size_t size);
 };
 
 #endif
@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* glfract-sweep: render variants of a fractal into one contact sheet.
+ *
+ * The view of the input file is rendered with all combinations of the given
+ * powers, bailouts and iteration limits, e.g.
+ *   glfract-sweep -p 2-8 -b 4,256 -m 100,1000 fractal.fract sheet.png
+ * Each list is either comma-separated values or a range of integers like
+ * 2-8; parameters without a list keep their value from the input file.
+ * The variants are arranged with the iteration limits varying fastest and the
+ * powers slowest, with one row of the sheet per power, or per bailout if
+ * there is only one power. The parameters of each cell are printed to
+ * standard output.
+ *
+ * All variants are computed in one batch with Engine::render_sweep(), which
+ * computes variants that differ only in the iteration limit together and
+ * keeps all threads busy across variants. The --sequential option renders
+ * each variant with its own Engine::render() call instead, for comparison. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+#include <getopt.h>
+
+#include <QString>
+#include <QStringList>
+#include <QFileInfo>
+#include <QImage>
+#include <QElapsedTimer>
+
+#include "state.hpp"
+#include "engine.hpp"
+#include "coloring.hpp"
+
+
+// Parse a comma-separated list of integers and integer ranges like 2-8
+static bool parse_int_list(const QString& s, std::vector<int>& list)
+{
+    QStringList items = s.split(',');
+    for (int i = 0; i < items.size(); i++) {
+        QStringList range = items[i].split('-');
+        bool ok0 = false, ok1 = false;
+        int first = range[0].toInt(&ok0);
+        int last = (range.size() == 2 ? range[1].toInt(&ok1) : first);
+        if (!ok0 || (range.size() == 2 && !ok1) || range.size() > 2 || last < first)
+            return false;
+        for (int v = first; v <= last; v++)
+            list.push_back(v);
+    }
+    return true;
+}
+
+static bool parse_float_list(const QString& s, std::vector<float>& list)
+{
+    QStringList items = s.split(',');
+    for (int i = 0; i < items.size(); i++) {
+        bool ok;
+        list.push_back(items[i].toFloat(&ok));
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [options] fractal.fract sheet.png\n"
+            "Options:\n"
+            "  -p, --power=LIST     Powers, e.g. 2-8 or 2,3,5\n"
+            "  -b, --bailout=LIST   Bailout values, e.g. 4,16,256\n"
+            "  -m, --max-iter=LIST  Iteration limits, e.g. 100,1000,10000\n"
+            "  -w, --width=W        Width of each cell (default 320)\n"
+            "  -h, --height=H       Height of each cell (default 240)\n"
+            "  -c, --columns=C      Number of columns (default: see above)\n"
+            "  -g, --gap=G          Gap between cells in pixels (default 2)\n"
+            "  -t, --threads=T      Number of threads (default: one per core)\n"
+            "  -s, --sequential     Render the variants one by one\n",
+            argv0);
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<int> powers;
+    std::vector<float> bailouts;
+    std::vector<int> max_iters;
+    int width = 320;
+    int height = 240;
+    int columns = 0;
+    int gap = 2;
+    int threads = 0;
+    bool sequential = false;
+
+    const struct option options[] = {
+        { "power",      required_argument, NULL, 'p' },
+        { "bailout",    required_argument, NULL, 'b' },
+        { "max-iter",   required_argument, NULL, 'm' },
+        { "width",      required_argument, NULL, 'w' },
+        { "height",     required_argument, NULL, 'h' },
+        { "columns",    required_argument, NULL, 'c' },
+        { "gap",        required_argument, NULL, 'g' },
+        { "threads",    required_argument, NULL, 't' },
+        { "sequential", no_argument,       NULL, 's' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+    bool ok = true;
+    while (ok && (c = getopt_long(argc, argv, "p:b:m:w:h:c:g:t:s", options, NULL)) != -1) {
+        switch (c) {
+        case 'p':
+            ok = parse_int_list(optarg, powers);
+            break;
+        case 'b':
+            ok = parse_float_list(optarg, bailouts);
+            break;
+        case 'm':
+            ok = parse_int_list(optarg, max_iters);
+            break;
+        case 'w':
+            width = atoi(optarg);
+            break;
+        case 'h':
+            height = atoi(optarg);
+            break;
+        case 'c':
+            columns = atoi(optarg);
+            break;
+        case 'g':
+            gap = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 's':
+            sequential = true;
+            break;
+        default:
+            ok = false;
+            break;
+        }
+    }
+    if (!ok || optind != argc - 2 || width < 1 || height < 1 || columns < 0 || gap < 0 || threads < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    for (size_t i = 0; i < powers.size(); i++) {
+        if (powers[i] < 2) {
+            fprintf(stderr, "Invalid power %d\n", powers[i]);
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < max_iters.size(); i++) {
+        if (max_iters[i] < 2) {
+            fprintf(stderr, "Invalid iteration limit %d\n", max_iters[i]);
+            return 1;
+        }
+    }
+
+    QString input = argv[optind];
+    QString output = argv[optind + 1];
+    if (!QFileInfo(input).isReadable()) {
+        fprintf(stderr, "%s is not readable\n", qPrintable(input));
+        return 1;
+    }
+    State base;
+    base.load(input, true);
+    if (base.fractal.mandelbrot.distance_estimation) {
+        fprintf(stderr, "%s: distance estimation is not supported\n", qPrintable(input));
+        return 1;
+    }
+    if (powers.empty())
+        powers.push_back(base.fractal.mandelbrot.power);
+    if (bailouts.empty())
+        bailouts.push_back(base.fractal.mandelbrot.bailout);
+    if (max_iters.empty())
+        max_iters.push_back(base.fractal.mandelbrot.max_iter);
+
+    std::vector<State> states;
+    for (size_t i = 0; i < powers.size(); i++) {
+        for (size_t j = 0; j < bailouts.size(); j++) {
+            for (size_t k = 0; k < max_iters.size(); k++) {
+                State state = base;
+                state.fractal.mandelbrot.power = powers[i];
+                state.fractal.mandelbrot.bailout = bailouts[j];
+                state.fractal.mandelbrot.max_iter = max_iters[k];
+                states.push_back(state);
+            }
+        }
+    }
+    int n = states.size();
+    if (columns == 0) {
+        int rows = (powers.size() > 1 ? powers.size() : bailouts.size() > 1 ? bailouts.size() : 1);
+        columns = n / rows;
+    }
+    columns = std::min(columns, n);
+    int rows = (n + columns - 1) / columns;
+
+    std::vector<float> values(static_cast<size_t>(n) * width * height);
+    std::vector<float*> variant_values(n);
+    for (int i = 0; i < n; i++)
+        variant_values[i] = values.data() + static_cast<size_t>(i) * width * height;
+    Engine engine(threads);
+    QElapsedTimer timer;
+    timer.start();
+    if (sequential) {
+        for (int i = 0; i < n; i++)
+            engine.render(states[i], width, height, variant_values[i]);
+    } else {
+        engine.render_sweep(states, width, height, variant_values);
+    }
+    fprintf(stderr, "%d variants rendered in %.2f s\n", n, timer.elapsed() / 1000.0);
+
+    QImage sheet(columns * width + (columns - 1) * gap, rows * height + (rows - 1) * gap,
+            QImage::Format_RGBX8888);
+    if (sheet.isNull()) {
+        fprintf(stderr, "Cannot create a sheet of %d x %d cells\n", columns, rows);
+        return 1;
+    }
+    sheet.fill(Qt::black);
+    Coloring coloring(base);
+    float offset = colormap_offset(base, 0.0);
+    for (int i = 0; i < n; i++) {
+        int row = i / columns;
+        int column = i % columns;
+        // Each variant is equalized on its own, like a single render
+        Equalization equalization(states[i]);
+        if (base.colormap.equalize) {
+            equalization.add(variant_values[i], static_cast<size_t>(width) * height, engine.threads());
+            equalization.update();
+        }
+        for (int y = 0; y < height; y++) {
+            unsigned char* line = sheet.scanLine(row * (height + gap) + y) + 4 * column * (width + gap);
+            coloring.apply(offset, variant_values[i] + static_cast<size_t>(y) * width, width, line,
+                    base.colormap.equalize ? &equalization : NULL);
+        }
+        printf("%d %d power=%d bailout=%g max_iter=%d\n", row, column,
+                states[i].fractal.mandelbrot.power,
+                states[i].fractal.mandelbrot.bailout,
+                states[i].fractal.mandelbrot.max_iter);
+    }
+    if (!sheet.save(output)) {
+        fprintf(stderr, "Cannot write %s\n", qPrintable(output));
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,33 @@
+#version 330
+
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+uniform sampler2D tile;
+// Distance estimates are measured in pixels of the tile; this converts them
+// to pixels of the target
+uniform float distance_scale;
+
+smooth in vec2 vxy;
+
+layout(location = 0) out vec2 fvalue;
+
+void main(void)
+{
+    vec2 fd = texture(tile, vxy).rg;
+    fvalue = vec2(fd.r, fd.g * distance_scale);
+}
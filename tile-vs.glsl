@@ -0,0 +1,35 @@
+#version 330
+
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Draws a part of a cached tile into a part of the fractal texture; see
+ * Renderer::render_tiles(). The rectangles are given as lower left corner
+ * and size. */
+
+layout(location = 1) in vec2 texcoord;
+
+uniform vec4 rect;      // in normalized device coordinates
+uniform vec4 texrect;   // in texture coordinates of the tile
+
+smooth out vec2 vxy;
+
+void main(void)
+{
+    vxy = texrect.xy + texcoord * texrect.zw;
+    gl_Position = vec4(rect.xy + texcoord * rect.zw, 0.0, 1.0);
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tilecache.hpp"
+
+
+bool operator<(const tile_key_t& a, const tile_key_t& b)
+{
+    if (a.level != b.level)
+        return a.level < b.level;
+    if (a.x != b.x)
+        return a.x < b.x;
+    if (a.y != b.y)
+        return a.y < b.y;
+    if (a.power != b.power)
+        return a.power < b.power;
+    if (a.max_iter != b.max_iter)
+        return a.max_iter < b.max_iter;
+    if (a.bailout != b.bailout)
+        return a.bailout < b.bailout;
+    if (a.smooth != b.smooth)
+        return a.smooth < b.smooth;
+    if (a.distance_estimation != b.distance_estimation)
+        return a.distance_estimation < b.distance_estimation;
+    return a.precision < b.precision;
+}
+
+TileCache::TileCache(size_t max_size) : _max_size(max_size), _size(0)
+{
+}
+
+size_t TileCache::max_size() const
+{
+    return _max_size;
+}
+
+void TileCache::set_max_size(size_t max_size, std::vector<unsigned int>& evicted)
+{
+    _max_size = max_size;
+    evict(0, evicted);
+}
+
+// Evict the least recently used tiles until a tile of the given size fits
+void TileCache::evict(size_t size, std::vector<unsigned int>& evicted)
+{
+    while (!_lru.empty() && _size + size > _max_size) {
+        std::map<tile_key_t, entry_t>::iterator it = _entries.find(_lru.back());
+        evicted.push_back(it->second.handle);
+        _size -= it->second.size;
+        _entries.erase(it);
+        _lru.pop_back();
+    }
+}
+
+bool TileCache::contains(const tile_key_t& key) const
+{
+    return _entries.find(key) != _entries.end();
+}
+
+unsigned int TileCache::find(const tile_key_t& key)
+{
+    std::map<tile_key_t, entry_t>::iterator it = _entries.find(key);
+    if (it == _entries.end())
+        return 0;
+    _lru.splice(_lru.begin(), _lru, it->second.lru_pos);
+    return it->second.handle;
+}
+
+void TileCache::insert(const tile_key_t& key, unsigned int handle, size_t size, std::vector<unsigned int>& evicted)
+{
+    if (size > _max_size) {
+        evicted.push_back(handle);
+        return;
+    }
+    evict(size, evicted);
+    _lru.push_front(key);
+    entry_t e = { handle, size, _lru.begin() };
+    _entries.insert(std::make_pair(key, e));
+    _size += size;
+}
+
+void TileCache::clear(std::vector<unsigned int>& evicted)
+{
+    for (std::map<tile_key_t, entry_t>::iterator it = _entries.begin(); it != _entries.end(); ++it)
+        evicted.push_back(it->second.handle);
+    _entries.clear();
+    _lru.clear();
+    _size = 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILECACHE_HPP
+#define TILECACHE_HPP
+
+#include <vector>
+#include <list>
+#include <map>
+#include <cstddef>
+
+#include "state.hpp"
+
+/* A tile in a quadtree over the complex plane, together with the fractal
+ * parameters that its iteration values depend on. The color map is not part
+ * of the key since coloring happens after the fractal pass.
+ * Tiles on level 0 have the width tile_cache_root_size, and each level halves
+ * it. Tile (x, y) on a level covers [x * width, (x + 1) * width] in the real
+ * part and [y * width, (y + 1) * width] in the imaginary part; the children
+ * of a tile are (2x + i, 2y + j) for i, j in { 0, 1 } on the next level. */
+typedef struct {
+    int power;
+    int max_iter;
+    float bailout;
+    bool smooth;
+    bool distance_estimation;
+    precision_type_t precision;
+    int level;
+    long long x, y;
+} tile_key_t;
+
+bool operator<(const tile_key_t& a, const tile_key_t& b);
+
+// The width of level 0 tiles in the complex plane
+const int tile_cache_root_size = 4;
+// The deepest level; tile coordinates must fit into long long
+const int tile_cache_max_level = 60;
+
+/* A memory-bounded cache of tiles that evicts the least recently used tiles
+ * first. It only does the bookkeeping: the data of a tile is identified by
+ * an opaque handle, e.g. a texture name, and handles of evicted tiles are
+ * returned to the caller for deletion. */
+class TileCache
+{
+private:
+    typedef struct {
+        unsigned int handle;
+        size_t size;
+        std::list<tile_key_t>::iterator lru_pos;
+    } entry_t;
+    std::map<tile_key_t, entry_t> _entries;
+    // Keys in order of use, most recently used first
+    std::list<tile_key_t> _lru;
+    size_t _max_size;
+    size_t _size;
+
+    void evict(size_t size, std::vector<unsigned int>& evicted);
+
+public:
+    TileCache(size_t max_size);
+
+    // The maximum total size of the cached tiles. Zero disables the cache.
+    size_t max_size() const;
+    void set_max_size(size_t max_size, std::vector<unsigned int>& evicted);
+
+    // Whether the given tile is cached, without marking it as used
+    bool contains(const tile_key_t& key) const;
+
+    // Return the handle of the given tile and mark it as used, or return 0
+    // if the tile is not cached
+    unsigned int find(const tile_key_t& key);
+
+    // Insert a tile whose data has the given size, evicting old tiles as
+    // necessary. The tile must not be cached yet. If it is larger than the
+    // cache, its own handle is returned in evicted.
+    void insert(const tile_key_t& key, unsigned int handle, size_t size, std::vector<unsigned int>& evicted);
+
+    // Remove all tiles
+    void clear(std::vector<unsigned int>& evicted);
+};
+
+#endif
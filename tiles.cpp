@@ -0,0 +1,404 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* glfract-tiles: export a fractal as a tile pyramid for web map viewers.
+ *
+ * The pyramid covers the square region around the navigation center of the
+ * given .fract file that a square viewport shows. Level z consists of
+ * 2^z x 2^z tiles, stored as DIR/z/x/y.png with x from left to right and y
+ * from top to bottom, as expected by slippy map viewers such as Leaflet or
+ * OpenLayers. Tiles are processed in parallel, one per thread.
+ *
+ * Only the tiles of the deepest level are rendered. A tile on any other level
+ * covers exactly its four children on the next level, so it is built by
+ * averaging 2x2 pixel blocks of the children; this is the same as rendering it
+ * with 2x2 supersampling, recursively. With --direct, every level is rendered
+ * instead, e.g. to get unfiltered values on all levels.
+ *
+ * Each level directory contains a file .glfract-key that describes the
+ * parameters its tiles were made with. On re-runs, existing tiles of levels
+ * with unchanged parameters are skipped, so that an interrupted export can be
+ * resumed. Levels with changed parameters are removed and made again. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <climits>
+#include <algorithm>
+
+#include <getopt.h>
+
+#include <QString>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QSaveFile>
+#include <QImage>
+#include <QImageWriter>
+#include <QElapsedTimer>
+
+#include "state.hpp"
+#include "engine.hpp"
+#include "coloring.hpp"
+
+
+class Pyramid
+{
+public:
+    State state;
+    QString dir;
+    QString format;
+    int quality;
+    int tile_size;
+    int min_level, max_level;
+    bool direct;
+    bool fixed;
+
+    QString tile_name(int z, int x, int y) const
+    {
+        return QString("%1/%2/%3/%4.%5").arg(dir).arg(z).arg(x).arg(y).arg(format);
+    }
+
+    // Whether the tiles of level z are rendered or built from the next level
+    bool rendered(int z) const
+    {
+        return direct || z == max_level;
+    }
+
+    // A description of everything that the tiles of level z depend on
+    std::string key(int z) const
+    {
+        std::string key = "glfract-tiles";
+        key += " tile_size=" + std::to_string(tile_size);
+        key += " quality=" + std::to_string(quality);
+        key += std::string(" backend=") + (fixed ? "fixed" : "cpu");
+        if (rendered(z))
+            key += " rendered";
+        else
+            key += " downsampled_from=" + std::to_string(max_level);
+        key += " state=";
+        std::vector<unsigned char> s = state.serialize();
+        for (size_t i = 0; i < s.size(); i++) {
+            char hex[3];
+            snprintf(hex, sizeof(hex), "%02x", s[i]);
+            key += hex;
+        }
+        key += '\n';
+        return key;
+    }
+};
+
+// Make sure that the existing tiles of level z were made with the current
+// parameters. If the key of the level differs, the key and the tiles are
+// removed before the new key is written, so that an interruption cannot
+// leave old tiles with a new key.
+static bool prepare_level(const Pyramid& pyramid, int z)
+{
+    int n = 1 << z;
+    QDir level_dir(pyramid.dir + '/' + QString::number(z));
+    QString key_name = level_dir.filePath(".glfract-key");
+    std::string key = pyramid.key(z);
+    bool key_matches = false;
+    QFile key_file(key_name);
+    if (key_file.open(QIODevice::ReadOnly)) {
+        key_matches = (key_file.readAll() == QByteArray(key.data(), key.size()));
+        key_file.close();
+    }
+    if (!key_matches) {
+        QFile::remove(key_name);
+        for (int x = 0; x < n; x++)
+            for (int y = 0; y < n; y++)
+                QFile::remove(pyramid.tile_name(z, x, y));
+    }
+    for (int x = 0; x < n; x++) {
+        if (!level_dir.mkpath(QString::number(x))) {
+            fprintf(stderr, "Cannot create %s\n", qPrintable(level_dir.filePath(QString::number(x))));
+            return false;
+        }
+    }
+    if (!key_matches) {
+        QSaveFile new_key_file(key_name);
+        if (!new_key_file.open(QIODevice::WriteOnly)
+                || new_key_file.write(key.data(), key.size()) != static_cast<qint64>(key.size())
+                || !new_key_file.commit()) {
+            fprintf(stderr, "Cannot write %s\n", qPrintable(key_name));
+            return false;
+        }
+    }
+    return true;
+}
+
+static QImage render_tile(const Pyramid& pyramid, const Engine& engine, const Coloring& coloring,
+        const Equalization* equalization, int z, int x, int y, std::vector<float>& values)
+{
+    int s = pyramid.tile_size;
+    int size = s << z;
+    values.resize(static_cast<size_t>(s) * s);
+    if (pyramid.fixed)
+        engine.render_fixed(pyramid.state, size, size, x * s, y * s, s, s, values.data());
+    else
+        engine.render(pyramid.state, size, size, x * s, y * s, s, s, values.data());
+    QImage img(s, s, QImage::Format_RGBX8888);
+    if (img.isNull())
+        return img;
+    float offset = colormap_offset(pyramid.state, 0.0);
+    for (int row = 0; row < s; row++)
+        coloring.apply(offset, values.data() + static_cast<size_t>(row) * s, s, img.scanLine(row), equalization);
+    return img;
+}
+
+// Build a tile from its four children on the next level. Returns a null
+// image if a child cannot be read.
+static QImage downsample_tile(const Pyramid& pyramid, int z, int x, int y)
+{
+    int s = pyramid.tile_size;
+    int h = s / 2;
+    QImage img(s, s, QImage::Format_RGBX8888);
+    if (img.isNull())
+        return img;
+    for (int j = 0; j < 2; j++) {
+        for (int i = 0; i < 2; i++) {
+            QImage child(pyramid.tile_name(z + 1, 2 * x + i, 2 * y + j));
+            if (child.width() != s || child.height() != s)
+                return QImage();
+            child = child.convertToFormat(QImage::Format_RGBX8888);
+            for (int cy = 0; cy < h; cy++) {
+                const unsigned char* r0 = child.constScanLine(2 * cy);
+                const unsigned char* r1 = child.constScanLine(2 * cy + 1);
+                unsigned char* d = img.scanLine(j * h + cy) + i * h * 4;
+                for (int cx = 0; cx < h; cx++) {
+                    for (int c = 0; c < 4; c++) {
+                        d[4 * cx + c] = (r0[8 * cx + c] + r0[8 * cx + 4 + c]
+                                + r1[8 * cx + c] + r1[8 * cx + 4 + c] + 2) / 4;
+                    }
+                }
+            }
+        }
+    }
+    return img;
+}
+
+static bool save_tile(const Pyramid& pyramid, const QImage& img, const QString& name)
+{
+    QSaveFile file(name);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    QImageWriter writer(&file, pyramid.format.toLatin1());
+    writer.setQuality(pyramid.quality);
+    return writer.write(img) && file.commit();
+}
+
+static void work(const Pyramid* pyramid, int z, const Coloring* coloring, const Equalization* equalization,
+        std::atomic<long long>* next_tile, std::atomic<long long>* skipped, std::atomic<long long>* failed)
+{
+    Engine engine(1);
+    std::vector<float> values;
+    long long n = 1LL << z;
+    long long i;
+    while ((i = (*next_tile)++) < n * n) {
+        int x = i % n;
+        int y = i / n;
+        QString name = pyramid->tile_name(z, x, y);
+        if (QFileInfo(name).exists()) {
+            (*skipped)++;
+            continue;
+        }
+        QImage img = (pyramid->rendered(z)
+                ? render_tile(*pyramid, engine, *coloring, equalization, z, x, y, values)
+                : downsample_tile(*pyramid, z, x, y));
+        if (img.isNull() || !save_tile(*pyramid, img, name)) {
+            fprintf(stderr, "Cannot write %s\n", qPrintable(name));
+            (*failed)++;
+        }
+    }
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [options] fractal.fract\n"
+            "Options:\n"
+            "  -o, --output=DIR     Output directory (default: fractal-tiles next to\n"
+            "                       the input file)\n"
+            "  -z, --min-level=Z    Coarsest level, with one tile (default 0)\n"
+            "  -Z, --max-level=Z    Deepest level, with 2^Z x 2^Z tiles (default 5)\n"
+            "  -s, --tile-size=S    Tile width and height; must be even (default 256)\n"
+            "  -f, --format=EXT     Tile format, e.g. png or webp (default png)\n"
+            "  -q, --quality=Q      Quality for lossy formats, 0-100 (default: format\n"
+            "                       specific)\n"
+            "  -b, --backend=B      Render with cpu or fixed (default cpu)\n"
+            "  -d, --direct         Render all levels instead of building them from\n"
+            "                       the next level\n"
+            "  -t, --threads=T      Number of threads (default: one per core)\n",
+            argv0);
+}
+
+int main(int argc, char* argv[])
+{
+    QString output_dir;
+    int min_level = 0;
+    int max_level = 5;
+    int tile_size = 256;
+    QString format = "png";
+    int quality = -1;
+    QString backend = "cpu";
+    bool direct = false;
+    int threads = 0;
+
+    const struct option options[] = {
+        { "output",    required_argument, NULL, 'o' },
+        { "min-level", required_argument, NULL, 'z' },
+        { "max-level", required_argument, NULL, 'Z' },
+        { "tile-size", required_argument, NULL, 's' },
+        { "format",    required_argument, NULL, 'f' },
+        { "quality",   required_argument, NULL, 'q' },
+        { "backend",   required_argument, NULL, 'b' },
+        { "direct",    no_argument,       NULL, 'd' },
+        { "threads",   required_argument, NULL, 't' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "o:z:Z:s:f:q:b:dt:", options, NULL)) != -1) {
+        switch (c) {
+        case 'o':
+            output_dir = optarg;
+            break;
+        case 'z':
+            min_level = atoi(optarg);
+            break;
+        case 'Z':
+            max_level = atoi(optarg);
+            break;
+        case 's':
+            tile_size = atoi(optarg);
+            break;
+        case 'f':
+            format = optarg;
+            break;
+        case 'q':
+            quality = atoi(optarg);
+            break;
+        case 'b':
+            backend = optarg;
+            break;
+        case 'd':
+            direct = true;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1
+            || min_level < 0 || max_level < min_level || max_level > 30
+            || tile_size < 2 || tile_size % 2 != 0 || (static_cast<long long>(tile_size) << max_level) > INT_MAX
+            || quality < -1 || quality > 100
+            || (backend != "cpu" && backend != "fixed") || threads < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!QImageWriter::supportedImageFormats().contains(format.toLatin1())) {
+        fprintf(stderr, "Unsupported tile format %s\n", qPrintable(format));
+        return 1;
+    }
+
+    QString input = argv[optind];
+    QFileInfo info(input);
+    if (!info.isReadable()) {
+        fprintf(stderr, "%s is not readable\n", qPrintable(input));
+        return 1;
+    }
+    Pyramid pyramid;
+    pyramid.state.load(input, true);
+    if (pyramid.state.fractal.mandelbrot.distance_estimation) {
+        fprintf(stderr, "%s: distance estimation is not supported\n", qPrintable(input));
+        return 1;
+    }
+    pyramid.dir = (output_dir.isEmpty() ? info.dir().filePath(info.completeBaseName() + "-tiles") : output_dir);
+    pyramid.format = format;
+    pyramid.quality = quality;
+    pyramid.tile_size = tile_size;
+    pyramid.min_level = min_level;
+    pyramid.max_level = max_level;
+    pyramid.direct = direct;
+    pyramid.fixed = (backend == "fixed");
+    Coloring coloring(pyramid.state);
+    if (threads == 0)
+        threads = Engine().threads();
+    // With histogram equalization, all tiles use the histogram of an
+    // overview of the whole region, so that they fit together
+    Equalization equalization(pyramid.state);
+    if (pyramid.state.colormap.equalize) {
+        int size = tile_size << std::min(max_level, 2);
+        std::vector<float> values(static_cast<size_t>(size) * size);
+        Engine engine(threads);
+        if (pyramid.fixed)
+            engine.render_fixed(pyramid.state, size, size, values.data());
+        else
+            engine.render(pyramid.state, size, size, values.data());
+        equalization.add(values.data(), values.size(), threads);
+        equalization.update();
+    }
+    const Equalization* eq = (pyramid.state.colormap.equalize ? &equalization : NULL);
+
+    // Process the levels from the deepest one, since the others are built
+    // from it
+    QElapsedTimer total_timer;
+    total_timer.start();
+    long long total_made = 0;
+    long long total_failed = 0;
+    for (int z = max_level; z >= min_level; z--) {
+        if (!prepare_level(pyramid, z))
+            return 1;
+        QElapsedTimer timer;
+        timer.start();
+        std::atomic<long long> next_tile(0);
+        std::atomic<long long> skipped(0);
+        std::atomic<long long> failed(0);
+        std::vector<std::thread> workers;
+        for (int i = 1; i < threads; i++)
+            workers.push_back(std::thread(work, &pyramid, z, &coloring, eq, &next_tile, &skipped, &failed));
+        work(&pyramid, z, &coloring, eq, &next_tile, &skipped, &failed);
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+        long long tiles = (1LL << z) * (1LL << z);
+        long long made = tiles - skipped - failed;
+        double seconds = timer.elapsed() / 1000.0;
+        fprintf(stderr, "level %d: %lld tiles %s, %lld skipped, %lld failed (%.2f s, %.1f tiles/s)\n",
+                z, made, pyramid.rendered(z) ? "rendered" : "downsampled",
+                static_cast<long long>(skipped), static_cast<long long>(failed),
+                seconds, made / std::max(seconds, 0.001));
+        total_made += made;
+        total_failed += failed;
+        // Coarser levels cannot be built from an incomplete level
+        if (failed > 0 && !direct)
+            break;
+    }
+    double seconds = total_timer.elapsed() / 1000.0;
+    fprintf(stderr, "%lld tiles made in %.2f s (%.1f tiles/s)\n",
+            total_made, seconds, total_made / std::max(seconds, 0.001));
+    if (total_failed > 0) {
+        fprintf(stderr, "%lld tiles failed\n", total_failed);
+        return 1;
+    }
+    return 0;
+}
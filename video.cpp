@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2023  Martin Lambers <marlam@marlam.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* glfract-video: render a zoom video along a path given by two or more .fract
+ * files as keyframes, or by the scenes of binary scene files (.fracts). The
+ * navigation center is interpolated linearly and the zoom factor and the
+ * maximum number of iterations logarithmically between consecutive
+ * keyframes. The precision is taken from the deeper keyframe of each
+ * segment, all other parameters from the keyframe at its start.
+ * Frames are written as numbered PNG files or as raw RGB24 frames to
+ * standard output, e.g. for
+ *   glfract-video -r a.fract b.fract \
+ *       | ffmpeg -f rawvideo -pix_fmt rgb24 -s 1920x1080 -r 30 -i - zoom.mp4
+ * Alternatively, it renders the color map animation of a single fractal. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include <getopt.h>
+
+#include <QString>
+#include <QFileInfo>
+#include <QImage>
+
+#include <quadmath.h>
+
+#include "state.hpp"
+#include "scenefile.hpp"
+#include "engine.hpp"
+#include "coloring.hpp"
+#include "iterbuf.hpp"
+
+
+// Returns the index of the keyframe that starts the segment
+static int interpolate(const std::vector<State>& keyframes, int frame, int frames, State* state)
+{
+    int segments = keyframes.size() - 1;
+    double t = (frames > 1 ? static_cast<double>(frame) / (frames - 1) : 0.0) * segments;
+    int k = t;
+    if (k >= segments)
+        k = segments - 1;
+    __float128 s = t - k;
+    const State& a = keyframes[k];
+    const State& b = keyframes[k + 1];
+    *state = a;
+    state->navigation.x = a.navigation.x + s * (b.navigation.x - a.navigation.x);
+    state->navigation.y = a.navigation.y + s * (b.navigation.y - a.navigation.y);
+    state->navigation.zoom = expq(logq(a.navigation.zoom)
+            + s * (logq(b.navigation.zoom) - logq(a.navigation.zoom)));
+    state->fractal.mandelbrot.max_iter = std::round(std::exp(std::log(a.fractal.mandelbrot.max_iter)
+                + static_cast<double>(s) * (std::log(b.fractal.mandelbrot.max_iter) - std::log(a.fractal.mandelbrot.max_iter))));
+    if (b.navigation.zoom > a.navigation.zoom)
+        state->precision.type = b.precision.type;
+    return k;
+}
+
+/* Exponential map mode: the video zooms into the center of the last keyframe,
+ * from the zoom factor of the first keyframe to that of the last, with all
+ * other parameters from the last keyframe. Instead of computing each frame,
+ * a log-polar strip around the center is computed once (see
+ * Engine::render_expmap()) and each frame is resampled from it. Only a small
+ * disc around the center, where the strip would need infinitely many rows, is
+ * computed directly for each frame. The strip is computed incrementally while
+ * the zoom advances, and rows that are no longer needed are dropped, so that
+ * memory usage stays bounded for arbitrarily deep zooms. */
+class ExpMap
+{
+private:
+    const Engine& _engine;
+    const State& _state;
+    int _w;
+    double _r0, _step;
+    int _first_row;
+    std::deque<std::vector<float>> _rows;
+    std::vector<float> _chunk;
+
+    void compute(int row0, int rows)
+    {
+        _chunk.resize(static_cast<size_t>(rows) * _w);
+        _engine.render_expmap(_state, _w, _r0, row0, rows, _chunk.data());
+        samples += _chunk.size();
+    }
+
+public:
+    static const int chunk_rows = 256;
+    size_t samples;
+
+    ExpMap(const Engine& engine, const State& state, int w, double r0) :
+        _engine(engine), _state(state), _w(w), _r0(r0), _step(2.0 * M_PI / w), _first_row(0), samples(0)
+    {
+    }
+
+    // The strip row that corresponds to the given radius
+    double row(double radius) const
+    {
+        return std::log(_r0 / radius) / _step;
+    }
+
+    // Make rows [a, b] available
+    void update(int a, int b)
+    {
+        while (!_rows.empty() && _first_row < a) {
+            _rows.pop_front();
+            _first_row++;
+        }
+        while (!_rows.empty() && _first_row + static_cast<int>(_rows.size()) - 1 > b + chunk_rows)
+            _rows.pop_back();
+        if (_rows.empty())
+            _first_row = a;
+        if (a < _first_row) {
+            int row0 = std::max(0, std::min(a, _first_row - chunk_rows));
+            compute(row0, _first_row - row0);
+            for (int r = _first_row - row0 - 1; r >= 0; r--)
+                _rows.push_front(std::vector<float>(_chunk.begin() + r * _w, _chunk.begin() + (r + 1) * _w));
+            _first_row = row0;
+        }
+        int next_row = _first_row + _rows.size();
+        if (b >= next_row) {
+            int rows = std::max(b + 1 - next_row, chunk_rows);
+            compute(next_row, rows);
+            for (int r = 0; r < rows; r++)
+                _rows.push_back(std::vector<float>(_chunk.begin() + r * _w, _chunk.begin() + (r + 1) * _w));
+        }
+    }
+
+    // Bilinear interpolation at the given row and angle
+    float sample(double row, double angle) const
+    {
+        double r = row - _first_row;
+        double c = angle / _step - 0.5;
+        int r0 = std::floor(r);
+        int c0 = std::floor(c);
+        float fr = r - r0;
+        float fc = c - c0;
+        int r1 = std::min(r0 + 1, static_cast<int>(_rows.size()) - 1);
+        r0 = std::max(0, std::min(r0, r1));
+        c0 = ((c0 % _w) + _w) % _w;
+        int c1 = (c0 + 1) % _w;
+        float v0 = (1.0f - fc) * _rows[r0][c0] + fc * _rows[r0][c1];
+        float v1 = (1.0f - fc) * _rows[r1][c0] + fc * _rows[r1][c1];
+        return (1.0f - fr) * v0 + fr * v1;
+    }
+};
+
+static bool write_frame(int frame, const std::vector<unsigned char>& rgbx, int width, int height,
+        bool raw, const QString& prefix, std::vector<unsigned char>& rgb)
+{
+    if (raw) {
+        rgb.resize(rgbx.size() / 4 * 3);
+        for (size_t i = 0; i < rgbx.size() / 4; i++) {
+            rgb[3 * i + 0] = rgbx[4 * i + 0];
+            rgb[3 * i + 1] = rgbx[4 * i + 1];
+            rgb[3 * i + 2] = rgbx[4 * i + 2];
+        }
+        if (fwrite(rgb.data(), rgb.size(), 1, stdout) != 1 || fflush(stdout) != 0) {
+            fprintf(stderr, "Cannot write frame %d to standard output\n", frame);
+            return false;
+        }
+    } else {
+        QString name = prefix + QString("%1.png").arg(frame, 6, 10, QChar('0'));
+        QImage img(rgbx.data(), width, height, QImage::Format_RGBX8888);
+        if (!img.save(name)) {
+            fprintf(stderr, "Cannot write %s\n", qPrintable(name));
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Color map cycling mode: the iteration values are computed only once (or
+ * read from an iteration buffer file), and each frame only applies the color
+ * map with the offset of the color map animation at its time. If the fractal
+ * has no color map animation enabled, it is enabled with the configured
+ * speed. */
+static int cycle(const QString& name, int width, int height, int frames, double fps,
+        int threads, bool raw, const QString& prefix)
+{
+    State state;
+    std::vector<float> values;
+    Engine engine(threads);
+    if (name.endsWith(".iterbuf", Qt::CaseInsensitive)) {
+        IterBuf buf;
+        if (!buf.open(name)) {
+            fprintf(stderr, "Cannot read %s\n", qPrintable(name));
+            return 1;
+        }
+        state = buf.state;
+        width = buf.width;
+        height = buf.height;
+        values.resize(static_cast<size_t>(width) * height);
+        for (int y = 0; y < height; y += buf.tile_size) {
+            if (!buf.read_tile_row(y, values.data() + static_cast<size_t>(y) * width)) {
+                fprintf(stderr, "Cannot read %s\n", qPrintable(name));
+                return 1;
+            }
+        }
+    } else {
+        state.load(name, true);
+        values.resize(static_cast<size_t>(width) * height);
+        engine.render(state, width, height, values.data());
+    }
+    state.colormap.animation = true;
+
+    Equalization equalization(state);
+    if (state.colormap.equalize) {
+        equalization.add(values.data(), values.size(), engine.threads());
+        equalization.update();
+    }
+    ColorCycle color_cycle(Coloring(state), values.data(), values.size(),
+            state.colormap.equalize ? &equalization : NULL);
+    std::vector<unsigned char> rgbx(4 * values.size());
+    std::vector<unsigned char> rgb;
+    for (int frame = 0; frame < frames; frame++) {
+        color_cycle.apply(colormap_offset(state, frame / fps), rgbx.data(), engine.threads());
+        if (!write_frame(frame, rgbx, width, height, raw, prefix, rgb))
+            return 1;
+        fprintf(stderr, "\rFrame %d/%d", frame + 1, frames);
+    }
+    fprintf(stderr, "\n");
+    return 0;
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr, "Usage: %s [options] keyframe0.fract keyframe1.fract [...]\n"
+            "       %s [options] keyframes.fracts [...]\n"
+            "       %s [options] --cycle fractal.fract|buffer.iterbuf\n"
+            "Options:\n"
+            "  -w, --width=W        Frame width (default 1920)\n"
+            "  -h, --height=H       Frame height (default 1080)\n"
+            "  -n, --frames=N       Number of frames (default 300)\n"
+            "  -f, --fps=F          Frame rate, for color map animation (default 30)\n"
+            "  -t, --threads=T      Number of threads (default: one per core)\n"
+            "  -o, --output=PREFIX  Write PREFIX000000.png etc. (default frame-)\n"
+            "  -r, --raw            Write raw RGB24 frames to standard output\n"
+            "  -e, --expmap         Zoom into the center of the last keyframe using an\n"
+            "                       exponential map; much faster for deep zooms\n"
+            "  -c, --cycle          Animate the color map of a single fractal or iteration\n"
+            "                       buffer file; the fractal is computed only once\n",
+            argv0, argv0, argv0);
+}
+
+int main(int argc, char* argv[])
+{
+    int width = 1920;
+    int height = 1080;
+    int frames = 300;
+    double fps = 30.0;
+    int threads = 0;
+    QString prefix = "frame-";
+    bool raw = false;
+    bool expmap = false;
+    bool cycle_colormap = false;
+
+    const struct option options[] = {
+        { "width",   required_argument, NULL, 'w' },
+        { "height",  required_argument, NULL, 'h' },
+        { "frames",  required_argument, NULL, 'n' },
+        { "fps",     required_argument, NULL, 'f' },
+        { "threads", required_argument, NULL, 't' },
+        { "output",  required_argument, NULL, 'o' },
+        { "raw",     no_argument,       NULL, 'r' },
+        { "expmap",  no_argument,       NULL, 'e' },
+        { "cycle",   no_argument,       NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "w:h:n:f:t:o:rec", options, NULL)) != -1) {
+        switch (c) {
+        case 'w':
+            width = atoi(optarg);
+            break;
+        case 'h':
+            height = atoi(optarg);
+            break;
+        case 'n':
+            frames = atoi(optarg);
+            break;
+        case 'f':
+            fps = atof(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'o':
+            prefix = optarg;
+            break;
+        case 'r':
+            raw = true;
+            break;
+        case 'e':
+            expmap = true;
+            break;
+        case 'c':
+            cycle_colormap = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 1 || (cycle_colormap && argc - optind > 1) || width < 1 || height < 1 || frames < 1 || fps <= 0.0 || threads < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<State> keyframes;
+    for (int i = optind; i < argc; i++) {
+        QString name = argv[i];
+        if (!QFileInfo(name).isReadable()
+                || (!cycle_colormap && !SceneFile::load_all(name, keyframes))) {
+            fprintf(stderr, "%s is not readable\n", qPrintable(name));
+            return 1;
+        }
+    }
+    if (cycle_colormap)
+        return cycle(argv[optind], width, height, frames, fps, threads, raw, prefix);
+    if (keyframes.size() < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Everything that does not depend on the frame is set up only once:
+    // the engine, the colorings, and the buffers.
+    Engine engine(threads);
+    std::vector<Coloring> colorings;
+    for (size_t i = 0; i < keyframes.size(); i++)
+        colorings.push_back(Coloring(keyframes[i]));
+    std::vector<float> values(static_cast<size_t>(width) * height);
+    std::vector<unsigned char> rgbx(4 * values.size());
+    std::vector<unsigned char> rgb;
+
+    State state;
+    ExpMap* expmap_strip = NULL;
+    const int expmap_disc = 8; // radius in pixels
+    std::vector<float> disc_values;
+    size_t samples = 0;
+    if (expmap) {
+        state = keyframes.back();
+        // Choose the strip width so that its samples at the outer radius of a
+        // frame are as large as the pixels.
+        double radius_px = 0.5 * std::hypot(width, height);
+        int strip_width = std::ceil(2.0 * M_PI * radius_px);
+        __float128 x0, xw0, xw1, y0, yw;
+        state.navigation.zoom = keyframes.front().navigation.zoom;
+        state.region(width, height, &x0, &xw0, &y0, &yw);
+        state.navigation.zoom = keyframes.back().navigation.zoom;
+        state.region(width, height, &x0, &xw1, &y0, &yw);
+        double r0 = radius_px * static_cast<double>(std::max(xw0, xw1) / width);
+        expmap_strip = new ExpMap(engine, state, strip_width, r0);
+    }
+    for (int frame = 0; frame < frames; frame++) {
+        int k;
+        if (expmap) {
+            k = keyframes.size() - 1;
+            double t = (frames > 1 ? static_cast<double>(frame) / (frames - 1) : 0.0);
+            __float128 z0 = keyframes.front().navigation.zoom;
+            __float128 z1 = keyframes.back().navigation.zoom;
+            state.navigation.zoom = expq(logq(z0) + t * (logq(z1) - logq(z0)));
+            __float128 x0, xw, y0, yw;
+            state.region(width, height, &x0, &xw, &y0, &yw);
+            double pixel_size = xw / width;
+            double radius_px = 0.5 * std::hypot(width, height);
+            expmap_strip->update(std::floor(expmap_strip->row(radius_px * pixel_size)),
+                    std::ceil(expmap_strip->row(expmap_disc * pixel_size)) + 1);
+            int tx = std::max(0, width / 2 - expmap_disc - 1);
+            int ty = std::max(0, height / 2 - expmap_disc - 1);
+            int tw = std::min(width - tx, 2 * expmap_disc + 2);
+            int th = std::min(height - ty, 2 * expmap_disc + 2);
+            disc_values.resize(tw * th);
+            engine.render(state, width, height, tx, ty, tw, th, disc_values.data());
+            samples += disc_values.size();
+            for (int y = 0; y < height; y++) {
+                double dy = 0.5 * height - (y + 0.5);
+                for (int x = 0; x < width; x++) {
+                    double dx = (x + 0.5) - 0.5 * width;
+                    double r = std::hypot(dx, dy);
+                    float v;
+                    if (r < expmap_disc) {
+                        v = disc_values[(y - ty) * tw + (x - tx)];
+                    } else {
+                        double angle = std::atan2(dy, dx);
+                        if (angle < 0.0)
+                            angle += 2.0 * M_PI;
+                        v = expmap_strip->sample(expmap_strip->row(r * pixel_size), angle);
+                    }
+                    values[static_cast<size_t>(y) * width + x] = v;
+                }
+            }
+        } else {
+            k = interpolate(keyframes, frame, frames, &state);
+            engine.render(state, width, height, values.data());
+            samples += values.size();
+        }
+        // Each frame is equalized on its own, like in the GUI
+        Equalization equalization(state);
+        if (state.colormap.equalize) {
+            equalization.add(values.data(), values.size(), engine.threads());
+            equalization.update();
+        }
+        colorings[k].apply(colormap_offset(state, frame / fps), values.data(), values.size(), rgbx.data(),
+                state.colormap.equalize ? &equalization : NULL);
+        if (!write_frame(frame, rgbx, width, height, raw, prefix, rgb))
+            return 1;
+        fprintf(stderr, "\rFrame %d/%d", frame + 1, frames);
+    }
+    if (expmap_strip) {
+        samples += expmap_strip->samples;
+        delete expmap_strip;
+    }
+    fprintf(stderr, "\n%.1f samples per pixel\n",
+            static_cast<double>(samples) / (static_cast<double>(width) * height * frames));
+    return 0;
+}